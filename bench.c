@@ -0,0 +1,252 @@
+/* Gerador de carga para o servidor IMAP.
+ *
+ * Abre <Conexões> conexões simultâneas com o servidor, cada uma em um
+ * processo, e em cada uma faz LOGIN e repete <Iterações> vezes um SELECT
+ * seguido de um FETCH de todas as mensagens da caixa. No final imprime
+ * quantos comandos por segundo e quantos bytes por segundo o servidor
+ * conseguiu atender. Para comparar os backends de E/S basta rodar o
+ * mesmo teste contra o servidor iniciado com e sem a opção -u:
+ *
+ * ./ep1 8000 1 &
+ * ./bench 8000 50 100
+ * ./ep1 -u 8000 1 &
+ * ./bench 8000 50 100
+ *
+ * Com a opção -z cada conexão ativa o COMPRESS=DEFLATE logo depois do
+ * LOGIN, e também são impressos os bytes que passaram pela rede, para
+ * comparar a economia de banda com o custo da compressão no servidor:
+ *
+ * ./bench -z 8000 50 100
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#define MAXLINE 4096
+#define BUFSIZE 65536
+
+char const *user = "lmagno@ime.usp.br";
+char const *password = "password2";
+
+// Compressão da conexão deste processo e quantos bytes passaram pela
+// rede (comprimidos ou não)
+bool zon = false;
+z_stream zin, zout;
+long wire = 0;
+
+//========================================= FUNÇÕES =========================================
+long command(int fd, int tag, char const *cmd);
+void client(int port, int iterations, int out, bool compress);
+ssize_t conn_read(int fd, char *buf, size_t n);
+void conn_write(int fd, char const *data, size_t len);
+double now();
+
+int main(int argc, char **argv) {
+    int port, nconn, iterations, i;
+    int fds[2];
+    long bytes[2], total = 0, totalwire = 0;
+    double start, elapsed;
+    bool compress = false;
+
+    if(argc > 1 && !strcmp(argv[1], "-z")) {
+        compress = true;
+        argc--;
+        argv++;
+    }
+
+    if(argc != 4) {
+        fprintf(stderr, "Uso: %s [-z] <Porta> <Conexões> <Iterações>\n", argv[0]);
+        exit(1);
+    }
+
+    port = atoi(argv[1]);
+    nconn = atoi(argv[2]);
+    iterations = atoi(argv[3]);
+
+    // Cada cliente devolve pelo pipe quantos bytes recebeu, antes e
+    // depois da descompressão
+    if(pipe(fds) == -1) {
+        perror("pipe :(\n");
+        exit(2);
+    }
+
+    start = now();
+    for(i = 0; i < nconn; i++) {
+        if(fork() == 0) {
+            close(fds[0]);
+            client(port, iterations, fds[1], compress);
+            exit(0);
+        }
+    }
+    close(fds[1]);
+
+    while(read(fds[0], bytes, sizeof(bytes)) == sizeof(bytes)) {
+        total += bytes[0];
+        totalwire += bytes[1];
+    }
+    while(wait(NULL) > 0);
+    elapsed = now() - start;
+
+    printf("%d conexões, %d iterações: %.3f s\n", nconn, iterations, elapsed);
+    printf("%.0f comandos/s, %.2f MB/s\n", nconn*(2.0*iterations + 2 + compress)/elapsed, total/elapsed/1e6);
+    if(compress)
+        printf("%.2f MB/s na rede, %.1f%% do original\n", totalwire/elapsed/1e6, 100.0*totalwire/total);
+
+    return 0;
+}
+
+// Tempo atual em segundos
+double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Executa uma sessão completa e escreve em 'out' quantos bytes
+// foram recebidos
+void client(int port, int iterations, int out, bool compress) {
+    int fd, i, tag = 0;
+    long bytes[2] = {0, 0};
+    char cmd[MAXLINE+1];
+    struct sockaddr_in servaddr;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket :(\n");
+        exit(2);
+    }
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family      = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    servaddr.sin_port        = htons(port);
+    if(connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
+        perror("connect :(\n");
+        exit(3);
+    }
+
+    // Saudação do servidor
+    bytes[0] += command(fd, -1, NULL);
+
+    sprintf(cmd, "LOGIN %s %s", user, password);
+    bytes[0] += command(fd, tag++, cmd);
+
+    // A partir da resposta do COMPRESS tudo vai comprimido, em DEFLATE
+    // puro nos dois sentidos
+    if(compress) {
+        bytes[0] += command(fd, tag++, "COMPRESS DEFLATE");
+        if(inflateInit2(&zin, -15) != Z_OK || deflateInit2(&zout, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "zlib :(\n");
+            exit(5);
+        }
+        zon = true;
+    }
+
+    for(i = 0; i < iterations; i++) {
+        bytes[0] += command(fd, tag++, "SELECT INBOX");
+        bytes[0] += command(fd, tag++, "UID FETCH 1:* (UID RFC822.SIZE FLAGS BODY.PEEK[])");
+    }
+
+    bytes[0] += command(fd, tag++, "LOGOUT");
+    close(fd);
+
+    bytes[1] = wire;
+    write(out, bytes, sizeof(bytes));
+}
+
+// Envia o comando 'cmd' com a tag 'tag' e lê a resposta até a linha
+// com a mesma tag. Com tag negativa só lê a primeira linha (a saudação).
+// Retorna a quantidade de bytes recebidos
+long command(int fd, int tag, char const *cmd) {
+    char buf[BUFSIZE+1], line[MAXLINE+1], mark[32];
+    int n, keep = 0;
+    long bytes = 0;
+    char *p;
+
+    if(tag < 0) {
+        strcpy(mark, "* ");
+    } else {
+        sprintf(mark, "\na%d ", tag);
+        sprintf(line, "a%d %s\r\n", tag, cmd);
+        conn_write(fd, line, strlen(line));
+    }
+
+    // Lê até encontrar a linha marcada seguida de um fim de linha,
+    // guardando o final do bloco anterior para o caso da marca
+    // estar dividida entre dois blocos
+    buf[0] = '\n';
+    keep = 1;
+    for(;;) {
+        if((n = conn_read(fd, buf+keep, BUFSIZE-keep)) <= 0) {
+            fprintf(stderr, "Conexão fechada durante '%s'\n", cmd ? cmd : "saudação");
+            exit(4);
+        }
+        bytes += n;
+        n += keep;
+        buf[n] = 0;
+
+        if((p = tag < 0 ? strstr(buf+1, mark) : strstr(buf, mark)) != NULL && strstr(p+1, "\r\n") != NULL)
+            return bytes;
+
+        keep = (n < MAXLINE) ? n : MAXLINE;
+        memmove(buf, buf+n-keep, keep);
+    }
+}
+
+// Lê até 'n' bytes da conexão, descomprimindo se necessário
+ssize_t conn_read(int fd, char *buf, size_t n) {
+    static char raw[BUFSIZE];
+    ssize_t r;
+    int ret;
+
+    if(!zon) {
+        if((r = read(fd, buf, n)) > 0) wire += r;
+        return r;
+    }
+
+    zin.next_out = (Bytef*)buf;
+    zin.avail_out = n;
+    for(;;) {
+        if(zin.avail_in == 0) {
+            if((r = read(fd, raw, sizeof(raw))) <= 0) return r;
+            wire += r;
+            zin.next_in = (Bytef*)raw;
+            zin.avail_in = r;
+        }
+
+        ret = inflate(&zin, Z_SYNC_FLUSH);
+        if(ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Dados comprimidos inválidos\n");
+            exit(4);
+        }
+        if(zin.avail_out < n) return n - zin.avail_out;
+    }
+}
+
+// Escreve 'len' bytes na conexão, comprimindo se necessário
+void conn_write(int fd, char const *data, size_t len) {
+    char raw[MAXLINE+64];
+
+    if(!zon) {
+        write(fd, data, len);
+        return;
+    }
+
+    zout.next_in = (Bytef*)data;
+    zout.avail_in = len;
+    zout.next_out = (Bytef*)raw;
+    zout.avail_out = sizeof(raw);
+    deflate(&zout, Z_SYNC_FLUSH);
+    write(fd, raw, sizeof(raw) - zout.avail_out);
+}
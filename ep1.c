@@ -44,46 +44,180 @@
 #include <fts.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <poll.h>
 #include "imap.c"
 
-#define LISTENQ 1
+#define LISTENQ SOMAXCONN
 #define MAXDATASIZE 100
 #define MAXLINE 4096
+#define MAXEVENTS 256
+
+/* Operações do io_uring que não são de uma sessão: as esperas pelo
+ * inotify e pelo timerfd dos diários e os cancelamentos de leituras */
+#define URING_NOTIFY 1
+#define URING_CANCEL 2
+#define URING_FLUSH 3
+
+void session_command(session_t *session, char *line, size_t len);
+void session_frame(session_t *session);
+size_t session_cmdlen(session_t *session, char *data, size_t len, bool *refused);
+void session_accept(int listenfd, int epfd);
+void session_event(session_t *session, uint32_t events, int epfd);
+pid_t worker_start(int cpu, int port, int backlog);
+void worker(int cpu, int port, int backlog);
+void worker_epoll(int listenfd);
+void worker_uring(int listenfd);
+void session_uring(uring_t *ring, session_t *session);
+void notify_epoll(int epfd);
+void notify_uring(uring_t *ring);
+void commit_epoll(int epfd);
+void commit_uring(uring_t *ring);
+void uring_poll(uring_t *ring, int fd, unsigned long long data);
+int listen_socket(int port, int backlog);
 
 int main (int argc, char **argv) {
-   /* Os sockets. Um que será o socket que vai escutar pelas conexões
-    * e o outro que vai ser o socket específico de cada conexão */
-	int listenfd, connfd;
-   /* Informações sobre o socket (endereço e porta) ficam nesta struct */
-	struct sockaddr_in servaddr;
-   /* Retorno da função fork para saber quem é o processo filho e quem
-    * é o processo pai */
-   pid_t childpid;
-   /* Armazena linhas recebidas do cliente */
-	char	recvline[MAXLINE + 1];
-   /* Armazena o tamanho da string lida do cliente */
-   ssize_t  n;
+   /* Número de processos trabalhadores e tamanho da fila de conexões
+    * pendentes de cada um */
+   int nworkers, backlog = LISTENQ;
+   int port, opt, i, status;
+   /* PIDs dos processos trabalhadores, para que possam ser reiniciados
+    * caso algum termine */
+   pid_t *workers, pid;
 
    // Ignora SIGPIPE
    signal(SIGPIPE, SIG_IGN);
 
-	if (argc != 2) {
-      fprintf(stderr,"Uso: %s <Porta>\n",argv[0]);
-      fprintf(stderr,"Vai rodar um servidor de echo na porta <Porta> TCP\n");
+   // Escolhe os kernels de varredura de texto conforme a CPU
+   simd_init();
+
+   while ((opt = getopt(argc, argv, "b:ul:s:")) != -1) {
+      switch (opt) {
+         case 'b':
+            backlog = atoi(optarg);
+            break;
+         case 'u':
+            uring_on = true;
+            break;
+         case 'l':
+            log_level = atoi(optarg);
+            break;
+         case 's':
+            log_sample = atoi(optarg);
+            break;
+         default:
+            argc = 0;
+            break;
+      }
+   }
+
+	if (argc - optind < 1 || argc - optind > 2) {
+      fprintf(stderr,"Uso: %s [-u] [-b <Backlog>] [-l <Nível>] [-s <Amostra>] <Porta> [<Processos>]\n",argv[0]);
+      fprintf(stderr,"Vai rodar um servidor IMAP na porta <Porta> TCP com <Processos>\n");
+      fprintf(stderr,"processos trabalhadores (padrão: um por CPU) e uma fila de\n");
+      fprintf(stderr,"<Backlog> conexões pendentes por processo (padrão: %d).\n", LISTENQ);
+      fprintf(stderr,"Com -u a E/S é feita pelo io_uring, se disponível\n");
+      fprintf(stderr,"O log mostra erros (-l 0), conexões (-l 1, padrão) ou também\n");
+      fprintf(stderr,"o protocolo (-l 2) de uma a cada <Amostra> sessões (padrão: 1)\n");
 		exit(1);
 	}
 
+   port = atoi(argv[optind]);
+   if (argc - optind == 2)
+      nworkers = atoi(argv[optind+1]);
+   else
+      nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+   if (nworkers < 1) nworkers = 1;
+   if (backlog < 1) backlog = LISTENQ;
+   if (log_sample < 1) log_sample = 1;
+
+   printf("[Servidor no ar. Aguardando conexoes na porta %d]\n", port);
+   printf("[%d processos trabalhadores, backlog %d, E/S com %s, kernels %s]\n", nworkers, backlog, uring_on ? "io_uring" : "epoll", simd.name);
+   printf("[Para finalizar, pressione CTRL+c ou rode um kill ou killall]\n");
+   fflush(stdout);
+
+   /* Os processos trabalhadores são criados de antemão, cada um
+    * preso a uma CPU e com seu próprio socket de escuta na mesma
+    * porta (SO_REUSEPORT). Assim o kernel distribui as novas conexões
+    * entre as filas de cada processo, sem que todos acordem a cada
+    * conexão nova */
+   workers = (pid_t*)malloc(nworkers*sizeof(pid_t));
+   for (i = 0; i < nworkers; i++)
+      workers[i] = worker_start(i, port, backlog);
+
+   /* O processo pai só acompanha os trabalhadores, reiniciando os que
+    * terminarem inesperadamente */
+	for (;;) {
+      if ((pid = wait(&status)) == -1) {
+         if (errno == EINTR) continue;
+         perror("wait :(\n");
+         exit(6);
+      }
+
+      for (i = 0; i < nworkers; i++) {
+         if (workers[i] != pid) continue;
+
+         fprintf(stderr, "[Processo %d terminou, reiniciando]\n", pid);
+         sleep(1);
+         workers[i] = worker_start(i, port, backlog);
+      }
+	}
+	exit(0);
+}
+
+// Cria o processo trabalhador de índice 'cpu'
+pid_t worker_start(int cpu, int port, int backlog) {
+   pid_t pid;
+
+   fflush(stdout);
+   if ((pid = fork()) == -1) {
+      perror("fork :(\n");
+      exit(5);
+   }
+
+   if (pid == 0) {
+      // O trabalhador termina junto com o processo pai
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      worker(cpu, port, backlog);
+      exit(0);
+   }
+
+   return pid;
+}
+
+// Cria um socket de escuta na porta 'port', compartilhada com os
+// outros processos trabalhadores
+int listen_socket(int port, int backlog) {
+   /* O socket que vai escutar pelas conexões */
+	int listenfd, on = 1;
+   /* Informações sobre o socket (endereço e porta) ficam nesta struct */
+	struct sockaddr_in servaddr;
+
    /* Criação de um socket. Eh como se fosse um descritor de arquivo. Eh
     * possivel fazer operacoes como read, write e close. Neste
     * caso o socket criado eh um socket IPv4 (por causa do AF_INET),
     * que vai usar TCP (por causa do SOCK_STREAM), já que o IMAP
     * funciona sobre TCP, e será usado para uma aplicação convencional sobre
-    * a Internet (por causa do número 0) */
-	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    * a Internet (por causa do número 0). Ele é não-bloqueante, já que
+    * um único processo atende várias conexões */
+	if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
 		perror("socket :(\n");
 		exit(2);
 	}
 
+   /* Cada processo trabalhador tem seu próprio socket na mesma porta.
+    * Com SO_REUSEPORT o kernel mantém uma fila de conexões para cada
+    * um e distribui as conexões novas entre elas */
+   if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1 ||
+       setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+		perror("setsockopt :(\n");
+		exit(2);
+   }
+
    /* Agora é necessário informar os endereços associados a este
     * socket. É necessário informar o endereço / interface e a porta,
     * pois mais adiante o socket ficará esperando conexões nesta porta
@@ -92,12 +226,12 @@ int main (int argc, char **argv) {
     * caso AF_INET porque é IPv4), em qual endereço / interface serão
     * esperadas conexões (Neste caso em qualquer uma -- INADDR_ANY) e
     * qual a porta. Neste caso será a porta que foi passada como
-    * argumento no shell (atoi(argv[1]))
+    * argumento no shell
     */
 	bzero(&servaddr, sizeof(servaddr));
 	servaddr.sin_family      = AF_INET;
 	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	servaddr.sin_port        = htons(atoi(argv[1]));
+	servaddr.sin_port        = htons(port);
 	if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
 		perror("bind :(\n");
 		exit(3);
@@ -107,232 +241,613 @@ int main (int argc, char **argv) {
    /* Como este código é o código de um servidor, o socket será um
     * socket passivo. Para isto é necessário chamar a função listen
     * que define que este é um socket de servidor que ficará esperando
-    * por conexões nos endereços definidos na função bind. */
-	if (listen(listenfd, LISTENQ) == -1) {
+    * por conexões nos endereços definidos na função bind. O backlog é
+    * o tamanho da fila de conexões completas ainda não aceitas */
+	if (listen(listenfd, backlog) == -1) {
 		perror("listen :(\n");
 		exit(4);
 	}
 
-   printf("[Servidor no ar. Aguardando conexoes na porta %s]\n",argv[1]);
-   printf("[Para finalizar, pressione CTRL+c ou rode um kill ou killall]\n");
+   return listenfd;
+}
+
+// Processo trabalhador
+void worker(int cpu, int port, int backlog) {
+   int listenfd;
+   cpu_set_t cpus;
+
+   /* Prende o processo a uma CPU, para que as conexões que ele atende
+    * fiquem sempre no mesmo cache */
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+   if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+      perror("sched_setaffinity :(\n");
+
+   /* O log de cada trabalhador é escrito por uma thread própria */
+   log_init();
+
+   listenfd = listen_socket(port, backlog);
+
+   /* As mudanças nas caixas das sessões em IDLE são avisadas por um
+    * inotify próprio do trabalhador, e as flags alteradas por ele são
+    * gravadas nos nomes dos arquivos quando o seu timerfd avisar */
+   notify_init();
+   flush_init();
 
-   /* O servidor no final das contas é um loop infinito de espera por
-    * conexões e processamento de cada uma individualmente */
+   cmdtable_init(&commands, command_list, sizeof(command_list)/sizeof(cmdinfo_t));
+   cmdtable_init(&uid_commands, uid_list, sizeof(uid_list)/sizeof(cmdinfo_t));
+
+   if (uring_on)
+      worker_uring(listenfd);
+   else
+      worker_epoll(listenfd);
+}
+
+// Loop de eventos com epoll
+void worker_epoll(int listenfd) {
+   /* O descritor do epoll, que acompanha todas as conexões abertas ao
+    * mesmo tempo */
+   int epfd;
+   /* Eventos devolvidos pelo epoll a cada iteração */
+   struct epoll_event ev, events[MAXEVENTS];
+   int nev, i;
+
+   /* Todas as conexões são registradas em uma única instância do
+    * epoll, que avisa quais sockets têm dados prontos para serem lidos.
+    * O socket de escuta é identificado por um ponteiro nulo, o inotify
+    * e o timerfd pelos endereços dos seus descritores e os de cada
+    * cliente pela sua sessão */
+   if ((epfd = epoll_create1(0)) == -1) {
+      perror("epoll_create1 :(\n");
+      exit(5);
+   }
+
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+      perror("epoll_ctl :(\n");
+      exit(5);
+   }
+
+   ev.data.ptr = &notify_fd;
+   if (notify_fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, notify_fd, &ev) == -1) {
+      perror("epoll_ctl :(\n");
+      exit(5);
+   }
+
+   ev.data.ptr = &flush_fd;
+   if (flush_fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, flush_fd, &ev) == -1) {
+      perror("epoll_ctl :(\n");
+      exit(5);
+   }
+
+   /* O processo trabalhador no final das contas é um loop infinito de
+    * espera por eventos e processamento de cada um individualmente. Com
+    * APPENDs esperando o fsync em grupo, a espera não bloqueia */
 	for (;;) {
-      /* O socket inicial que foi criado é o socket que vai aguardar
-       * pela conexão na porta especificada. Mas pode ser que existam
-       * diversos clientes conectando no servidor. Por isso deve-se
-       * utilizar a função accept. Esta função vai retirar uma conexão
-       * da fila de conexões que foram aceitas no socket listenfd e
-       * vai criar um socket específico para esta conexão. O descritor
-       * deste novo socket é o retorno da função accept. */
-		if ((connfd = accept(listenfd, (struct sockaddr *) NULL, NULL)) == -1 ) {
-			perror("accept :(\n");
-			exit(5);
-		}
-
-
-      /* Agora o servidor precisa tratar este cliente de forma
-       * separada. Para isto é criado um processo filho usando a
-       * função fork. O processo vai ser uma cópia deste. Depois da
-       * função fork, os dois processos (pai e filho) estarão no mesmo
-       * ponto do código, mas cada um terá um PID diferente. Assim é
-       * possível diferenciar o que cada processo terá que fazer. O
-       * filho tem que processar a requisição do cliente. O pai tem
-       * que voltar no loop para continuar aceitando novas conexões */
-      /* Se o retorno da função fork for zero, é porque está no
-       * processo filho. */
-      if ( (childpid = fork()) == 0) {
-         /**** PROCESSO FILHO ****/
-         printf("[Uma conexao aberta]\n");
-         /* Já que está no processo filho, não precisa mais do socket
-          * listenfd. Só o processo pai precisa deste socket. */
-         close(listenfd);
-
-         /* Agora pode ler do socket e escrever no socket. Isto tem
-          * que ser feito em sincronia com o cliente. Não faz sentido
-          * ler sem ter o que ler. Ou seja, neste caso está sendo
-          * considerado que o cliente vai enviar algo para o servidor.
-          * O servidor vai processar o que tiver sido enviado e vai
-          * enviar uma resposta para o cliente (Que precisará estar
-          * esperando por esta resposta)
-          */
-
-         /* ========================================================= */
-         /* ========================================================= */
-         /*                         EP1 INÍCIO                        */
-         /* ========================================================= */
-         /* ========================================================= */
-         /* TODO: É esta parte do código que terá que ser modificada
-          * para que este servidor consiga interpretar comandos IMAP  */
-
-
-        char *token;
-        char *saveptr;
-        char *c; // ponteiro para a posição equivalente de 'input' em 'recvline'
-        char input[MAXLINE+1];
-        char resp[MAXLINE+1];
-        cmd_t cmd;
-        session_t session = {getpid(), connfd, NULL, NOTAUTHENTICATED};
-
-        respond("*", "OK", "[CAPABILITY IMAP4rev1]", &session);
-        while ((n=read(session.connfd, recvline, MAXLINE)) > 0) {
-            recvline[n]=0;
-
-            printf("%d C: %s", session.pid, recvline);
-
-            // Termina o IDLE
-            if(!strncmp(recvline, "DONE", 4)) {
-                session.idle = false;
-
-                respond(session.idletag, "OK", "IDLE Completed", &session);
-                continue;
-            }
+      if ((nev = epoll_wait(epfd, events, MAXEVENTS, ncommit > 0 ? 0 : -1)) == -1) {
+         if (errno == EINTR) continue;
+         perror("epoll_wait :(\n");
+         exit(6);
+      }
+
+      for (i = 0; i < nev; i++) {
+         if (events[i].data.ptr == NULL)
+            session_accept(listenfd, epfd);
+         else if (events[i].data.ptr == &notify_fd)
+            notify_epoll(epfd);
+         else if (events[i].data.ptr == &flush_fd)
+            flush_event();
+         else
+            session_event(events[i].data.ptr, events[i].events, epfd);
+      }
+
+      /* Os APPENDs terminados nesta iteração vão juntos para o disco */
+      commit_epoll(epfd);
+	}
+}
 
-            // Copia a linha para manter uma cópia intacta
-            strcpy(input, recvline);
-            c = recvline;
+// Loop de eventos com io_uring. Em vez de esperar os sockets ficarem
+// prontos, as próprias leituras, envios e aceites são enfileirados no
+// anel, e todas as operações geradas em uma iteração são enviadas ao
+// kernel em uma única chamada de sistema
+void worker_uring(int listenfd) {
+   uring_t ring;
+   struct io_uring_cqe *cqe;
+   session_t *session;
+   unsigned long long data;
+   int res;
+
+   if (uring_init(&ring, MAXEVENTS) == -1) {
+      fprintf(stderr, "[io_uring indisponível, usando epoll]\n");
+      uring_on = false;
+      worker_epoll(listenfd);
+      return;
+   }
+
+   /* O io_uring espera os sockets ficarem prontos por conta própria,
+    * então eles podem ser bloqueantes */
+   fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) & ~O_NONBLOCK);
+
+   /* O aceite de conexões é identificado por um ponteiro nulo, e as
+    * operações de cada cliente pela sua sessão */
+   uring_sqe(&ring, IORING_OP_ACCEPT, listenfd, NULL, 0, 0, 0);
+   uring_poll(&ring, notify_fd, URING_NOTIFY);
+   uring_poll(&ring, flush_fd, URING_FLUSH);
 
-            // struct que vai guardar a linha recebida
-            cmdline_t cmdline;
+	for (;;) {
+      uring_submit(&ring, ncommit > 0 ? 0 : 1);
 
+      while ((cqe = uring_cqe(&ring)) != NULL) {
+         data = cqe->user_data;
+         session = (session_t*)data;
+         res = cqe->res;
+         uring_seen(&ring);
 
+         if (data == URING_CANCEL)
+            continue;
 
-            // Registra a tag da linha
-            token = strtok_r(input, " \t\n\r", &saveptr);
-            strcpy(cmdline.tag, token);
-            c += strlen(token);
+         if (data == URING_NOTIFY) {
+            notify_uring(&ring);
+            continue;
+         }
 
-            // Identifica o comando
-            token = strtok_r(NULL, " \t\n\r", &saveptr);
-            c += strlen(token)+1;
+         if (data == URING_FLUSH) {
+            flush_event();
+            uring_poll(&ring, flush_fd, URING_FLUSH);
+            continue;
+         }
 
-            cmd = findcmd(uppercase(token));
-            if(cmd == -1) {
-                sprintf(resp, "%s Comando inválido", token);
-                respond(cmdline.tag, "BAD", resp, &session);
-                continue;
-            } else if ((int)cmd > (int)session.state) {
-                sprintf(resp, "%s Comando não permitido", token);
-                respond(cmdline.tag, "BAD", resp, &session);
-                continue;
-            } else {
-                cmdline.cmd = cmd;
+         if (session == NULL) {
+            // Conexão nova
+            uring_sqe(&ring, IORING_OP_ACCEPT, listenfd, NULL, 0, 0, 0);
+            if (res < 0) continue;
+
+            session = session_new(res);
+            log_printf(LOG_INFO, "[Uma conexao aberta]\n");
+            respond("*", "OK", "[CAPABILITY " CAPABILITIES "]", session);
+         } else if (res == -ECANCELED && session->cancelling) {
+            /* A leitura foi cancelada para enviar as respostas do IDLE */
+         } else if (res <= 0) {
+            // Conexão fechada pelo cliente ou com erro
+            log_printf(LOG_INFO, "[Uma conexao fechada]\n");
+            session_free(session);
+            continue;
+         } else if (session->sending) {
+            /* Parte da resposta foi enviada. Quando ela termina, os
+             * comandos que esperavam no buffer são executados */
+            out_sent(&session->out, res);
+            if (session->out.sent == session->out.len) {
+               session->sending = false;
+               session_frame(session);
+            }
+         } else if (session->zin) {
+            // Dados recebidos comprimidos
+            session->zraw.len += res;
+            if (session_inflate(session) == -1) {
+               log_printf(LOG_INFO, "[Uma conexao fechada]\n");
+               session_free(session);
+               continue;
             }
+            session_frame(session);
+         } else {
+            // Dados recebidos
+            session->in.len += res;
+            session_frame(session);
+         }
 
+         session_uring(&ring, session);
+      }
 
-            // Lê o restante dos argumentos
-            int i = 0, j;
-            int par;
-            while((token = strtok_r(NULL, " \t\n\r", &saveptr)) != NULL) {
-                strcpy(cmdline.argv[i++], token);
-                c += strlen(token)+1;
-
-                // Verifica se existe um abre parênteses,
-                // nesse caso tudo até o próximo fecha parênteses
-                // é um único argumento
-                if((saveptr != NULL) && saveptr[0] == '(') {
-                    // Encontra o próximo ')'
-                    // "par" indica a diferença entre '(' e ')' encontrados
-                    par = 1;
-                    j = 0;
-                    while(par != 0) {
-                        j++;
-                        if(saveptr[j] == '(') par++;
-                        else if(saveptr[j] == ')') par--;
-                    }
-                    // Salva o bloco input[saveptr, ..., saveptr+(j-1)) como argumento
-                    saveptr[j] = 0;
-                    strcpy(cmdline.argv[i++], saveptr+1);
-                    c += j;
-                    // Reinicia o token
-                    saveptr += j+1;
-                }
+      commit_uring(&ring);
+	}
+}
 
-            }
+// Enfileira a próxima operação da sessão: o envio do restante da
+// resposta, se houver, ou a leitura do próximo comando. Cada sessão
+// tem no máximo uma operação em andamento
+void session_uring(uring_t *ring, session_t *session) {
+   buf_t *in = session->zin ? &session->zraw : &session->in;
+
+   session->cancelling = false;
+   session_deflate(session, Z_SYNC_FLUSH);
+   if (session->out.sent < session->out.len) {
+      /* Todos os trechos pendentes da resposta vão em um único envio */
+      session->sending = true;
+      session->hdr.msg_iov = session->iov;
+      session->hdr.msg_iovlen = out_iov(&session->out, session->iov, OUTIOV);
+      uring_sqe(ring, IORING_OP_SENDMSG, session->connfd, &session->hdr, 1, 0, (unsigned long long)session);
+      return;
+   }
+
+   session->sending = false;
+
+   if (session->state == LOGOUT_s) {
+      log_printf(LOG_INFO, "[Uma conexao fechada]\n");
+      session_free(session);
+      return;
+   }
+
+   buf_reserve(in, MAXLINE);
+   uring_sqe(ring, IORING_OP_RECV, session->connfd, in->data + in->len,
+             in->cap - in->len, 0, (unsigned long long)session);
+}
 
-            cmdline.argc = i;
+// Envia as mudanças avisadas pelo inotify às sessões em IDLE. Uma
+// sessão encerrada sai da lista trocando de lugar com a última, que
+// já foi vista
+void notify_epoll(int epfd) {
+   int i;
+
+   notify_event();
+   for (i = nidlers-1; i >= 0; i--) {
+      if (!idlers[i]->pushed) continue;
+      idlers[i]->pushed = false;
+      session_event(idlers[i], 0, epfd);
+   }
+}
 
-            // Decide o que fazer dependendo do comando
-            switch(cmdline.cmd) {
-                case AUTHENTICATE:
-                    respond(cmdline.tag, "NO", "AUTHENTICATE Comando não implementado", &session);
-                    break;
+// Como notify_epoll, mas as sessões em IDLE estão esperando uma
+// leitura, que é cancelada para que as respostas sejam enviadas quando
+// o cancelamento terminar. Uma sessão enviando algo envia as respostas
+// em seguida. A espera pelo inotify é renovada no final
+void notify_uring(uring_t *ring) {
+   int i;
+
+   notify_event();
+   for (i = 0; i < nidlers; i++) {
+      if (!idlers[i]->pushed) continue;
+      idlers[i]->pushed = false;
+      if (idlers[i]->sending || idlers[i]->cancelling) continue;
+      if (uring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, idlers[i], 0, 0, URING_CANCEL) != NULL)
+         idlers[i]->cancelling = true;
+   }
+
+   uring_poll(ring, notify_fd, URING_NOTIFY);
+}
 
-                case LOGIN:
-                    cmd_login(cmdline, &session);
-                    break;
+// Faz o fsync em grupo dos APPENDs terminados e volta a atender as
+// sessões deles: envia as confirmações e executa os comandos que
+// esperavam no buffer
+void commit_epoll(int epfd) {
+   int i;
 
-                case LIST:
-                    cmd_list(cmdline, &session);
-                    break;
+   if (ncommit == 0) return;
+   append_commit();
+   for (i = 0; i < ncommitted; i++)
+      session_event(committed[i], 0, epfd);
+}
 
-                case LSUB:
-                    respond("*", "LSUB", "() \"\" INBOX", &session);
-                    respond(cmdline.tag, "OK", "LSUB completado.", &session);
-                    break;
+// Como commit_epoll, mas a leitura pendente de cada sessão é cancelada,
+// como no IDLE, para que a confirmação seja enviada quando o
+// cancelamento terminar. Uma sessão enviando algo executa os comandos
+// seguintes quando o envio terminar
+void commit_uring(uring_t *ring) {
+   int i;
+
+   if (ncommit == 0) return;
+   append_commit();
+   for (i = 0; i < ncommitted; i++) {
+      if (committed[i]->sending || committed[i]->cancelling) continue;
+      if (uring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, committed[i], 0, 0, URING_CANCEL) != NULL)
+         committed[i]->cancelling = true;
+   }
+}
 
-                case SELECT:
-                    cmd_select(cmdline, &session);
-                    break;
+// Espera o descritor 'fd' ter algo para ler, se ele existir
+void uring_poll(uring_t *ring, int fd, unsigned long long data) {
+   struct io_uring_sqe *sqe;
 
-                case UID:
-                    cmd_uid(cmdline, &session);
-                    break;
+   if (fd != -1 && (sqe = uring_sqe(ring, IORING_OP_POLL_ADD, fd, NULL, 0, 0, data)) != NULL)
+      sqe->poll32_events = POLLIN;
+}
 
-                case LOGOUT:
-                    respond("*", "BYE", "LOGOUT", &session);
-                    respond(cmdline.tag, "OK", "LOGOUT", &session);
+// Aceita todas as conexões pendentes no socket de escuta,
+// criando uma sessão para cada uma
+void session_accept(int listenfd, int epfd) {
+    int connfd;
+    struct epoll_event ev;
+    session_t *session;
+
+    for(;;) {
+        /* A função accept retira uma conexão da fila de conexões que
+         * foram aceitas no socket listenfd e cria um socket específico
+         * para ela. Como o socket de escuta é não-bloqueante, quando a
+         * fila estiver vazia accept retorna EAGAIN */
+        if((connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept :(\n");
+            return;
+        }
 
-                    break;
+        session = session_new(connfd);
 
-                case FETCH:
-                    cmd_fetch(cmdline, &session);
-                    break;
+        log_printf(LOG_INFO, "[Uma conexao aberta]\n");
+        respond("*", "OK", "[CAPABILITY " CAPABILITIES "]", session);
+        session_flush(session);
 
-                case STORE:
-                    cmd_store(cmdline, &session);
-                    break;
+        ev.events = session->events = session->sending ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = session;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+            perror("epoll_ctl :(\n");
+            session_free(session);
+        }
+    }
+}
 
-                case IDLE:
-                    session.idle = true;
-                    strcpy(session.idletag, cmdline.tag);
-                    respond("+", "idling", NULL, &session);
-                    break;
+// Trata os eventos de uma sessão: lê o que estiver disponível no
+// socket, executa os comandos recebidos e envia todas as respostas
+// juntas. Se o socket encher, o restante das respostas espera ele
+// poder ser escrito de novo, e os comandos seguintes esperam no buffer.
+// A sessão é encerrada se o cliente fechar a conexão ou depois de um
+// LOGOUT
+void session_event(session_t *session, uint32_t events, int epfd) {
+    /* Armazena o tamanho da string lida do cliente */
+    ssize_t n;
+    buf_t *in = &session->in;
+    struct epoll_event ev;
+    bool closed = false;
+
+    // Com compressão os dados são lidos para 'zraw' e descomprimidos
+    if(session->zin) in = &session->zraw;
+
+    if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        // O literal de um APPEND vai do socket direto para o arquivo,
+        // se não houver nada antes dele no buffer
+        if(session->appendleft > 0 && in->len == 0 && !session->zin && append_splice(session) == -1) {
+            closed = true;
+        } else {
+            buf_reserve(in, MAXLINE);
+            n = read(session->connfd, in->data + in->len, in->cap - in->len);
+            if(n > 0)
+                in->len += n;
+            else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                closed = true;
+        }
+    }
+    if(!closed && session->zin && session_inflate(session) == -1)
+        closed = true;
+
+    // Termina de enviar as respostas anteriores antes de executar os
+    // próximos comandos
+    if(!closed && session_flush(session) == -1)
+        closed = true;
+    if(!closed) {
+        session_frame(session);
+        closed = (session_flush(session) == -1);
+    }
+
+    if(!closed && (session->state != LOGOUT_s || session->sending)) {
+        // Espera o socket poder ser escrito se sobrou resposta
+        ev.events = session->sending ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = session;
+        if(ev.events != session->events && epoll_ctl(epfd, EPOLL_CTL_MOD, session->connfd, &ev) == 0)
+            session->events = ev.events;
+        return;
+    }
+
+    /* Após ter feito toda a troca de informação com o cliente,
+     * pode finalizar a sessão */
+    log_printf(LOG_INFO, "[Uma conexao fechada]\n");
+    epoll_ctl(epfd, EPOLL_CTL_DEL, session->connfd, NULL);
+    session_free(session);
+}
 
-                case NOOP:
-                    respond(cmdline.tag, "OK", "NOOP Completed", &session);
-                    break;
+// Executa todos os comandos completos do buffer de entrada da sessão,
+// de forma que o cliente possa enviar vários comandos de uma vez sem
+// esperar as respostas. Um comando incompleto fica no buffer até que o
+// restante chegue nas próximas leituras. O literal de um APPEND é
+// gravado no arquivo assim que chega, e os comandos depois dele esperam
+// o fsync em grupo
+void session_frame(session_t *session) {
+    buf_t *in = &session->in;
+    char *nl;
+    size_t pos = 0, len;
+    bool refused;
+
+    while(pos < in->len && session->state != LOGOUT_s && !session->sending && !session->committing) {
+        // Respostas que apontam para os dados da sessão (como o texto
+        // das mensagens) são enviadas antes do próximo comando, que
+        // pode alterá-los
+        if(session_queue(session)->refs > 0 && (uring_on || session_flush(session) == -1 || session->sending))
+            break;
+
+        // Conteúdo de uma mensagem do APPEND
+        if(session->appendleft > 0) {
+            len = in->len - pos;
+            if(len > session->appendleft) len = session->appendleft;
+            append_data(session, in->data + pos, len);
+            pos += len;
+            continue;
+        }
 
-                default:
-                    // Comando não implementado
-                    respond("BAD", commands[cmdline.cmd], "Comando não implementado.", &session);
-                    break;
+        // Restante da linha do APPEND depois do literal
+        if(session->appending) {
+            if((nl = memchr(in->data + pos, '\n', in->len - pos)) == NULL) {
+                if(in->len - pos > MAXLINE) {
+                    append_fail(session, "BAD", "Linha muito longa", 0, true);
+                    session->discard = true;
+                    pos = in->len;
+                }
+                break;
             }
+            len = nl - (in->data + pos) + 1;
+            append_next(session, in->data + pos, len);
+            pos += len;
+            continue;
+        }
 
+        // Descarta o literal de um comando recusado
+        if(session->skip > 0) {
+            len = in->len - pos;
+            if(len > session->skip) len = session->skip;
+            session->skip -= len;
+            pos += len;
+            continue;
         }
-         /* ========================================================= */
-         /* ========================================================= */
-         /*                         EP1 FIM                           */
-         /* ========================================================= */
-         /* ========================================================= */
-
-         /* Após ter feito toda a troca de informação com o cliente,
-          * pode finalizar o processo filho */
-         printf("[Uma conexao fechada]\n");
-         int i;
-         for(i = 0; i < session.exists; i++) {
-             free(session.messages[i].text);
-             free(session.messages[i].header);
-         }
-         close(session.connfd);
-         exit(0);
-      }
-      /**** PROCESSO PAI ****/
-      /* Se for o pai, a única coisa a ser feita é fechar o socket
-       * connfd (ele é o socket do cliente específico que será tratado
-       * pelo processo filho) */
-	   close(connfd);
-	}
-	exit(0);
+
+        // Descarta o restante de um comando recusado
+        if(session->discard) {
+            if((nl = memchr(in->data + pos, '\n', in->len - pos)) == NULL) {
+                pos = in->len;
+                break;
+            }
+            pos = nl - in->data + 1;
+            session->discard = false;
+            continue;
+        }
+
+        if((len = session_cmdlen(session, in->data + pos, in->len - pos, &refused)) == 0)
+            break;
+
+        if(!refused)
+            session_command(session, in->data + pos, len);
+        session->cont = 0;
+        pos += len;
+
+        // Um APPEND recusado antes de começar ainda recebe o literal, se
+        // ele não for síncrono, que é descartado
+        if(session->cmdline.literal > 0) {
+            if(!session->cmdline.sync) {
+                session->skip = session->cmdline.literal;
+                session->discard = true;
+            }
+            session->cmdline.literal = -1;
+        }
+
+        // Depois do COMPRESS, o restante do buffer já chegou comprimido
+        if(session->zstart) {
+            session->zstart = false;
+            buf_append(&session->zraw, in->data + pos, in->len - pos);
+            in->len = pos;
+            if(session_inflate(session) == -1) {
+                session->state = LOGOUT_s;
+                break;
+            }
+        }
+    }
+
+    // Guarda o comando incompleto no começo do buffer
+    in->len -= pos;
+    memmove(in->data, in->data + pos, in->len);
+}
+
+// Retorna o tamanho do comando completo que começa em 'data', incluindo
+// os literais e o fim de linha, ou 0 se ele ainda não chegou inteiro.
+// Se o comando for recusado (linha ou literal grande demais) ele é
+// descartado e 'refused' é marcado
+size_t session_cmdlen(session_t *session, char *data, size_t len, bool *refused) {
+    char tag[MAXLINE+1], *line, *nl, *tail;
+    size_t pos = 0, n, size;
+    bool sync;
+
+    *refused = false;
+    for(;;) {
+        line = data + pos;
+        nl = memchr(line, '\n', len - pos);
+        n = nl ? (size_t)(nl - line + 1) : len - pos;
+
+        if(n > MAXLINE) {
+            // Linha grande demais. Se ainda não terminou, o restante
+            // é descartado quando chegar
+            respond("*", "BAD", "Linha muito longa", session);
+            *refused = true;
+            session->discard = (nl == NULL);
+            return pos + n;
+        }
+
+        if(nl == NULL) return 0;
+        pos += n;
+
+        // Verifica se a linha termina com o cabeçalho de um literal
+        if((tail = literal_tail(line, n, &size, &sync)) == NULL)
+            return pos;
+
+        // O literal da primeira mensagem de um APPEND não espera no
+        // buffer: o comando é executado antes e recebe o literal
+        if(pos == n && append_cmd(line, tail))
+            return pos;
+
+        if(size > MAXLITERAL) {
+            sscanf(data, "%s", tag);
+            respond(tag, "NO", "Literal muito grande", session);
+            *refused = true;
+
+            // Sem a confirmação o cliente não envia um literal
+            // síncrono, mas envia um não-síncrono logo em seguida
+            if(!sync) {
+                session->skip = size;
+                session->discard = true;
+            }
+            return pos;
+        }
+
+        if(len - pos < size) {
+            // Pede o literal ao cliente, uma única vez
+            if(sync && session->cont < pos) {
+                respond("+", "Pronto para o literal", NULL, session);
+                session->cont = pos;
+            }
+            return 0;
+        }
+
+        pos += size;
+    }
+}
+
+// Interpreta uma linha de comando IMAP recebida do cliente
+// e responde de acordo
+void session_command(session_t *session, char *line, size_t len) {
+    char resp[MAXLINE+1], *tail;
+    cmdinfo_t const *cmd;
+    cmdline_t *cmdline = &session->cmdline;
+    size_t size;
+
+    if(session->trace)
+        log_data(session->id, "C", line, len);
+
+    // Um APPEND chega só com o cabeçalho do literal, que fica de fora
+    // dos argumentos
+    cmdline->literal = -1;
+    if((tail = literal_tail(line, len, &size, &cmdline->sync)) != NULL) {
+        cmdline->literal = size;
+        *tail = 0;
+        len = tail - line;
+    }
+
+    // Termina o IDLE
+    if(session->idle && !strncasecmp(line, "DONE", 4)) {
+        idle_del(session);
+
+        respond(session->idletag, "OK", "IDLE Completed", session);
+        return;
+    }
+
+    // Separa a tag, o comando e os argumentos
+    if(parse_cmdline(cmdline, line, len) == -1) {
+        respond(cmdline->tag ? cmdline->tag : "*", "BAD", "Comando mal formado", session);
+        return;
+    }
+
+    if(cmdline->tag == NULL) return;
+    if(cmdline->name == NULL) {
+        respond(cmdline->tag, "BAD", "Comando ausente", session);
+        return;
+    }
+
+    // Identifica o comando
+    if((cmd = findcmd(&commands, cmdline->name)) == NULL) {
+        sprintf(resp, "%s Comando inválido", cmdline->name);
+        respond(cmdline->tag, "BAD", resp, session);
+    } else if(!(cmd->states & (1 << session->state))) {
+        sprintf(resp, "%s Comando não permitido", cmd->name);
+        respond(cmdline->tag, "BAD", resp, session);
+    } else if(cmd->fn == NULL) {
+        sprintf(resp, "%s Comando não implementado.", cmd->name);
+        respond(cmdline->tag, "BAD", resp, session);
+    } else {
+        cmdline->cmd = cmd->cmd;
+        cmdline->uid = false;
+        cmd->fn(cmdline, session);
+    }
 }
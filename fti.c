@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+// Índice invertido do texto das mensagens, para o SEARCH
+//
+// O texto de uma mensagem, para a busca, é o seu cabeçalho seguido do
+// corpo das partes de texto (decodificado do base64 ou quoted-printable)
+// e do cabeçalho das mensagens anexadas; as partes que não são texto
+// ficam de fora. Uma palavra é uma sequência de letras e dígitos ASCII
+// e bytes acima de 127, sem diferenciar maiúsculas. O índice diz em
+// quais mensagens cada palavra aparece, o que reduz uma busca às
+// mensagens que têm todas as palavras do que se procura, e só essas
+// precisam ter o texto conferido
+
+// Palavra do índice e os UIDs das mensagens em que ela aparece, em
+// ordem crescente, guardados como a diferença para o anterior em
+// varint (7 bits por byte, o bit mais alto indicando que há mais).
+// 'last' é o último UID da lista
+typedef struct {char *word; int len; uint32_t last; buf_t uids;} posting_t;
+
+// Índice de uma caixa em um processo, construído a partir do arquivo
+// 'Maildir/ep1.search', que é compartilhado pelos processos. A primeira
+// linha do arquivo é "1 V<uidvalidity>" e cada uma das seguintes é
+// "<uid> <palavra> <palavra> ...", com as palavras distintas de uma
+// mensagem. As mensagens novas são indexadas por quem fizer a próxima
+// busca, que acrescenta as linhas delas no final com o arquivo travado
+// (flock), e cada processo lê só o que foi acrescentado desde a última
+// vez ('off'). As mensagens removidas continuam no arquivo até que elas
+// sejam mais da metade das linhas ('records'), quando ele é reescrito e
+// substituído; um inode diferente ('ino') faz os processos relerem tudo.
+// 'slot' é a tabela de espalhamento das palavras (posição + 1, ou 0) e
+// 'last' é o maior UID indexado. As palavras com mais de FTIWORD bytes
+// (quase sempre lixo) não entram no índice, e as mensagens que as têm
+// ficam na lista da palavra FTILONG, que não é uma palavra válida e é
+// incluída em todas as buscas
+#define FTIFILE "ep1.search"
+#define FTISLACK 1024
+#define FTIWORD 64
+#define FTILONG "-"
+typedef struct {posting_t *words; int n, cap; int *slot; unsigned mask; int fd; off_t off; ino_t ino;
+                uint32_t uidvalidity, last; int records;} fti_t;
+
+//========================================= FUNÇÕES =========================================
+fti_t *fti_new();
+void fti_free(fti_t *fti);
+void fti_clear(fti_t *fti);
+bool fti_char(int c);
+unsigned fti_hash(char const *s, int len);
+posting_t *fti_word(fti_t *fti, char const *s, int len, bool create);
+bool fti_post(posting_t *w, uint32_t uid);
+int fti_open(fti_t *fti, char const *maildir, uint32_t uidvalidity);
+void fti_unlock(fti_t *fti);
+void fti_load(fti_t *fti, uint32_t uidvalidity);
+void fti_record(fti_t *fti, char *line, char *end);
+void fti_add(fti_t *fti, uint32_t uid, char const *doc, size_t len, buf_t *rec);
+void fti_write(fti_t *fti, buf_t *rec);
+void fti_compact(fti_t *fti, char const *maildir, uint32_t const *uids, int n);
+void fti_bits(posting_t const *w, uint8_t *bits);
+uint8_t *fti_query(fti_t *fti, char const *s);
+bool fti_match(char const *s, size_t len, char const *t);
+size_t fti_doc(buf_t *doc, mime_t const *mime, char const *text);
+void fti_decode(buf_t *doc, mime_t const *mime, int p, char const *text);
+void fti_base64(buf_t *doc, char const *s, size_t len);
+void fti_qp(buf_t *doc, char const *s, size_t len);
+
+
+// Índice vazio, ainda sem o arquivo aberto
+fti_t *fti_new() {
+    fti_t *fti = (fti_t*)calloc(1, sizeof(fti_t));
+
+    fti->fd = -1;
+    return fti;
+}
+
+// Fecha o arquivo e libera a memória do índice
+void fti_free(fti_t *fti) {
+    if(fti == NULL) return;
+
+    fti_clear(fti);
+    free(fti->words);
+    free(fti->slot);
+    if(fti->fd != -1) close(fti->fd);
+    free(fti);
+}
+
+// Esquece todas as palavras, para que o arquivo seja lido do começo
+void fti_clear(fti_t *fti) {
+    int i;
+
+    for(i = 0; i < fti->n; i++) {
+        free(fti->words[i].word);
+        buf_free(&fti->words[i].uids);
+    }
+    fti->n = 0;
+    if(fti->slot != NULL) memset(fti->slot, 0, (fti->mask + 1)*sizeof(int));
+    fti->off = 0;
+    fti->uidvalidity = fti->last = 0;
+    fti->records = 0;
+}
+
+// Verifica se o byte 'c' faz parte de uma palavra
+bool fti_char(int c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// Espalhamento de uma palavra (FNV-1a)
+unsigned fti_hash(char const *s, int len) {
+    uint32_t h = 2166136261u;
+    int i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+
+    return h;
+}
+
+// Palavra 's' (já em minúsculas) do índice. Se ela não existir, é
+// criada se 'create' for verdadeiro e senão o retorno é NULL
+posting_t *fti_word(fti_t *fti, char const *s, int len, bool create) {
+    unsigned h, size;
+    posting_t *w;
+    int i;
+
+    if(fti->slot != NULL) {
+        for(h = fti_hash(s, len) & fti->mask; fti->slot[h] != 0; h = (h + 1) & fti->mask) {
+            w = &fti->words[fti->slot[h] - 1];
+            if(w->len == len && !memcmp(w->word, s, len)) return w;
+        }
+    }
+    if(!create) return NULL;
+
+    // A tabela fica no máximo com metade das posições ocupadas
+    if(2u*(fti->n + 1) > (fti->slot ? fti->mask + 1 : 0)) {
+        size = fti->slot ? 2*(fti->mask + 1) : 4096;
+        free(fti->slot);
+        fti->slot = (int*)calloc(size, sizeof(int));
+        fti->mask = size - 1;
+        for(i = 0; i < fti->n; i++) {
+            for(h = fti_hash(fti->words[i].word, fti->words[i].len) & fti->mask; fti->slot[h] != 0; h = (h + 1) & fti->mask);
+            fti->slot[h] = i + 1;
+        }
+    }
+
+    if(fti->n == fti->cap) {
+        fti->cap = fti->cap ? 2*fti->cap : 4096;
+        fti->words = (posting_t*)realloc(fti->words, fti->cap*sizeof(posting_t));
+    }
+    w = &fti->words[fti->n++];
+    memset(w, 0, sizeof(posting_t));
+    w->word = (char*)malloc(len + 1);
+    memcpy(w->word, s, len);
+    w->word[len] = 0;
+    w->len = len;
+
+    for(h = fti_hash(s, len) & fti->mask; fti->slot[h] != 0; h = (h + 1) & fti->mask);
+    fti->slot[h] = fti->n;
+
+    return w;
+}
+
+// Acrescenta 'uid' à lista da palavra, se ele for maior que o último.
+// Retorna false se ele já estava lá
+bool fti_post(posting_t *w, uint32_t uid) {
+    unsigned char v[8];
+    uint32_t d;
+    int n = 0;
+
+    if(uid <= w->last) return false;
+
+    for(d = uid - w->last; d >= 0x80; d >>= 7)
+        v[n++] = (d & 0x7f) | 0x80;
+    v[n++] = d;
+    buf_append(&w->uids, (char*)v, n);
+    w->last = uid;
+
+    return true;
+}
+
+// Abre e trava o arquivo do índice da caixa no Maildir 'maildir', e lê
+// o que outros processos acrescentaram a ele. Se o arquivo foi
+// substituído ou é de outra 'uidvalidity', o índice recomeça. Retorna
+// -1 se o arquivo não pôde ser aberto
+int fti_open(fti_t *fti, char const *maildir, uint32_t uidvalidity) {
+    char path[PATH_MAX];
+    struct stat st, cur;
+
+    snprintf(path, sizeof(path), "%s/" FTIFILE, maildir);
+    for(;;) {
+        if(fti->fd == -1 && (fti->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+            perror(path);
+            return -1;
+        }
+        while(flock(fti->fd, LOCK_EX) == -1 && errno == EINTR);
+
+        // Quem substituiu o arquivo o fez com ele travado, então depois
+        // de obter a trava basta conferir se ele ainda é o do caminho
+        if(fstat(fti->fd, &st) == 0 && stat(path, &cur) == 0 && st.st_ino == cur.st_ino) break;
+        close(fti->fd);
+        fti->fd = -1;
+    }
+
+    if(st.st_ino != fti->ino || st.st_size < fti->off) {
+        fti_clear(fti);
+        fti->ino = st.st_ino;
+    }
+    fti_load(fti, uidvalidity);
+
+    return 0;
+}
+
+// Libera a trava do arquivo
+void fti_unlock(fti_t *fti) {
+    flock(fti->fd, LOCK_UN);
+}
+
+// Lê as linhas acrescentadas ao arquivo desde 'off', com a trava já
+// obtida. Um arquivo vazio ou de outra 'uidvalidity' é esvaziado, e uma
+// linha incompleta no final, de um acréscimo interrompido, é descartada
+void fti_load(fti_t *fti, uint32_t uidvalidity) {
+    char head[64], *p, *nl, *end;
+    buf_t data = {NULL, 0, 0};
+    ssize_t n;
+    int len;
+
+    if(fti->uidvalidity != 0 && fti->uidvalidity != uidvalidity) fti_clear(fti);
+
+    for(;;) {
+        buf_reserve(&data, 1 << 20);
+        if((n = pread(fti->fd, data.data + data.len, data.cap - data.len, fti->off + data.len)) <= 0) break;
+        data.len += n;
+    }
+
+    p = data.data;
+    end = data.data + data.len;
+    if(fti->off == 0) {
+        nl = data.len ? memchr(p, '\n', data.len) : NULL;
+        if(nl == NULL || sscanf(p, "1 V%u", &fti->uidvalidity) != 1 || fti->uidvalidity != uidvalidity) {
+            fti->uidvalidity = uidvalidity;
+            len = snprintf(head, sizeof(head), "1 V%u\n", uidvalidity);
+            if(ftruncate(fti->fd, 0) == -1 || pwrite(fti->fd, head, len, 0) != len)
+                perror(FTIFILE);
+            fti->off = len;
+            buf_free(&data);
+            return;
+        }
+        p = nl + 1;
+    }
+
+    while(p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        fti_record(fti, p, nl);
+        p = nl + 1;
+    }
+    fti->off += p - data.data;
+    if(p < end && ftruncate(fti->fd, fti->off) == -1)
+        perror(FTIFILE);
+
+    buf_free(&data);
+}
+
+// Acrescenta ao índice a linha de uma mensagem, que vai de 'line' até
+// 'end' (o fim de linha)
+void fti_record(fti_t *fti, char *line, char *end) {
+    unsigned long uid;
+    posting_t *w;
+    char *p, *q;
+
+    uid = strtoul(line, &p, 10);
+    if(uid == 0 || uid > UINT32_MAX || uid <= fti->last) return;
+
+    while(p < end) {
+        for(; p < end && *p == ' '; p++);
+        for(q = p; q < end && *q != ' '; q++);
+        if(q > p && (w = fti_word(fti, p, q - p, true)) != NULL) fti_post(w, uid);
+        p = q;
+    }
+
+    fti->last = uid;
+    fti->records++;
+}
+
+// Indexa o texto 'doc' da mensagem 'uid', que deve ser maior que todos
+// os já indexados, e escreve em 'rec' a sua linha do arquivo
+void fti_add(fti_t *fti, uint32_t uid, char const *doc, size_t len, buf_t *rec) {
+    char word[FTIWORD], num[16];
+    posting_t *w;
+    size_t i, j;
+    int n;
+
+    if(uid <= fti->last) return;
+
+    buf_append(rec, num, sprintf(num, "%u", uid));
+    for(i = 0; i < len; i = j) {
+        for(; i < len && !fti_char((unsigned char)doc[i]); i++);
+        for(j = i, n = 0; j < len && fti_char((unsigned char)doc[j]); j++)
+            if(n < FTIWORD) word[n++] = tolower((unsigned char)doc[j]);
+        if(j == i) break;
+
+        if(j - i > FTIWORD) {
+            strcpy(word, FTILONG);
+            n = strlen(FTILONG);
+        }
+        if((w = fti_word(fti, word, n, true)) != NULL && fti_post(w, uid)) {
+            buf_append(rec, " ", 1);
+            buf_append(rec, word, n);
+        }
+    }
+    buf_append(rec, "\n", 1);
+
+    fti->last = uid;
+    fti->records++;
+}
+
+// Acrescenta as linhas de 'rec' ao arquivo, com a trava já obtida
+void fti_write(fti_t *fti, buf_t *rec) {
+    if(rec->len == 0) return;
+
+    if(pwrite(fti->fd, rec->data, rec->len, fti->off) != (ssize_t)rec->len) {
+        perror(FTIFILE);
+        if(ftruncate(fti->fd, fti->off) == -1) perror(FTIFILE);
+    } else {
+        fti->off += rec->len;
+    }
+    rec->len = 0;
+}
+
+// Reescreve o arquivo só com as linhas das 'n' mensagens em 'uids' (em
+// ordem crescente), com a trava já obtida, e relê o índice a partir
+// dele. O arquivo novo substitui o antigo de uma vez (rename), e fica
+// travado no lugar dele
+void fti_compact(fti_t *fti, char const *maildir, uint32_t const *uids, int n) {
+    char path[PATH_MAX], tmp[PATH_MAX], *p, *nl, *end;
+    buf_t data = {NULL, 0, 0}, out = {NULL, 0, 0};
+    unsigned long uid;
+    struct stat st;
+    uint32_t validity = fti->uidvalidity;
+    ssize_t r;
+    int fd, i = 0;
+
+    snprintf(path, sizeof(path), "%s/" FTIFILE, maildir);
+    snprintf(tmp, sizeof(tmp), "%s/" FTIFILE ".tmp", maildir);
+
+    for(;;) {
+        buf_reserve(&data, 1 << 20);
+        if((r = pread(fti->fd, data.data + data.len, data.cap - data.len, data.len)) <= 0) break;
+        data.len += r;
+    }
+
+    // O cabeçalho e as linhas das mensagens que ainda existem
+    end = data.data + data.len;
+    for(p = data.data; p < end && (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+        if(p > data.data) {
+            uid = strtoul(p, NULL, 10);
+            while(i < n && uids[i] < uid) i++;
+            if(i == n || uids[i] != uid) continue;
+        }
+        buf_append(&out, p, nl + 1 - p);
+    }
+
+    if((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1 ||
+       flock(fd, LOCK_EX) == -1 || write(fd, out.data, out.len) != (ssize_t)out.len ||
+       fstat(fd, &st) == -1 || rename(tmp, path) == -1) {
+        perror(tmp);
+        if(fd != -1) close(fd);
+        unlink(tmp);
+    } else {
+        close(fti->fd);
+        fti->fd = fd;
+        fti->ino = st.st_ino;
+        fti_clear(fti);
+        fti_load(fti, validity);
+    }
+
+    buf_free(&data);
+    buf_free(&out);
+}
+
+// Liga em 'bits' os UIDs da lista da palavra 'w'
+void fti_bits(posting_t const *w, uint8_t *bits) {
+    unsigned char const *p = (unsigned char const*)w->uids.data, *end = p + w->uids.len;
+    uint32_t uid, d;
+    int shift;
+
+    for(uid = 0; p < end; uid += d) {
+        for(d = 0, shift = 0; p < end; shift += 7) {
+            d |= (uint32_t)(*p & 0x7f) << shift;
+            if(!(*p++ & 0x80)) break;
+        }
+        bits[(uid + d)/8] |= 1 << ((uid + d) % 8);
+    }
+}
+
+// Mensagens que podem conter 's': um bit por UID, até 'last', ligado
+// se a mensagem tem todas as palavras de 's'. As palavras do meio de
+// 's' são palavras inteiras do texto, achadas direto na tabela, mas a
+// primeira pode ser o final de uma palavra e a última o começo de
+// outra, então essas são procuradas entre todas as palavras do índice.
+// Retorna NULL se 's' não tem nenhuma palavra, quando todas as
+// mensagens são candidatas
+uint8_t *fti_query(fti_t *fti, char const *s) {
+    size_t len = strlen(s), size = fti->last/8 + 1, i, j, k, n;
+    uint8_t *bits = NULL, *word;
+    posting_t const *w;
+    char *t;
+    bool left, right;
+    int m;
+
+    t = (char*)malloc(len + 1);
+    simd.fold(t, s, len + 1, false);
+    word = (uint8_t*)malloc(size);
+
+    for(i = 0; i < len; i = j) {
+        for(; i < len && !fti_char((unsigned char)t[i]); i++);
+        for(j = i; j < len && fti_char((unsigned char)t[j]); j++);
+        if(j == i) break;
+        n = j - i;
+        left = (i > 0);
+        right = (j < len);
+
+        // UIDs de todas as palavras do índice compatíveis com esta, e
+        // das mensagens com palavras longas, que podem ser qualquer uma
+        memset(word, 0, size);
+        if((w = fti_word(fti, FTILONG, strlen(FTILONG), false)) != NULL) fti_bits(w, word);
+        if(left && right) {
+            if(n <= FTIWORD && (w = fti_word(fti, t + i, n, false)) != NULL) fti_bits(w, word);
+        } else {
+            for(m = 0; m < fti->n; m++) {
+                w = &fti->words[m];
+                if(!strcmp(w->word, FTILONG)) {
+                    continue;
+                } else if(left) {
+                    if((size_t)w->len < n || memcmp(w->word, t + i, n)) continue;
+                } else if(right) {
+                    if((size_t)w->len < n || memcmp(w->word + w->len - n, t + i, n)) continue;
+                } else if(memmem(w->word, w->len, t + i, n) == NULL) {
+                    continue;
+                }
+                fti_bits(w, word);
+            }
+        }
+
+        if(bits == NULL) {
+            bits = word;
+            word = (uint8_t*)malloc(size);
+        } else {
+            for(k = 0; k < size; k++) bits[k] &= word[k];
+        }
+    }
+
+    free(word);
+    free(t);
+    return bits;
+}
+
+// Verifica se 't' aparece nos 'len' bytes de 's', sem diferenciar
+// maiúsculas
+bool fti_match(char const *s, size_t len, char const *t) {
+    return simd.ifind(s, len, t, strlen(t)) != NULL;
+}
+
+// Escreve em 'doc' o texto da mensagem 'text', com a árvore de partes
+// 'mime', como descrito no começo do arquivo. Retorna o tamanho do
+// cabeçalho, depois do qual vem o corpo
+size_t fti_doc(buf_t *doc, mime_t const *mime, char const *text) {
+    part_t const *part;
+    span_t type, subtype, params;
+    int p;
+
+    buf_append(doc, text, mime->parts[0].hlen);
+    for(p = 0; p < mime->n; p++) {
+        part = &mime->parts[p];
+        if(p > 0 && mime->parts[part->parent].message)
+            buf_append(doc, text + part->hoff, part->hlen);
+        if(part->multipart || part->message) continue;
+
+        // Sem Content-Type, a parte é texto
+        if(mime_ctype(mime, p, text, &type, &subtype, &params) && !mime_is(&type, "text")) continue;
+        fti_decode(doc, mime, p, text);
+        buf_append(doc, "\n", 1);
+    }
+
+    return mime->parts[0].hlen;
+}
+
+// Escreve em 'doc' o corpo da parte 'p', decodificado conforme o seu
+// Content-Transfer-Encoding
+void fti_decode(buf_t *doc, mime_t const *mime, int p, char const *text) {
+    char const *body = text + mime->parts[p].boff;
+    size_t len = mime->parts[p].blen;
+    span_t v, enc;
+
+    if(mime_field(mime, p, text, "Content-Transfer-Encoding", &v)) {
+        mime_token(v.s, v.s + v.len, &enc);
+        if(mime_is(&enc, "base64")) {
+            fti_base64(doc, body, len);
+            return;
+        }
+        if(mime_is(&enc, "quoted-printable")) {
+            fti_qp(doc, body, len);
+            return;
+        }
+    }
+
+    buf_append(doc, body, len);
+}
+
+// Decodifica o base64 em 's' para 'doc', ignorando o que não for do
+// alfabeto (como os fins de linha)
+void fti_base64(buf_t *doc, char const *s, size_t len) {
+    static int8_t value[256];
+    uint32_t acc = 0;
+    size_t i;
+    char *out;
+    int bits = 0, c;
+
+    // A tabela é montada na primeira chamada
+    if(value['B'] == 0) {
+        memset(value, -1, sizeof(value));
+        for(c = 0; c < 64; c++)
+            value[(unsigned char)"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[c]] = c;
+    }
+
+    buf_reserve(doc, len/4*3 + 3);
+    out = doc->data + doc->len;
+    for(i = 0; i < len; i++) {
+        if((c = value[(unsigned char)s[i]]) < 0) continue;
+        acc = (acc << 6) | c;
+        if((bits += 6) >= 8) {
+            bits -= 8;
+            *out++ = acc >> bits;
+        }
+    }
+    doc->len = out - doc->data;
+}
+
+// Decodifica o quoted-printable em 's' para 'doc': "=XX" é o byte XX e
+// um '=' no fim da linha a junta com a seguinte
+void fti_qp(buf_t *doc, char const *s, size_t len) {
+    char hex[3] = {0, 0, 0}, *out;
+    size_t i;
+
+    buf_reserve(doc, len);
+    out = doc->data + doc->len;
+    for(i = 0; i < len; i++) {
+        if(s[i] != '=') {
+            *out++ = s[i];
+        } else if(i + 2 < len && isxdigit((unsigned char)s[i+1]) && isxdigit((unsigned char)s[i+2])) {
+            hex[0] = s[i+1];
+            hex[1] = s[i+2];
+            *out++ = strtol(hex, NULL, 16);
+            i += 2;
+        } else if(i + 1 < len && s[i+1] == '\n') {
+            i++;
+        } else if(i + 2 < len && s[i+1] == '\r' && s[i+2] == '\n') {
+            i += 2;
+        } else {
+            *out++ = s[i];
+        }
+    }
+    doc->len = out - doc->data;
+}
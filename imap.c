@@ -11,15 +11,33 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <unistd.h>
-#include <fts.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include "simd.c"
 #include "utils.c"
+#include "uring.c"
+#include "log.c"
+#include "mailbox.c"
+#include "mime.c"
+#include "fti.c"
+#include "share.c"
+#include "sort.c"
 
-#define LISTENQ 1
 #define MAXDATASIZE 100
 #define MAXLINE 4096
 
+// Quantidade máxima de trechos por envio e tamanho da fila de saída a
+// partir do qual ela é enviada mesmo no meio de um comando
+#define OUTIOV 64
+#define OUTHIWAT 262144
+
 // Condições de uma resposta
 typedef enum {OK, NO, BAD, PREAUTH, BYE} cond_t;
 
@@ -27,308 +45,884 @@ typedef enum {OK, NO, BAD, PREAUTH, BYE} cond_t;
 typedef enum {CAPABILITY, IDLE, NOOP, LOGOUT,
               STARTTLS, AUTHENTICATE, LOGIN,
               SELECT, EXAMINE, CREATE, DELETE, RENAME, SUBSCRIBE, UNSUBSCRIBE, LIST, LSUB, STATUS, APPEND,
-              CHECK, CLOSE, EXPUNGE, SEARCH, FETCH, STORE, COPY, UID} cmd_t;
-char commands[][16] = {"CAPABILITY", "IDLE", "NOOP", "LOGOUT",
-              "STARTTLS", "AUTHENTICATE", "LOGIN",
-              "SELECT", "EXAMINE", "CREATE", "DELETE", "RENAME", "SUBSCRIBE", "UNSUBSCRIBE", "LIST", "LSUB", "STATUS", "APPEND",
-              "CHECK", "CLOSE", "EXPUNGE", "SEARCH", "FETCH", "STORE", "COPY", "UID", ""};
+              CHECK, CLOSE, EXPUNGE, SEARCH, FETCH, STORE, COPY, UID,
+              COMPRESS, SORT, THREAD, ENABLE} cmd_t;
 
 // Estados da sessão
-// Todos os comandos <= o estado são permitidos naquele estado
-typedef enum {NOTAUTHENTICATED = LOGIN,
-              AUTHENTICATED = APPEND,
-              SELECTED = UID,
-              LOGOUT_s} state_t;
-
-// Linha de comando recebida
-typedef struct {char tag[MAXLINE+1];    cmd_t cmd; char argv[10][MAXLINE+1]; int argc;} cmdline_t;
-
-// BODYSTRUCTURE
-typedef struct {char str[MAXLINE/2]; char *parts[10]; int nparts, psize[10];} bs_t;
-
-// Mensagem armazenada
-typedef struct {FTSENT *file; bool seen, deleted; int id; char *header, *text; int flines, fsize, hlines, hsize; char filepath[MAXLINE+1]; bs_t bs;} msg_t;
+typedef enum {NOTAUTHENTICATED, AUTHENTICATED, SELECTED, LOGOUT_s} state_t;
+
+// Conjuntos de estados em que um comando é permitido
+#define S_NOTAUTH  (1 << NOTAUTHENTICATED)
+#define S_AUTH     (1 << AUTHENTICATED | 1 << SELECTED)
+#define S_SELECTED (1 << SELECTED)
+#define S_ANY      (S_NOTAUTH | S_AUTH)
+
+// Linha de comando recebida. A tag, o nome do comando e os argumentos
+// apontam para o próprio buffer de entrada da sessão, com o delimitador
+// seguinte trocado por '\0': strings sem as aspas, listas sem os
+// parênteses e literais sem o cabeçalho {n}. 'uid' indica que o
+// comando veio depois de UID. 'literal' é o tamanho do literal de uma
+// mensagem do APPEND, que chega depois do comando (-1 se não houver), e
+// 'sync' indica que o cliente espera a confirmação para enviá-lo
+typedef struct {char *tag, *name; cmd_t cmd; bool uid, sync; slice_t *argv; int argc, cap; long literal;} cmdline_t;
+
+// Mensagem recebida pelo APPEND, gravada em 'tmp/' com o nome 'name'
+// até o fsync em grupo, quando é renomeada para 'cur/' com as flags.
+// 'date' é a data de entrega pedida (0 se não foi dada)
+typedef struct {char name[64]; int64_t date; size_t size; bool seen, deleted;} staged_t;
+
+// Texto de uma mensagem mapeado pela sessão
+typedef struct {char *text; size_t len;} map_t;
+
+// Itens do FETCH e as seções do BODY[...]: a mensagem inteira, o
+// cabeçalho, só alguns campos dele, o texto e o cabeçalho MIME de uma
+// parte
+typedef enum {F_UID, F_FLAGS, F_SIZE, F_DATE, F_ENVELOPE, F_BODY, F_STRUCTURE,
+              F_SECTION, F_RFC822, F_RFC822HEADER, F_RFC822TEXT, F_MODSEQ} fetchitem_t;
+typedef enum {SEC_ALL, SEC_HEADER, SEC_FIELDS, SEC_FIELDSNOT, SEC_TEXT, SEC_MIME} section_t;
+
+// Item pedido no FETCH. Uma seção tem o número da parte ('path', como
+// em BODY[2.1]), o que se quer dela, a lista de campos do HEADER.FIELDS
+// e o texto entre colchetes, repetido na resposta. 'octets' é negativo
+// se não foi pedido um trecho <origin.octets>
+#define FETCHITEMS 32
+#define FETCHPATH 16
+typedef struct {fetchitem_t item; section_t sec; bool peek; int path[FETCHPATH], npath;
+                char const *fields, *spec; long origin, octets;} fetch_t;
+
+// Critérios do SEARCH. Os de flags, tamanho, data de entrega, modseq e
+// conjuntos de mensagens são avaliados só com o índice da caixa; os de
+// texto (K_HEADER, K_BODY e K_TEXT) são filtrados pelo índice invertido
+// e conferidos no texto da mensagem, que também é preciso para as datas
+// do campo Date (K_SENT*)
+typedef enum {K_ALL, K_NONE, K_SEEN, K_UNSEEN, K_DELETED, K_UNDELETED, K_RECENT, K_NEW, K_OLD,
+              K_LARGER, K_SMALLER, K_BEFORE, K_ON, K_SINCE, K_SENTBEFORE, K_SENTON, K_SENTSINCE,
+              K_MODSEQ, K_SET, K_HEADER, K_BODY, K_TEXT, K_NOT, K_OR, K_AND} searchop_t;
+
+// O que vem depois do nome de um critério: nada, uma string, um número,
+// uma data, um conjunto de UIDs, um campo e uma string, um critério,
+// dois critérios ou um modseq (talvez depois do nome e do tipo da flag)
+typedef enum {A_NONE, A_STRING, A_NUMBER, A_DATE, A_UIDS, A_FIELD, A_KEY, A_KEYS, A_MODSEQ} searcharg_t;
+
+// Nome de um critério. Os campos de FROM, SUBJECT etc. são fixos, e as
+// flags e palavras-chave que a caixa não guarda nunca estão marcadas
+typedef struct {char const *name; searchop_t op; searcharg_t arg; char const *field;} searchname_t;
+
+// Critério já interpretado: os filhos 'a' e 'b' do NOT, OR e AND, o
+// número do LARGER e SMALLER ou a data (em dias desde 1970), as posições
+// de K_SET (intervalos fechados), o campo e a string procurada, e os
+// UIDs candidatos segundo o índice invertido (NULL se forem todos).
+// 'text' indica que ele precisa do texto das mensagens
+typedef struct {searchop_t op; int a, b; long num; set_t set; char const *field, *s; uint8_t *cand; bool text;} searchkey_t;
+
+// Critérios de um SEARCH e o maior UID que o índice invertido conhece
+typedef struct {searchkey_t *keys; int n, cap; uint32_t last;} search_t;
+
+// Mensagem avaliada pelo SEARCH. O texto só é mapeado, e a árvore de
+// partes e o texto para a busca ('doc', com o cabeçalho até 'hdoc')
+// montados, quando algum critério precisar deles
+typedef struct {int i; msg_t msg; char *text; size_t len; bool loaded, failed, built;
+                mime_t mime; buf_t doc; size_t hdoc;} searchmsg_t;
 
 // Lista de logins válidos
 char loginv[][2][MAXLINE+1] = {{"mriva@ime.usp.br", "password1"},
                               {"lmagno@ime.usp.br", "password2"}};
 int loginc = 2;
 
-// Sessão
-typedef struct {int pid, connfd; char *user; state_t state; msg_t messages[10]; int exists, unseen; bool idle; char idletag[MAXLINE+1];} session_t;
+// Sessão. 'condstore' e 'qresync' indicam que as respostas já podem
+// ter os modseqs e o VANISHED dessas extensões (RFC 7162). No APPEND,
+// 'staged' são as mensagens já gravadas em 'tmp/' (a última talvez
+// ainda esperando 'appendleft' bytes, escritos em 'appendfd'),
+// 'appending' indica que falta o restante da linha depois do literal,
+// 'appendfail' que alguma gravação falhou e 'committing' que elas
+// esperam o fsync em grupo, na posição 'commitpos' da lista
+typedef struct {int id, connfd; char *user; state_t state; share_t *box; int unseen; bool idle; char idletag[MAXLINE+1];
+                uint64_t modseq, nexp; uint32_t uidnext; int exists, recent, idlepos; set_t recents; bool pushed, cancelling;
+                bool condstore, qresync;
+                staged_t *staged; int nstaged, stagecap, appendfd, commitpos; size_t appendleft;
+                bool appending, appendfail, committing; char appendtag[MAXLINE+1];
+                map_t *maps; int nmaps, mapcap; size_t mapped;
+                buf_t in; outq_t out; size_t cont, skip; bool sending, discard, trace; unsigned events; cmdline_t cmdline;
+                struct msghdr hdr; struct iovec iov[OUTIOV];
+                z_stream *zout, *zin; outq_t zplain; buf_t zraw; bool zdirty, zstart;} session_t;
+
+// Entrada da tabela de comandos: o nome, a função que o executa
+// (NULL se não foi implementado) e os estados em que é permitido
+typedef struct {char const *name; cmd_t cmd; void (*fn)(cmdline_t*, session_t*); unsigned states;} cmdinfo_t;
+
+// Tabela de espalhamento perfeito dos comandos: o nome é levado
+// diretamente à posição da sua entrada por cmdhash(), sem colisões
+#define CMDBITS 6
+#define CMDSEED 157077u
+typedef struct {cmdinfo_t const *slot[1 << CMDBITS];} cmdtable_t;
+
+// Backend de E/S. As respostas são acumuladas em 'session->out' e
+// enviadas de uma vez no fim de cada lote de comandos (pelo loop de
+// eventos, com o io_uring)
+bool uring_on = false;
+
+// Quantos bytes de mensagens uma sessão mantém mapeados antes de
+// liberá-los no início do próximo comando
+#define MAXMAPPED (64 << 20)
+
+// Sessões em IDLE deste processo e o inotify que avisa das mudanças
+// nas caixas delas (-1 se não houver)
+session_t **idlers = NULL;
+int nidlers = 0, idlecap = 0;
+int notify_fd = -1;
+
+// Os diários de flags que este processo escreveu são aplicados FLUSHDELAY
+// segundos depois da primeira alteração, quando o timerfd 'flush_fd'
+// avisar. Sem ele, são aplicados a cada alteração
+#define FLUSHDELAY 1
+int flush_fd = -1;
+bool flush_armed = false;
+
+// Tamanho máximo de um literal fora do APPEND
+#define MAXLITERAL 65536
+
+// Tamanho máximo de uma mensagem do APPEND, que vai do socket para o
+// arquivo sem ficar inteira na memória
+#define MAXAPPEND (256 << 20)
+
+// Sessões deste processo cujo APPEND espera o fsync em grupo, feito uma
+// vez por iteração do loop de eventos, e as que acabaram de ser
+// atendidas por ele, cujos comandos seguintes o loop volta a executar
+session_t **committers = NULL, **committed = NULL;
+int ncommit = 0, commitcap = 0, ncommitted = 0, committedcap = 0;
+
+// Capacidades anunciadas na saudação e no CAPABILITY
+#define CAPABILITIES "IMAP4rev1 COMPRESS=DEFLATE SORT THREAD=ORDEREDSUBJECT THREAD=REFERENCES ENABLE CONDSTORE QRESYNC MULTIAPPEND LITERAL+"
+
+// Com o COMPRESS=DEFLATE (RFC 4978) as respostas são escritas em
+// 'session->zplain' e comprimidas para 'session->out' no fim de cada
+// lote de comandos, e o que chega do socket vai para 'session->zraw'
+// antes de ser descomprimido em 'session->in'. ZCHUNK é quanto espaço
+// o zlib recebe de cada vez
+#define ZLEVEL 1
+#define ZCHUNK 16384
 
 //========================================= FUNÇÕES =========================================
-cmd_t findcmd(char const name[MAXLINE+1]);
-msg_t parse_title(FTSENT *file);
-void parse_msg(msg_t *msg, session_t *session);
+unsigned cmdhash(char const *name);
+void cmdtable_init(cmdtable_t *table, cmdinfo_t const *list, int n);
+cmdinfo_t const *findcmd(cmdtable_t const *table, char const *name);
+int parse_cmdline(cmdline_t *cmdline, char *line, size_t len);
+int parse_args(char *p, char *end, slice_t **argv, int *argc, int *cap);
+char *parse_literal(char *p, char *end, size_t *size, bool *sync);
+char *literal_tail(char *line, size_t len, size_t *size, bool *sync);
+void parse_msg(msg_t *msg, char const *text, char *structure, char *keys);
+void msg_path(char const *name, session_t *session, char *path);
+int msg_open(session_t *session, uint32_t uid, char const *name, char *path);
+char *msg_load(msg_t *msg, char const *name, char *structure, session_t *session);
+bool msg_parse(msg_t *msg, char *keys, session_t *session);
+size_t map_size(size_t len);
+void msg_unmap(session_t *session);
 void parse_mime(char *line, char **structure);
-void upd_flags(msg_t *msg);
-
+int upd_flags(msg_t *msg, uint64_t unchanged, session_t *session);
+bool msg_set(session_t *session, char const *arg, bool uid, set_t *set);
+void msg_flags(msg_t const *msg, char *s);
+bool fetch_parse(char *arg, fetch_t *items, int *n);
+char const *modseq_num(char const *s, uint64_t *v);
+bool fetch_changed(slice_t const *arg, uint64_t *changed, bool *vanished);
+bool store_unchanged(slice_t const *arg, uint64_t *unchanged);
+bool fetch_section(char *p, fetch_t *item);
+bool fetch_msg(fetch_t const *items, int n, int i, msg_t *msg, char const *name, char *bs, session_t *session);
+void fetch_literal(buf_t *line, size_t len, bool *first, session_t *session);
+int search_key(search_t *search, searchop_t op);
+int search_list(search_t *search, slice_t *argv, int argc, session_t *session);
+int search_parse(search_t *search, slice_t *argv, int argc, int *k, session_t *session);
+bool search_charset(char const *s);
+int search_all(slice_t *argv, int argc, session_t *session, sortmsg_t **hits, uint64_t *modseq);
+void search_keys(sortmsg_t *hits, int n, session_t *session);
+bool search_date(char const *s, long *day, bool sent);
+void search_index(session_t *session);
+char *search_map(session_t *session, uint32_t uid, size_t *len);
+bool search_load(searchmsg_t *m, session_t *session);
+bool search_eval(search_t const *search, int k, searchmsg_t *m, session_t *session);
+void search_free(search_t *search);
+void notify_init();
+void notify_watch(share_t *share);
+void notify_unwatch(share_t *share);
+void notify_event();
+void idle_add(session_t *session);
+void idle_del(session_t *session);
+void flush_init();
+bool flush_arm();
+void flush_event();
+bool append_cmd(char const *line, char const *tail);
+bool append_date(char const *s, int64_t *t);
+bool append_begin(session_t *session, slice_t *argv, int argc, size_t size, bool sync);
+void append_write(session_t *session, char const *data, size_t len);
+void append_data(session_t *session, char const *data, size_t len);
+int append_splice(session_t *session);
+void append_close(session_t *session);
+void append_next(session_t *session, char *line, size_t len);
+void append_end(session_t *session);
+void append_fail(session_t *session, char const *status, char const *message, size_t size, bool sync);
+void append_clear(session_t *session, bool remove);
+void append_commit();
+
+session_t *session_new(int connfd);
+void session_free(session_t *session);
+void session_check(session_t *session);
+bool session_update(session_t *session, bool report);
+void session_vanished(session_t *session, uint64_t modseq, set_t const *uids);
+void session_resync(session_t *session, slice_t const *arg);
+int session_flush(session_t *session);
+int session_write(session_t *session);
+void session_hiwat(session_t *session);
+outq_t *session_queue(session_t *session);
+void session_deflate(session_t *session, int flush);
+int session_inflate(session_t *session);
 void respond(char const *tag, char const *status, char const *message, session_t *session);
-void cmd_login(cmdline_t cmdline, session_t *session);
-void cmd_select(cmdline_t cmdline, session_t *session);
-void cmd_list(cmdline_t cmdline, session_t *session);
-void cmd_fetch(cmdline_t cmdline, session_t *session);
-void cmd_uid(cmdline_t cmdline, session_t *session);
-void cmd_store(cmdline_t cmdline, session_t *session);
-
-
-void cmd_uid(cmdline_t cmdline, session_t *session) {
-    char cmd[MAXLINE+1];
-
-    // Atualiza argumentos
-    strcpy(cmd, cmdline.argv[0]);
-    for(int i = 0; i < cmdline.argc-1; i++)
-        strcpy(cmdline.argv[i], cmdline.argv[i+1]);
-
-    cmdline.argc--;
-
-    // Só fetch e store foram implementados
-    uppercase(cmd);
-    if(!strcmp("FETCH", cmd)) {
-        cmdline.cmd = FETCH;
-        cmd_fetch(cmdline, session);
-    } else if(!strcmp("STORE", cmd)) {
-        cmdline.cmd = STORE;
-        cmd_store(cmdline, session);
-    } else {
-        respond(cmdline.tag, "BAD", "UID Comando não implementado.", session);
+void respond_data(char const *data, size_t len, session_t *session);
+void respond_copy(char const *data, size_t len, session_t *session);
+void respond_file(int fd, size_t len, session_t *session);
+void cmd_login(cmdline_t *cmdline, session_t *session);
+void cmd_select(cmdline_t *cmdline, session_t *session);
+void cmd_list(cmdline_t *cmdline, session_t *session);
+void cmd_append(cmdline_t *cmdline, session_t *session);
+void cmd_fetch(cmdline_t *cmdline, session_t *session);
+void cmd_uid(cmdline_t *cmdline, session_t *session);
+void cmd_store(cmdline_t *cmdline, session_t *session);
+void cmd_search(cmdline_t *cmdline, session_t *session);
+void cmd_sort(cmdline_t *cmdline, session_t *session);
+void cmd_thread(cmdline_t *cmdline, session_t *session);
+void cmd_lsub(cmdline_t *cmdline, session_t *session);
+void cmd_idle(cmdline_t *cmdline, session_t *session);
+void cmd_noop(cmdline_t *cmdline, session_t *session);
+void cmd_logout(cmdline_t *cmdline, session_t *session);
+void cmd_capability(cmdline_t *cmdline, session_t *session);
+void cmd_compress(cmdline_t *cmdline, session_t *session);
+void cmd_enable(cmdline_t *cmdline, session_t *session);
+
+// Critérios do SEARCH (RFC 3501)
+searchname_t const search_names[] = {
+    {"ALL",        K_ALL,        A_NONE,   NULL},
+    {"ANSWERED",   K_NONE,       A_NONE,   NULL},
+    {"BCC",        K_HEADER,     A_STRING, "Bcc"},
+    {"BEFORE",     K_BEFORE,     A_DATE,   NULL},
+    {"BODY",       K_BODY,       A_STRING, NULL},
+    {"CC",         K_HEADER,     A_STRING, "Cc"},
+    {"DELETED",    K_DELETED,    A_NONE,   NULL},
+    {"DRAFT",      K_NONE,       A_NONE,   NULL},
+    {"FLAGGED",    K_NONE,       A_NONE,   NULL},
+    {"FROM",       K_HEADER,     A_STRING, "From"},
+    {"HEADER",     K_HEADER,     A_FIELD,  NULL},
+    {"KEYWORD",    K_NONE,       A_STRING, NULL},
+    {"LARGER",     K_LARGER,     A_NUMBER, NULL},
+    {"MODSEQ",     K_MODSEQ,     A_MODSEQ, NULL},
+    {"NEW",        K_NEW,        A_NONE,   NULL},
+    {"NOT",        K_NOT,        A_KEY,    NULL},
+    {"OLD",        K_OLD,        A_NONE,   NULL},
+    {"ON",         K_ON,         A_DATE,   NULL},
+    {"OR",         K_OR,         A_KEYS,   NULL},
+    {"RECENT",     K_RECENT,     A_NONE,   NULL},
+    {"SEEN",       K_SEEN,       A_NONE,   NULL},
+    {"SENTBEFORE", K_SENTBEFORE, A_DATE,   NULL},
+    {"SENTON",     K_SENTON,     A_DATE,   NULL},
+    {"SENTSINCE",  K_SENTSINCE,  A_DATE,   NULL},
+    {"SINCE",      K_SINCE,      A_DATE,   NULL},
+    {"SMALLER",    K_SMALLER,    A_NUMBER, NULL},
+    {"SUBJECT",    K_HEADER,     A_STRING, "Subject"},
+    {"TEXT",       K_TEXT,       A_STRING, NULL},
+    {"TO",         K_HEADER,     A_STRING, "To"},
+    {"UID",        K_SET,        A_UIDS,   NULL},
+    {"UNANSWERED", K_ALL,        A_NONE,   NULL},
+    {"UNDELETED",  K_UNDELETED,  A_NONE,   NULL},
+    {"UNDRAFT",    K_ALL,        A_NONE,   NULL},
+    {"UNFLAGGED",  K_ALL,        A_NONE,   NULL},
+    {"UNKEYWORD",  K_ALL,        A_STRING, NULL},
+    {"UNSEEN",     K_UNSEEN,     A_NONE,   NULL},
+};
+
+// Comandos do RFC 3501 e extensões
+cmdinfo_t const command_list[] = {
+    {"CAPABILITY",   CAPABILITY,   cmd_capability, S_ANY},
+    {"NOOP",         NOOP,         cmd_noop,   S_ANY},
+    {"LOGOUT",       LOGOUT,       cmd_logout, S_ANY},
+    {"STARTTLS",     STARTTLS,     NULL,       S_NOTAUTH},
+    {"AUTHENTICATE", AUTHENTICATE, NULL,       S_NOTAUTH},
+    {"LOGIN",        LOGIN,        cmd_login,  S_NOTAUTH},
+    {"SELECT",       SELECT,       cmd_select, S_AUTH},
+    {"EXAMINE",      EXAMINE,      NULL,       S_AUTH},
+    {"CREATE",       CREATE,       NULL,       S_AUTH},
+    {"DELETE",       DELETE,       NULL,       S_AUTH},
+    {"RENAME",       RENAME,       NULL,       S_AUTH},
+    {"SUBSCRIBE",    SUBSCRIBE,    NULL,       S_AUTH},
+    {"UNSUBSCRIBE",  UNSUBSCRIBE,  NULL,       S_AUTH},
+    {"LIST",         LIST,         cmd_list,   S_AUTH},
+    {"LSUB",         LSUB,         cmd_lsub,   S_AUTH},
+    {"STATUS",       STATUS,       NULL,       S_AUTH},
+    {"APPEND",       APPEND,       cmd_append, S_AUTH},
+    {"IDLE",         IDLE,         cmd_idle,   S_AUTH},
+    {"CHECK",        CHECK,        NULL,       S_SELECTED},
+    {"CLOSE",        CLOSE,        NULL,       S_SELECTED},
+    {"EXPUNGE",      EXPUNGE,      NULL,       S_SELECTED},
+    {"SEARCH",       SEARCH,       cmd_search, S_SELECTED},
+    {"FETCH",        FETCH,        cmd_fetch,  S_SELECTED},
+    {"STORE",        STORE,        cmd_store,  S_SELECTED},
+    {"COPY",         COPY,         NULL,       S_SELECTED},
+    {"UID",          UID,          cmd_uid,    S_SELECTED},
+    {"COMPRESS",     COMPRESS,     cmd_compress, S_AUTH},
+    {"SORT",         SORT,         cmd_sort,   S_SELECTED},
+    {"THREAD",       THREAD,       cmd_thread, S_SELECTED},
+    {"ENABLE",       ENABLE,       cmd_enable, S_AUTH},
+};
+
+// Comandos que podem vir depois de UID
+cmdinfo_t const uid_list[] = {
+    {"FETCH",        FETCH,        cmd_fetch,  S_SELECTED},
+    {"STORE",        STORE,        cmd_store,  S_SELECTED},
+    {"COPY",         COPY,         NULL,       S_SELECTED},
+    {"SEARCH",       SEARCH,       cmd_search, S_SELECTED},
+    {"EXPUNGE",      EXPUNGE,      NULL,       S_SELECTED},
+    {"SORT",         SORT,         cmd_sort,   S_SELECTED},
+    {"THREAD",       THREAD,       cmd_thread, S_SELECTED},
+};
+
+cmdtable_t commands, uid_commands;
+
+
+void cmd_uid(cmdline_t *cmdline, session_t *session) {
+    char resp[MAXLINE+1];
+    cmdinfo_t const *cmd;
+
+    if(cmdline->argc < 1) {
+        respond(cmdline->tag, "BAD", "UID Argumentos inválidos", session);
+        return;
     }
-}
 
-void cmd_fetch(cmdline_t cmdline, session_t *session) {
-    char *token, *saveptr, *options, *prev, *next;
-    int a, b; // Range
-    int i;
-    bool asterisk;
-    bool flags, size, body, peek, header, bstruct;
-    char tmp[MAXLINE+1], resp[MAXLINE+1];
-    msg_t msg;
+    // O primeiro argumento é o comando
+    if((cmd = findcmd(&uid_commands, cmdline->argv[0].s)) == NULL) {
+        sprintf(resp, "UID %s Comando inválido", cmdline->argv[0].s);
+        respond(cmdline->tag, "BAD", resp, session);
+        return;
+    }
 
-    // Checa número de argumentos
-    if(cmdline.argc != 2) {
-        respond(cmdline.tag, "BAD", "FETCH Argumentos inválidos", session);
+    if(cmd->fn == NULL) {
+        sprintf(resp, "UID %s Comando não implementado.", cmd->name);
+        respond(cmdline->tag, "BAD", resp, session);
         return;
     }
 
-    // Determina quais mensagens foram pedidas
-    char *range = cmdline.argv[0];
-    if(strchr(range, ':') == NULL) {
-        // Só foi pedido uma única mensagem
-        a = b = atoi(range);
-    } else {
-        // Range
-        asterisk = (strchr(range, '*') != NULL);
+    // Os demais são os seus argumentos
+    cmdline->cmd = cmd->cmd;
+    cmdline->uid = true;
+    cmdline->argv++;
+    cmdline->argc--;
+
+    cmd->fn(cmdline, session);
+
+    cmdline->argv--;
+    cmdline->argc++;
+}
 
-        token = strtok_r(range,":", &saveptr);
-        a = atoi(token);
+void cmd_lsub(cmdline_t *cmdline, session_t *session) {
+    respond("*", "LSUB", "() \"\" INBOX", session);
+    respond(cmdline->tag, "OK", "LSUB completado.", session);
+}
 
-        token = strtok_r(NULL,"\r\n", &saveptr);
-        b = atoi(token);
+void cmd_idle(cmdline_t *cmdline, session_t *session) {
+    strcpy(session->idletag, cmdline->tag);
+    respond("+", "idling", NULL, session);
 
-        if(b == 0) b = INT32_MAX;
+    // Com uma caixa selecionada, o que mudou até agora vai logo, e o
+    // que mudar depois é avisado pelo inotify
+    if(session->state == SELECTED) {
+        session_check(session);
+        notify_watch(session->box);
     }
+    idle_add(session);
+}
+
+void cmd_noop(cmdline_t *cmdline, session_t *session) {
+    if(session->state == SELECTED)
+        session_check(session);
+    respond(cmdline->tag, "OK", "NOOP Completed", session);
+}
 
-    // Opções
-    options = uppercase(cmdline.argv[1]);
-      flags = (strstr(options, "FLAGS") != NULL);
-       size = (strstr(options, "RFC822.SIZE") != NULL);
-       body = (strstr(options, "BODY") != NULL);
-       peek = (strstr(options, "PEEK") != NULL);
-     header = (strstr(options, "HEADER") != NULL);
-    bstruct = (strstr(options, "BODYSTRUCTURE") != NULL);
+void cmd_logout(cmdline_t *cmdline, session_t *session) {
+    respond("*", "BYE", "LOGOUT", session);
+    respond(cmdline->tag, "OK", "LOGOUT", session);
 
+    // A conexão é fechada pelo loop de eventos
+    session->state = LOGOUT_s;
+}
 
-    // Só mantém o que está entre colchetes
-    if(body)
-        options = strchr(options, '[');
+void cmd_capability(cmdline_t *cmdline, session_t *session) {
+    respond("*", "CAPABILITY", CAPABILITIES, session);
+    respond(cmdline->tag, "OK", "CAPABILITY completed", session);
+}
 
+// Liga o CONDSTORE e o QRESYNC (que também liga o CONDSTORE) na sessão
+// (RFC 5161). As extensões desconhecidas são ignoradas
+void cmd_enable(cmdline_t *cmdline, session_t *session) {
+    char resp[MAXLINE+1] = "ENABLED";
+    int k;
 
-    for(i = 0; i < session->exists; i++) {
-        msg = session->messages[i];
+    if(cmdline->argc < 1) {
+        respond(cmdline->tag, "BAD", "ENABLE Argumentos inválidos", session);
+        return;
+    }
 
-        // Filtra as mensagens com ID dentro do intervalo
-        // e a última se houver um asterisco
-        if((msg.id >= a && msg.id <= b) || (i == session->exists-1 && asterisk)) {
-            // BODYSTRUCTURE
-            if(bstruct) {
-                sprintf(tmp, "%d FETCH (UID %d BODYSTRUCTURE %s)", msg.id, msg.id, msg.bs.str);
-                respond("*", tmp, NULL, session);
-                continue;
-            }
+    for(k = 0; k < cmdline->argc; k++) {
+        if(!strcasecmp(cmdline->argv[k].s, "CONDSTORE") && strstr(resp, " CONDSTORE") == NULL) {
+            session->condstore = true;
+            strcat(resp, " CONDSTORE");
+        } else if(!strcasecmp(cmdline->argv[k].s, "QRESYNC") && strstr(resp, " QRESYNC") == NULL) {
+            session->condstore = session->qresync = true;
+            strcat(resp, " QRESYNC");
+        }
+    }
 
-            // UID
-            sprintf(tmp, "UID %d", msg.id);
+    respond("*", resp, NULL, session);
+    respond(cmdline->tag, "OK", "ENABLE completado", session);
+}
 
-            // Size
-            if(size) sprintf(tmp+strlen(tmp), " RFC822.SIZE %d", msg.fsize);
+void cmd_compress(cmdline_t *cmdline, session_t *session) {
+    if(cmdline->argc != 1 || strcasecmp(cmdline->argv[0].s, "DEFLATE")) {
+        respond(cmdline->tag, "BAD", "COMPRESS Mecanismo inválido", session);
+        return;
+    }
+    if(session->zout) {
+        respond(cmdline->tag, "NO", "[COMPRESSIONACTIVE] COMPRESS já ativo", session);
+        return;
+    }
 
-            // Flags
-            if(flags) {
-                sprintf(tmp+strlen(tmp), " FLAGS (");
-                if(msg.deleted) sprintf(tmp+strlen(tmp), " \\Deleted");
-                if(msg.seen) sprintf(tmp+strlen(tmp), " \\Seen");
-                sprintf(tmp+strlen(tmp), ")");
-            }
+    // A confirmação ainda vai sem compressão, e tudo depois dela vai
+    // comprimido, nos dois sentidos, em DEFLATE puro (sem cabeçalho)
+    respond(cmdline->tag, "OK", "DEFLATE active", session);
 
-            if(!body) {
-                // Só responde de volta
-                sprintf(resp, "%d FETCH (%s)", msg.id, tmp);
-                respond("*", resp, NULL, session);
-            } else {
-                if(header) {
-                    // Retorna só o header
-                    sprintf(resp, "%d FETCH (%s BODY%s {%d}", msg.id, tmp, options, msg.hsize);
-                    respond("*", resp, NULL, session);
-
-                    // Envia o header uma linha por vez
-                    prev = msg.header;
-                    next = strchr(prev, '\n');
-                    while(next != NULL) {
-                        snprintf(resp, strlen(prev)-strlen(next), "%s", prev);
-                        respond(NULL, NULL, resp, session);
-
-                        prev = next+1;
-                        next = strchr(next+1, '\n');
-                    }
-                    respond(NULL, prev, ")", session);
-                    // respond(NULL, ")", NULL, session);
+    session->zout = (z_stream*)calloc(1, sizeof(z_stream));
+    session->zin = (z_stream*)calloc(1, sizeof(z_stream));
+    if(deflateInit2(session->zout, ZLEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+       inflateInit2(session->zin, -15) != Z_OK) {
+        perror("zlib :(\n");
+        exit(10);
+    }
 
-                } else {
-                    // Retorna o arquivo todo
-                    sprintf(resp, "%d FETCH (%s BODY%s {%d}", msg.id, tmp, options, msg.fsize);
-                    respond("*", resp, NULL, session);
-
-                    // Envia o arquivo uma linha por vez
-                    prev = msg.text;
-                    next = strchr(prev, '\n');
-                    while(next != NULL) {
-                        snprintf(resp, strlen(prev)-strlen(next), "%s", prev);
-                        respond(NULL, NULL, resp, session);
-
-                        prev = next+1;
-                        next = strchr(next+1, '\n');
-                    }
-                    respond(NULL, NULL, prev, session);
-                    respond(NULL, ")", NULL, session);
-                }
+    // O restante do que já foi lido chegou comprimido
+    session->zstart = true;
+}
 
-                // Marca a mensagem como lida
-                if(!peek) {
-                    msg.seen = true;
-                    upd_flags(&msg);
-                }
-            }
-        }
+void cmd_fetch(cmdline_t *cmdline, session_t *session) {
+    fetch_t items[FETCHITEMS];
+    int nitems, i, k;
+    char name[NAME_MAX+1], bs[SHAREBS];
+    share_t *box = session->box;
+    set_t set = {NULL, 0, 0}, uids = {NULL, 0, 0};
+    uint64_t changed = 0;
+    bool bstruct = false, modseq = false, vanished = false, gone = false;
+    msg_t msg;
+
+    // Checa número de argumentos, e os modificadores do CONDSTORE e do
+    // QRESYNC: (CHANGEDSINCE modseq [VANISHED])
+    if((cmdline->argc != 2 && cmdline->argc != 3) ||
+       (cmdline->argc == 3 && !fetch_changed(&cmdline->argv[2], &changed, &vanished))) {
+        respond(cmdline->tag, "BAD", "FETCH Argumentos inválidos", session);
+        return;
+    }
+    if(vanished && (!cmdline->uid || !session->qresync)) {
+        respond(cmdline->tag, "BAD", "FETCH VANISHED só vale no UID FETCH com o QRESYNC", session);
+        return;
+    }
+
+    // Libera as mensagens mapeadas se a sessão acumulou muitas
+    if(session->mapped > MAXMAPPED) msg_unmap(session);
+
+    // Determina quais mensagens foram pedidas
+    if(!msg_set(session, cmdline->argv[0].s, cmdline->uid, &set)) {
+        respond(cmdline->tag, "BAD", "FETCH Conjunto de mensagens inválido", session);
+        set_free(&set);
+        return;
+    }
+
+    // Itens pedidos
+    if(!fetch_parse(uppercase(cmdline->argv[1].s), items, &nitems)) {
+        respond(cmdline->tag, "BAD", "FETCH Item inválido", session);
+        set_free(&set);
+        return;
+    }
+    for(k = 0; k < nitems; k++) {
+        if(items[k].item == F_STRUCTURE) bstruct = true;
+        if(items[k].item == F_MODSEQ) modseq = true;
+    }
+
+    // O CHANGEDSINCE também pede o MODSEQ, e os dois ligam o CONDSTORE
+    if(cmdline->argc == 3 && !modseq && nitems < FETCHITEMS) {
+        memset(&items[nitems], 0, sizeof(fetch_t));
+        items[nitems++].item = F_MODSEQ;
+        modseq = true;
+    }
+    if(modseq) session->condstore = true;
+
+    // As remoções dos UIDs pedidos vêm antes
+    if(vanished) {
+        set_parse(&uids, cmdline->argv[0].s, session->uidnext - 1);
+        session_vanished(session, changed, &uids);
+        set_free(&uids);
+    }
+
+    // Só as mensagens pedidas são visitadas, intervalo por intervalo
+    for(k = 0; k < set.n; k++)
+    for(i = set.r[k].lo; i < (int)set.r[k].hi; i++) {
+        // Cópia da mensagem, já que outras sessões podem alterá-la
+        if(!share_msg(box, i, &msg, name, bstruct ? bs : NULL)) break;
+        if(msg.modseq <= changed) continue;
+        if(!fetch_msg(items, nitems, i, &msg, name, bs, session)) gone = true;
     }
+    set_free(&set);
 
-    respond(cmdline.tag, "OK", "FETCH Completado", session);
+    // Uma mensagem cujo arquivo sumiu (removida por outra sessão) fica
+    // sem resposta, e o comando falha
+    if(gone) respond(cmdline->tag, "NO", "FETCH Algumas mensagens não puderam ser lidas", session);
+    else respond(cmdline->tag, "OK", "FETCH Completado", session);
 }
 
-void cmd_store(cmdline_t cmdline, session_t *session) {
-    int id, i;
-    bool seen, deleted, mark;
-    char *flags;
-    msg_t *msg;
+void cmd_store(cmdline_t *cmdline, session_t *session) {
+    int i, k, ret;
+    size_t oplen;
+    bool seen, deleted, mark, replace, silent, failed = false;
+    char *flags, *op;
+    char resp[MAXLINE+1];
+    share_t *box = session->box;
+    uint64_t before;
+    set_t set = {NULL, 0, 0}, modified = {NULL, 0, 0};
+    buf_t line = {NULL, 0, 0};
+    uint64_t unchanged = UINT64_MAX;
+    msg_t msg;
 
-    // Checa número de argumentos
-    if(cmdline.argc != 3) {
-        respond(cmdline.tag, "BAD", "STORE Argumentos inválidos", session);
+    // Checa número de argumentos, e o modificador do CONDSTORE:
+    // (UNCHANGEDSINCE modseq)
+    if((cmdline->argc != 3 && cmdline->argc != 4) ||
+       (cmdline->argc == 4 && !store_unchanged(&cmdline->argv[1], &unchanged))) {
+        respond(cmdline->tag, "BAD", "STORE Argumentos inválidos", session);
         return;
     }
+    if(cmdline->argc == 4) session->condstore = true;
 
-    // Encontra a mensagem especificada
-    id = atoi(cmdline.argv[0]);
-    for(i = 0; i < session->exists; i++) {
-        msg = &session->messages[i];
-        if(msg->id == id)
-            break;
+    // Determina quais mensagens devem ser alteradas
+    if(!msg_set(session, cmdline->argv[0].s, cmdline->uid, &set)) {
+        respond(cmdline->tag, "BAD", "STORE Conjunto de mensagens inválido", session);
+        set_free(&set);
+        return;
     }
 
-    // Verifica se o comando é para adicionar uma flag
-    mark = (cmdline.argv[1][0] == '+');
+    // Verifica se o comando é para adicionar, remover ou substituir as
+    // flags
+         op = cmdline->argv[cmdline->argc - 2].s;
+       mark = (op[0] != '-');
+    replace = (op[0] != '+' && op[0] != '-');
+      oplen = strlen(op);
+     silent = (oplen > 7 && !strcasecmp(op + oplen - 7, ".SILENT"));
 
     // Determina quais flags devem ser gravadas
-      flags = cmdline.argv[2];
+      flags = cmdline->argv[cmdline->argc - 1].s;
        seen = (strstr(flags, "\\Seen") != NULL);
     deleted = (strstr(flags, "\\Deleted") != NULL);
 
-    // Marca ou desmarca as flags pedidas
-    if(seen)    msg->seen    = mark;
-    if(deleted) msg->deleted = mark;
+    for(k = 0; k < set.n && !failed; k++)
+    for(i = set.r[k].lo; i < (int)set.r[k].hi; i++) {
+        if(!share_msg(box, i, &msg, NULL, NULL)) break;
+
+        // Marca ou desmarca as flags pedidas
+        if(replace) {
+            msg.seen    = seen;
+            msg.deleted = deleted;
+        } else {
+            if(seen)    msg.seen    = mark;
+            if(deleted) msg.deleted = mark;
+        }
+
+        // As que mudaram depois do UNCHANGEDSINCE ficam como estão. Se
+        // o diário não puder ser gravado o comando para
+        before = msg.modseq;
+        if((ret = upd_flags(&msg, unchanged, session)) == -1) {
+            failed = true;
+            break;
+        }
+        if(ret == 0) {
+            set_add(&modified, cmdline->uid ? (uint32_t)msg.id : (uint32_t)i + 1);
+            continue;
+        }
+
+        // Envia as flags novas, a não ser com o .SILENT. Com o CONDSTORE
+        // vai também o modseq, mesmo com o .SILENT se ele mudou
+        if(silent && !(session->condstore && msg.modseq != before)) continue;
+        sprintf(resp, "%d FETCH (UID %d", i+1, msg.id);
+        if(!silent) msg_flags(&msg, resp);
+        if(session->condstore) sprintf(resp + strlen(resp), " MODSEQ (%llu)", (unsigned long long)msg.modseq);
+        strcat(resp, ")");
+        respond("*", resp, NULL, session);
+    }
+    set_free(&set);
+
+    // As mensagens que não foram alteradas vão no [MODIFIED]
+    if(failed) {
+        respond(cmdline->tag, "NO", "STORE Não foi possível gravar as flags", session);
+    } else if(modified.n > 0) {
+        buf_append(&line, "[MODIFIED ", 10);
+        set_write(&line, &modified);
+        buf_append(&line, "] STORE condicional falhou", 26);
+        buf_append(&line, "", 1);
+        respond(cmdline->tag, "OK", line.data, session);
+    } else {
+        respond(cmdline->tag, "OK", "STORE completed", session);
+    }
+    buf_free(&line);
+    set_free(&modified);
+}
+
+void cmd_search(cmdline_t *cmdline, session_t *session) {
+    buf_t line = {NULL, 0, 0};
+    slice_t *argv = cmdline->argv;
+    int argc = cmdline->argc, n, k;
+    sortmsg_t *hits;
+    uint64_t modseq;
+    char num[32];
+
+    // Só o ASCII é aceito, e o UTF-8, do qual ele é parte
+    if(argc >= 2 && !strcasecmp(argv[0].s, "CHARSET")) {
+        if(!search_charset(argv[1].s)) {
+            respond(cmdline->tag, "NO", "[BADCHARSET (US-ASCII UTF-8)] SEARCH Charset não suportado", session);
+            return;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
+    if((n = search_all(argv, argc, session, &hits, &modseq)) == -1) {
+        respond(cmdline->tag, "BAD", "SEARCH Critério inválido", session);
+        return;
+    }
+
+    // Com o critério MODSEQ, o maior modseq das mensagens encontradas
+    // vai no final
+    buf_append(&line, "SEARCH", 6);
+    for(k = 0; k < n; k++) {
+        sprintf(num, " %u", cmdline->uid ? hits[k].uid : (uint32_t)hits[k].i + 1);
+        buf_append(&line, num, strlen(num));
+    }
+    if(modseq > 0) {
+        sprintf(num, " (MODSEQ %llu)", (unsigned long long)modseq);
+        buf_append(&line, num, strlen(num));
+    }
+    buf_append(&line, "", 1);
+
+    respond("*", line.data, NULL, session);
+    respond(cmdline->tag, "OK", "SEARCH completado", session);
+
+    buf_free(&line);
+    sort_free(hits, n);
+}
+
+// SORT (critérios) charset critérios-do-SEARCH (RFC 5256). As mensagens
+// são comparadas só pelas chaves guardadas no índice da caixa
+void cmd_sort(cmdline_t *cmdline, session_t *session) {
+    buf_t line = {NULL, 0, 0};
+    sortmsg_t *hits;
+    uint64_t modseq;
+    sort_t sort;
+    char num[32];
+    int n, k;
+
+    if(cmdline->argc < 3 || cmdline->argv[0].kind != '(' || !sort_parse(cmdline->argv[0].s, &sort)) {
+        respond(cmdline->tag, "BAD", "SORT Critério de ordenação inválido", session);
+        return;
+    }
+    if(!search_charset(cmdline->argv[1].s)) {
+        respond(cmdline->tag, "NO", "[BADCHARSET (US-ASCII UTF-8)] SORT Charset não suportado", session);
+        return;
+    }
+    if((n = search_all(cmdline->argv + 2, cmdline->argc - 2, session, &hits, &modseq)) == -1) {
+        respond(cmdline->tag, "BAD", "SORT Critério inválido", session);
+        return;
+    }
+
+    search_keys(hits, n, session);
+    qsort_r(hits, n, sizeof(sortmsg_t), sort_cmp, &sort);
+
+    buf_append(&line, "SORT", 4);
+    for(k = 0; k < n; k++) {
+        sprintf(num, " %u", cmdline->uid ? hits[k].uid : (uint32_t)hits[k].i + 1);
+        buf_append(&line, num, strlen(num));
+    }
+    if(modseq > 0) {
+        sprintf(num, " (MODSEQ %llu)", (unsigned long long)modseq);
+        buf_append(&line, num, strlen(num));
+    }
+    buf_append(&line, "", 1);
+
+    respond("*", line.data, NULL, session);
+    respond(cmdline->tag, "OK", "SORT completado", session);
+
+    buf_free(&line);
+    sort_free(hits, n);
+}
+
+// THREAD algoritmo charset critérios-do-SEARCH (RFC 5256), com os
+// algoritmos ORDEREDSUBJECT e REFERENCES
+void cmd_thread(cmdline_t *cmdline, session_t *session) {
+    thread_t thread = {NULL, 0, 0, NULL};
+    buf_t line = {NULL, 0, 0};
+    sortmsg_t *hits;
+    uint64_t modseq;
+    bool refs;
+    int n;
+
+    if(cmdline->argc < 3 || (strcasecmp(cmdline->argv[0].s, "REFERENCES") && strcasecmp(cmdline->argv[0].s, "ORDEREDSUBJECT"))) {
+        respond(cmdline->tag, "BAD", "THREAD Algoritmo inválido", session);
+        return;
+    }
+    if(!search_charset(cmdline->argv[1].s)) {
+        respond(cmdline->tag, "NO", "[BADCHARSET (US-ASCII UTF-8)] THREAD Charset não suportado", session);
+        return;
+    }
+    if((n = search_all(cmdline->argv + 2, cmdline->argc - 2, session, &hits, &modseq)) == -1) {
+        respond(cmdline->tag, "BAD", "THREAD Critério inválido", session);
+        return;
+    }
+
+    search_keys(hits, n, session);
+    refs = !strcasecmp(cmdline->argv[0].s, "REFERENCES");
+    if(refs) thread_references(&thread, hits, n);
+    else thread_ordered(&thread, hits, n);
 
-    upd_flags(msg);
+    buf_append(&line, "THREAD ", 7);
+    thread_write(&line, &thread, cmdline->uid);
+    buf_append(&line, "", 1);
 
-    respond(cmdline.tag, "OK", "STORE completed", session);
+    respond("*", line.data, NULL, session);
+    respond(cmdline->tag, "OK", "THREAD completado", session);
+
+    buf_free(&line);
+    free(thread.nodes);
+    sort_free(hits, n);
 }
 
-void cmd_list(cmdline_t cmdline, session_t *session) {
-    char *dir = cmdline.argv[1];
+void cmd_list(cmdline_t *cmdline, session_t *session) {
+    char *dir;
+
+    // Checa número de argumentos
+    if(cmdline->argc != 2) {
+        respond(cmdline->tag, "BAD", "LIST Argumentos inválidos", session);
+        return;
+    }
+
+    dir = cmdline->argv[1].s;
     if(!strcmp(dir, "*") || !strcmp(dir, "INBOX")) {
         respond("*", "LIST", "() \"\" INBOX", session);
     }
-    respond(cmdline.tag, "OK", "LIST completado.", session);
+    respond(cmdline->tag, "OK", "LIST completado.", session);
+}
+
+// Recebe uma mensagem para a INBOX, ou várias com o MULTIAPPEND (RFC
+// 3502), cada uma com as flags e a data de entrega opcionais. O
+// conteúdo vem no literal depois do comando e é gravado em 'tmp/' à
+// medida que chega; a confirmação só é enviada depois do fsync em grupo
+void cmd_append(cmdline_t *cmdline, session_t *session) {
+    slice_t *argv = cmdline->argv;
+    int argc = cmdline->argc, k, start;
+    size_t pending = cmdline->literal > 0 ? (size_t)cmdline->literal : 0;
+
+    // O literal passa a ser do APPEND, mesmo que ele seja recusado
+    snprintf(session->appendtag, sizeof(session->appendtag), "%s", cmdline->tag);
+    session->appending = true;
+    if(argc < 1) {
+        append_fail(session, "BAD", "APPEND Argumentos inválidos", pending, cmdline->sync);
+    } else if(argv[0].len != 5 || strncasecmp(argv[0].s, "INBOX", 5) != 0) {
+        append_fail(session, "NO", "[TRYCREATE] APPEND Não existe esse diretório", pending, cmdline->sync);
+    } else if(cmdline->literal >= 0) {
+        if(append_begin(session, argv + 1, argc - 1, cmdline->literal, cmdline->sync) && cmdline->sync)
+            respond("+", "Pronto para o literal", NULL, session);
+    } else {
+        // Com a caixa num literal, o comando chega inteiro pelo caminho
+        // normal, com as mensagens entre os argumentos
+        for(k = start = 1; k < argc; k++) {
+            if(argv[k].kind != '{') continue;
+            if(!append_begin(session, argv + start, k - start, argv[k].len, true)) return;
+            append_data(session, argv[k].s, argv[k].len);
+            start = k + 1;
+        }
+        if(start == 1 || start != argc)
+            append_fail(session, "BAD", "APPEND Argumentos inválidos", 0, true);
+        else
+            append_end(session);
+    }
+    cmdline->literal = -1;
 }
 
-void cmd_select(cmdline_t cmdline, session_t *session) {
-    char inbox[MAXLINE+1], resp[MAXLINE+1];
+void cmd_select(cmdline_t *cmdline, session_t *session) {
+    char resp[MAXLINE+1];
     char path[MAXLINE+1];
-    FTS *dir;
-    FTSENT *file, *children;
-    int fts_options = FTS_LOGICAL | FTS_NOCHDIR;
+    slice_t *param = NULL;
+    int i, exists, ret, n = 0, cap = 0;
     msg_t msg;
 
-    // Checa argumentos
-    if(cmdline.argc != 1) {
-        respond(cmdline.tag, "BAD", "Argumentos inválidos.", session);
+    // Checa argumentos. O parâmetro pode ser o CONDSTORE ou o QRESYNC
+    // com o estado que o cliente conhece, que é conferido depois
+    if(cmdline->argc == 2 && cmdline->argv[1].kind == '(' &&
+       parse_args(cmdline->argv[1].s, cmdline->argv[1].s + cmdline->argv[1].len, &param, &n, &cap) != -1 &&
+       ((n == 1 && !strcasecmp(param[0].s, "CONDSTORE")) ||
+        (n == 2 && !strcasecmp(param[0].s, "QRESYNC") && param[1].kind == '(' && session->qresync))) {
+        session->condstore = true;
+    } else if(cmdline->argc != 1) {
+        respond(cmdline->tag, "BAD", "Argumentos inválidos.", session);
+        free(param);
         return;
     }
 
     // Só existe a pasta INBOX
-    unquote(inbox, cmdline.argv[0], '\"', '\"');
-    if(strcmp(inbox, "INBOX") != 0) {
-        respond(cmdline.tag, "NO", "Não existe esse diretório.", session);
+    if(strcasecmp(cmdline->argv[0].s, "INBOX") != 0) {
+        respond(cmdline->tag, "NO", "Não existe esse diretório.", session);
+        free(param);
         return;
     }
 
+    // Com o QRESYNC, o cliente fica sabendo que a caixa anterior foi
+    // fechada, já que as respostas seguintes são da nova
+    if(session->state == SELECTED && session->qresync)
+        respond("*", "OK", "[CLOSED]", session);
+
     // Flags
     respond("*", "FLAGS", "(\\Deleted \\Seen)", session);
     respond("*", "OK", "[PERMANENTFLAGS (\\Deleted \\Seen)]", session);
 
-    // Vê as mensagens existentes
-    sprintf(path, "%s/Maildir/cur", session->user);
+    // Vê as mensagens existentes, pela caixa compartilhada com as outras
+    // sessões do usuário se 'cur/' não mudou. O conteúdo é mapeado
+    // quando for pedido
+    msg_unmap(session);
+    if(session->box == NULL && (session->box = share_get(session->user)) == NULL) {
+        respond(cmdline->tag, "NO", "SELECT Caixa indisponível", session);
+        free(param);
+        return;
+    }
 
-    char* const argv[] = {path, NULL};
-    if((dir = fts_open(argv, fts_options, NULL)) == NULL) {
+    sprintf(path, "%s/Maildir", session->user);
+    if((ret = share_open(session->box, path)) == -1) {
         perror("Não foi possível abrir o diretório 'cur'.\n");
         exit(7);
+    } else if(ret == -2) {
+        respond(cmdline->tag, "NO", "SELECT Caixa grande demais", session);
+        free(param);
+        return;
     }
 
-    session->exists = 0; // Inicia contador de mensagens
-    children = fts_children(dir, 0);
-    if(children != NULL) {
-        while((file = fts_read(dir)) != NULL) {
-            if(file->fts_info != FTS_F) continue;
-
-            // Se é um arquivo, processa seu conteúdo e guarda
-            // na sessão
-            msg = parse_title(file);
-            parse_msg(&msg, session);
-            session->messages[session->exists++] = msg;
-        }
-    }
-
-
-    // Número de mensagens existentes
-    sprintf(resp, "%d", session->exists);
+    // Número de mensagens existentes, visto junto com o estado da caixa
+    // a partir do qual as mudanças são avisadas
+    session_update(session, false);
+    exists = session->exists;
+    sprintf(resp, "%d", exists);
     respond("*", resp, "EXISTS", session);
-    respond("*", "0", "RECENT", session);
+    sprintf(resp, "%d", session->recent);
+    respond("*", resp, "RECENT", session);
 
-    // Primeira não-lida e provável próxima
+    // Número de sequência da primeira não-lida
     session->unseen = 0;
-    for(int i = 0; i < session->exists; i++) {
-        if(!session->messages[i].seen) {
-            session->unseen = session->messages[i].id;
+    for(i = 0; share_msg(session->box, i, &msg, NULL, NULL); i++) {
+        if(!msg.seen) {
+            session->unseen = i+1;
             break;
         }
     }
@@ -338,41 +932,45 @@ void cmd_select(cmdline_t cmdline, session_t *session) {
         respond("*", "OK", resp, session);
     }
 
-    if(session->unseen + 1 < session->exists) {
-        sprintf(resp, "[UIDNEXT %d]", session->unseen+1);
-        respond("*", resp, NULL, session);
-    }
+    // Os UIDs só mudam junto com o UIDVALIDITY, e o UIDNEXT é o que a
+    // próxima mensagem vai receber
+    sprintf(resp, "[UIDVALIDITY %u]", session->box->hdr->uidvalidity);
+    respond("*", "OK", resp, session);
+    sprintf(resp, "[UIDNEXT %u]", session->uidnext);
+    respond("*", "OK", resp, session);
+
+    // O maior modseq da caixa, a partir do qual o cliente pode pedir o
+    // que mudou na próxima vez, e o que mudou desde a última
+    sprintf(resp, "[HIGHESTMODSEQ %llu]", (unsigned long long)session->modseq);
+    respond("*", "OK", resp, session);
+    if(n == 2) session_resync(session, &param[1]);
+    free(param);
 
     // Finaliza
-    respond(cmdline.tag, "OK", "[READ-WRITE] SELECT completado", session);
+    respond(cmdline->tag, "OK", "[READ-WRITE] SELECT completado", session);
 
     session->state = SELECTED;
-    fts_close(dir);
 }
 
-void cmd_login(cmdline_t cmdline, session_t *session) {
+void cmd_login(cmdline_t *cmdline, session_t *session) {
     int i;
     char *login, *password;
 
     // Checa se os argumentos estão corretos
-    if(cmdline.argc != 2) {
-        respond(cmdline.tag, "BAD", "Argumentos inválidos.", session);
+    if(cmdline->argc != 2) {
+        respond(cmdline->tag, "BAD", "Argumentos inválidos.", session);
         return;
     }
 
     // Verifica se o par (login, senha) se encontra na lista de logins
-    login    = cmdline.argv[0];
-    password = cmdline.argv[1];
-
-    // Remove aspas
-    unquote(login, login, '\"', '\"');
-    unquote(password, password, '\"', '\"');
+    login    = cmdline->argv[0].s;
+    password = cmdline->argv[1].s;
 
     for(i = 0; i < loginc; i++) {
         if(!strcmp(login, loginv[i][0]) && !strcmp(password, loginv[i][1])) {
             // O login é válido
 
-            respond(cmdline.tag, "OK", "LOGIN", session);
+            respond(cmdline->tag, "OK", "LOGIN", session);
             session->user = loginv[i][0];
             session->state = AUTHENTICATED;
             return;
@@ -380,232 +978,2200 @@ void cmd_login(cmdline_t cmdline, session_t *session) {
     }
 
     // O login é inválido se não está na lista
-    respond(cmdline.tag, "NO", "LOGIN", session);
+    respond(cmdline->tag, "NO", "LOGIN", session);
     return;
 }
 
-// Extrai as flags de uma mensagem a partir de seu título
-msg_t parse_title(FTSENT *file) {
-    char *token, *saveptr, filename[MAXLINE+1];
-    msg_t msg;
+// Envia uma linha de resposta para o cliente
+// e imprime o log localmente
+void respond(char const *tag, char const *status, char const *message, session_t *session) {
+    char const *parts[3] = {tag, status, message};
+    outq_t *out = session_queue(session);
+    size_t start = out->buf.len;
     int i;
 
-    msg.file = file;
-    strcpy(filename, file->fts_name);
+    // Escreve a linha de resposta direto na fila de saída da sessão
+    for(i = 0; i < 3; i++) {
+        if(parts[i] == NULL) continue;
+        if(out->buf.len > start) out_copy(out, " ", 1);
+        out_copy(out, parts[i], strlen(parts[i]));
+    }
+    out_copy(out, "\r\n", 2);
 
-    // Primeira parte do nome é o id
-    token = strtok_r(filename, ":", &saveptr);
-    msg.id = atoi(token);
+    // Registra a resposta
+    if(session->trace)
+        log_data(session->id, "S", out->buf.data + start, out->buf.len - start);
 
-    // Versão do Maildir
-    token = strtok_r(NULL, ",", &saveptr);
+    session_hiwat(session);
+}
 
-    // Flags
-    msg.seen = false;
-    msg.deleted = false;
-    token = strtok_r(NULL, "\n\r", &saveptr);
-    if(!token)
-        return msg;
-
-    for(i = 0; i < (int)strlen(token); i++) {
-        switch(token[i]) {
-            case 'S':
-                msg.seen = true;
-                break;
-            case 'D':
-                msg.deleted = true;
-                break;
-            default:
-                break;
-        }
-    }
+// Envia os 'len' bytes de 'data' sem copiá-los, como o conteúdo de um
+// literal. 'data' precisa continuar válido até ser enviado, o que é
+// garantido porque os comandos seguintes esperam esse envio
+void respond_data(char const *data, size_t len, session_t *session) {
+    out_ref(session_queue(session), data, len);
 
-    return msg;
+    if(session->trace)
+        log_data(session->id, "S", data, len);
+
+    session_hiwat(session);
 }
 
-// Envia uma linha de resposta para o cliente
-// e imprime o log localmente
-void respond(char const *tag, char const *status, char const *message, session_t *session) {
-    char resp[MAXLINE+1];
+// Envia uma cópia dos 'len' bytes de 'data', que podem ser liberados em
+// seguida, como o conteúdo de um literal
+void respond_copy(char const *data, size_t len, session_t *session) {
+    out_copy(session_queue(session), data, len);
+
+    if(session->trace)
+        log_data(session->id, "S", data, len);
+
+    session_hiwat(session);
+}
 
-    // Escreve a linha de resposta pro cliente
-    resp[0] = 0;
-    if(tag) sprintf(resp+strlen(resp), "%s ", tag);
-    if(status) sprintf(resp+strlen(resp), "%s ", status);
-    if(message) sprintf(resp+strlen(resp), "%s ", message);
+// Envia os 'len' primeiros bytes do arquivo aberto 'fd' como o conteúdo
+// de um literal, sem passar pela memória do processo: com sendfile, ou
+// mapeando o arquivo no io_uring (que não tem um envio de arquivos) e
+// quando ele precisa ser comprimido. O arquivo é fechado depois de
+// enviado
+void respond_file(int fd, size_t len, session_t *session) {
+    out_file(session_queue(session), fd, len, uring_on || session->zout);
 
-    sprintf(resp+strlen(resp)-1, "\r\n");
-    write(session->connfd, resp, strlen(resp));
+    if(session->trace)
+        log_printf(LOG_TRACE, "%d S: [%zu bytes do arquivo]\n", session->id, len);
 
-    // Imprime localmente a resposta
-    printf("%d S: %s", session->pid, resp);
+    session_hiwat(session);
 }
 
-// Retorna o ID do comando a partir do nome
-// (-1 se não for encontrado na lista)
-cmd_t findcmd(char const name[MAXLINE+1]) {
-    int i;
+// Fila em que as respostas são escritas: a de saída, ou a que ainda
+// vai ser comprimida
+outq_t *session_queue(session_t *session) {
+    return session->zout ? &session->zplain : &session->out;
+}
 
-    // Encontra o comando na lista
-    for(i = 0; strcmp(commands[i], ""); i++)
-        if(!strcmp(name, commands[i])) {
-            return (cmd_t)i;
-        }
-
-    return (cmd_t)-1;
-}
-
-// Extrai o conteúdo de uma mensagem e armazena de forma estruturada,
-// para que não seja necessário abrir o arquivo referente novamente
-void parse_msg(msg_t *msg, session_t *session) {
-    FILE *file;
-    char line[MAXLINE+1], parts[10][MAXLINE+1], boundary[MAXLINE+1],
-    lang[MAXLINE+1], disposition[MAXLINE+1], type[MAXLINE+1], encoding[MAXLINE+1],
-    filename[MAXLINE+1];
-    char *s;
-    bool header, multipart, content, text;
-    int part, plines;
-
-    // Pega o caminho até o arquivo
-    sprintf(msg->filepath, "%s/Maildir/cur/%s", session->user, msg->file->fts_name);
-
-    // Abre o arquivo
-    file = fopen(msg->filepath, "r");
-    if(!file) {
-        perror(filename);
-        exit(9);
-    }
-
-    // Aloca espaço para guardar o arquivo todo
-    msg->fsize = msg->file->fts_statp->st_size;
-    msg->text = (char*)malloc((msg->fsize+1)*sizeof(char));
-    msg->text[0] = 0;
-
-    // Calcula o tamanho do header, a quantidade de linhas
-    // e armazena a BODYSTRUCTURE
-    msg->flines = 0;
-    msg->hlines = 0;
-    msg->hsize = 0;
-    header = true; multipart = false; content = false;
-    part = 0;
-    msg->bs.psize[part] = 0;
-    while(fgets(line, MAXLINE, file) != NULL) {
-        strcat(msg->text, line);
-        msg->flines++;
-
-        if(header) {
-            msg->hsize += strlen(line);
-            msg->hlines++;
-        }
-
-        // BODYSTRUCTURE
-        if(strstr(line, "boundary")) {
-            // Divisão entre as partes da mensagem
-            unquote(boundary, line, '\"', '\"');
-            header = false;
-
-        } else if(strstr(line, "Content-Language")) {
-            // O idioma do texto
-            trim(lang, strchr(line, ' '));
-
-        } else if(strstr(line, "Content-Type")) {
-            // Tipo da parte
-            if(!multipart) header = false;
-
-            // A mensagem tem mais de uma parte
-            if(strstr(line, "multipart/mixed")) {
-                multipart = true;
-                continue;
-            }
+// Sem io_uring, a fila é enviada assim que cresce demais, mesmo no
+// meio de um comando. A compressão continua sem forçar a descarga do
+// zlib, que só acontece no fim do lote de comandos
+void session_hiwat(session_t *session) {
+    outq_t *q = session_queue(session);
 
-            // Encontrou o começo de uma parte
-            part++;
-            msg->bs.psize[part] = 0;
-            plines = 0;
-            if(strstr(line, "text/plain")) {
-                strcpy(type, "\"text\" \"plain\" (\"charset\" \"utf-8\" \"format\" \"flowed\")");
-                text = true;
-            }
+    if(uring_on || q->len - q->sent < OUTHIWAT) return;
+
+    session_deflate(session, Z_NO_FLUSH);
+    session_write(session);
+}
 
-            if (strstr(line, "application/pdf")) {
-                // Nome do arquivo
-                unquote(filename, line, '\"', '\"');
+// Envia todas as respostas acumuladas. Com compressão, o zlib
+// descarrega tudo o que recebeu (Z_SYNC_FLUSH), para que o cliente
+// possa ler as respostas inteiras, inclusive as do IDLE
+int session_flush(session_t *session) {
+    session_deflate(session, Z_SYNC_FLUSH);
+    return session_write(session);
+}
 
-                sprintf(type, "\"application\" \"pdf\" (\"name\" \"%s\")", filename);
-                text = false;
+// Comprime para a fila de saída o que estiver esperando compressão.
+// 'flush' é repassado ao zlib: com Z_NO_FLUSH ele pode guardar parte
+// dos dados para comprimir melhor
+void session_deflate(session_t *session, int flush) {
+    z_stream *z = session->zout;
+    outq_t *plain = &session->zplain, *out = &session->out;
+    struct iovec iov[OUTIOV];
+    int i, n;
+
+    if(z == NULL) return;
+    if(plain->sent == plain->len && (flush == Z_NO_FLUSH || !session->zdirty)) return;
+
+    // Passa os trechos pendentes pelo zlib, escrevendo direto no final
+    // do buffer da fila de saída
+    while(plain->sent < plain->len) {
+        n = out_iov(plain, iov, OUTIOV);
+        for(i = 0; i < n; i++) {
+            z->next_in = (Bytef*)iov[i].iov_base;
+            z->avail_in = iov[i].iov_len;
+            while(z->avail_in > 0) {
+                buf_reserve(&out->buf, ZCHUNK);
+                z->next_out = (Bytef*)out->buf.data + out->buf.len;
+                z->avail_out = ZCHUNK;
+                deflate(z, Z_NO_FLUSH);
+                out_commit(out, ZCHUNK - z->avail_out);
             }
+            out_sent(plain, iov[i].iov_len);
+        }
+    }
+    session->zdirty = true;
+
+    if(flush == Z_NO_FLUSH) return;
+
+    do {
+        buf_reserve(&out->buf, ZCHUNK);
+        z->next_out = (Bytef*)out->buf.data + out->buf.len;
+        z->avail_out = ZCHUNK;
+        deflate(z, flush);
+        out_commit(out, ZCHUNK - z->avail_out);
+    } while(z->avail_out == 0);
+    session->zdirty = false;
+}
+
+// Descomprime o que chegou em 'session->zraw' para o final do buffer
+// de entrada. Retorna -1 se os dados forem inválidos
+int session_inflate(session_t *session) {
+    z_stream *z = session->zin;
+    buf_t *in = &session->in, *raw = &session->zraw;
+    int ret;
+
+    z->next_in = (Bytef*)raw->data;
+    z->avail_in = raw->len;
+    while(z->avail_in > 0) {
+        buf_reserve(in, ZCHUNK);
+        z->next_out = (Bytef*)in->data + in->len;
+        z->avail_out = in->cap - in->len;
+        ret = inflate(z, Z_SYNC_FLUSH);
+        in->len = in->cap - z->avail_out;
+        if(ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+        if(ret == Z_BUF_ERROR && z->avail_out > 0) return -1;
+    }
+    raw->len = 0;
+
+    return 0;
+}
 
+// Envia o que for possível da fila de saída sem bloquear, com uma
+// chamada writev para vários trechos de uma vez e sendfile para os
+// arquivos. Se o buffer do kernel encher, 'sending' fica marcado até o
+// loop de eventos avisar que o socket pode ser escrito de novo.
+// Retorna -1 se a conexão falhou
+int session_write(session_t *session) {
+    struct iovec iov[OUTIOV];
+    ssize_t n;
+    int niov;
+
+    while(session->out.sent < session->out.len) {
+        if((niov = out_iov(&session->out, iov, OUTIOV)) > 0)
+            n = writev(session->connfd, iov, niov);
+        else
+            n = out_sendfile(&session->out, session->connfd);
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+            session->sending = true;
+            return 0;
         }
+        out_sent(&session->out, n);
+    }
+
+    session->sending = false;
+    return 0;
+}
+
+// Cria uma sessão nova para a conexão 'connfd'
+session_t *session_new(int connfd) {
+    static int nsessions = 0;
+    session_t *session;
+    int one = 1;
+
+    session = (session_t*)calloc(1, sizeof(session_t));
+    session->id = ++nsessions;
+    session->connfd = connfd;
+    session->user = NULL;
+    session->state = NOTAUTHENTICATED;
+    session->appendfd = -1;
+    session->trace = (log_level >= LOG_TRACE && session->id % log_sample == 0);
+
+    // As respostas já são agrupadas por comando, então o algoritmo de
+    // Nagle só atrasaria o envio
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return session;
+}
+
+// Fecha a conexão e libera todos os recursos da sessão
+void session_free(session_t *session) {
+    char path[MAXLINE+1];
+
+    msg_unmap(session);
+    free(session->maps);
+    if(session->idle) idle_del(session);
+
+    // As mensagens de um APPEND não confirmado são descartadas
+    if(session->committing) {
+        committers[session->commitpos] = committers[--ncommit];
+        committers[session->commitpos]->commitpos = session->commitpos;
+    }
+    append_clear(session, true);
+    free(session->staged);
+
+    if(session->box != NULL) {
+        sprintf(path, "%s/Maildir", session->user);
+        share_flush(session->box, path);
+        share_save(session->box, path);
+        if(session->box->refs == 1) notify_unwatch(session->box);
+        share_put(session->box);
+    }
+    free(session->cmdline.argv);
+    set_free(&session->recents);
+    buf_free(&session->in);
+    out_free(&session->out);
+    if(session->zout) {
+        deflateEnd(session->zout);
+        inflateEnd(session->zin);
+        free(session->zout);
+        free(session->zin);
+    }
+    out_free(&session->zplain);
+    buf_free(&session->zraw);
+    close(session->connfd);
+    free(session);
+}
 
-        if(strstr(line, "Content-Disposition")) {
-            strcpy(disposition, "(\"attachment\" (\"filename\" \"enunciado.pdf\"))");
+// Relê a caixa selecionada, se 'cur/' mudou, e envia as mudanças
+void session_check(session_t *session) {
+    char path[MAXLINE+1];
+
+    sprintf(path, "%s/Maildir", session->user);
+    if(share_open(session->box, path) == -1)
+        perror(path);
+    session_update(session, true);
+}
+
+// Envia as mudanças da caixa desde a última vez que a sessão a viu (se
+// 'report'): as remoções que estão no registro do segmento (num VANISHED,
+// com o QRESYNC), a nova
+// quantidade de mensagens (e quantas delas são recentes para a sessão)
+// e as flags das mensagens com 'modseq' maior.
+// As remoções vão da última para a primeira, para que o número de
+// sequência das anteriores não mude. Se o registro já perdeu remoções
+// que a sessão não viu, ela é encerrada. Retorna true se alguma
+// resposta foi enviada
+bool session_update(session_t *session, bool report) {
+    share_t *box = session->box;
+    sharehdr_t *hdr = box->hdr;
+    char resp[MAXLINE+1];
+    buf_t vanished = {NULL, 0, 0};
+    set_t gone = {NULL, 0, 0};
+    uint32_t *uids;
+    uint64_t e;
+    int i, n = 0, sent = 0, recent;
+
+    if(report && __atomic_load_n(&hdr->modseq, __ATOMIC_ACQUIRE) == session->modseq)
+        return false;
+
+    share_lock(box);
+    if(report && (hdr->nexp < session->nexp || (hdr->nexp > SHAREEXP && hdr->nexp - SHAREEXP > session->nexp))) {
+        share_unlock(box);
+        respond("*", "BYE", "Caixa alterada demais, selecione de novo", session);
+        session->state = LOGOUT_s;
+        return true;
+    }
+
+    if(report) {
+        // UIDs removidos que a sessão conhecia, sem repetições
+        uids = (uint32_t*)malloc((hdr->nexp - session->nexp + 1)*sizeof(uint32_t));
+        for(e = session->nexp; e < hdr->nexp; e++)
+            if(box->exps[e % SHAREEXP].uid < session->uidnext)
+                uids[n++] = box->exps[e % SHAREEXP].uid;
+        qsort(uids, n, sizeof(uint32_t), uid_cmp);
+        for(e = i = 0; i < n; i++)
+            if(i == 0 || uids[i] != uids[i-1]) uids[e++] = uids[i];
+        n = e;
+
+        // Com o QRESYNC, os UIDs vão todos num VANISHED
+        if(session->qresync && n > 0) {
+            for(i = 0; i < n; i++) set_add(&gone, uids[i]);
+            buf_append(&vanished, "VANISHED ", 9);
+            set_write(&vanished, &gone);
+            buf_append(&vanished, "", 1);
+            respond("*", vanished.data, NULL, session);
+            buf_free(&vanished);
+            set_free(&gone);
+            sent++;
+        }
+        for(i = n-1; i >= 0 && !session->qresync; i--) {
+            sprintf(resp, "%d", share_uid(box, uids[i]) + i + 1);
+            respond("*", resp, "EXPUNGE", session);
+            sent++;
         }
+        free(uids);
 
-        if (strstr(line, "Content-Transfer-Encoding")) {
-            // Codificação da parte
+        if(hdr->exists != session->exists - n) {
+            sprintf(resp, "%d", hdr->exists);
+            respond("*", resp, "EXISTS", session);
+            sent++;
+        }
 
-            trim(encoding, strchr(line, ' '));
+        if((recent = share_recent(box, session->uidnext, &session->recents)) > 0) {
+            session->recent += recent;
+            sprintf(resp, "%d", session->recent);
+            respond("*", resp, "RECENT", session);
+        }
 
-            // Começa o conteúdo de fato
-            content = true;
-            msg->bs.parts[part] = &(msg->text[strlen(msg->text)+1]);
+        for(i = 0; i < hdr->exists; i++) {
+            if(box->msgs[i].modseq <= session->modseq || (uint32_t)box->msgs[i].id >= session->uidnext)
+                continue;
+            sprintf(resp, "%d FETCH (UID %d", i+1, box->msgs[i].id);
+            msg_flags(&box->msgs[i], resp);
+            if(session->condstore) sprintf(resp + strlen(resp), " MODSEQ (%llu)", (unsigned long long)box->msgs[i].modseq);
+            strcat(resp, ")");
+            respond("*", resp, NULL, session);
+            sent++;
         }
+    } else {
+        session->recents.n = 0;
+        session->recent = share_recent(box, 0, &session->recents);
+    }
+
+    session->modseq = hdr->modseq;
+    session->nexp = hdr->nexp;
+    session->exists = hdr->exists;
+    session->uidnext = hdr->uidnext;
+    share_unlock(box);
+
+    return sent > 0;
+}
+
+// Envia o VANISHED (EARLIER) com os UIDs de 'uids' (todos, se for NULL)
+// removidos depois de 'modseq'. Os removidos depois do que a sessão já
+// viu ficam para o session_update
+void session_vanished(session_t *session, uint64_t modseq, set_t const *uids) {
+    set_t gone = {NULL, 0, 0};
+    buf_t line = {NULL, 0, 0};
+
+    share_vanished(session->box, modseq, session->modseq, uids, &gone);
+    if(gone.n > 0) {
+        buf_append(&line, "VANISHED (EARLIER) ", 19);
+        set_write(&line, &gone);
+        buf_append(&line, "", 1);
+        respond("*", line.data, NULL, session);
+    }
+
+    buf_free(&line);
+    set_free(&gone);
+}
+
+// Envia, no SELECT com o QRESYNC, o que mudou desde o estado que o
+// cliente conhece, 'arg' = "uidvalidity modseq [uids] [(seqs uids)]":
+// os UIDs removidos, num VANISHED (EARLIER), e as flags das mensagens
+// alteradas, só entre os UIDs dados. Nada é enviado se o UIDVALIDITY não
+// for o da caixa. Os pares de números de sequência e UIDs, que ajudam a
+// achar as remoções, não são necessários com o registro do segmento
+void session_resync(session_t *session, slice_t const *arg) {
+    slice_t *v = NULL;
+    set_t uids = {NULL, 0, 0};
+    char resp[MAXLINE+1];
+    char const *p;
+    uint64_t validity, modseq;
+    bool known;
+    int i, n = 0, cap = 0;
+    msg_t msg;
+
+    if(parse_args(arg->s, arg->s + arg->len, &v, &n, &cap) == -1 || n < 2 || n > 4 ||
+       (p = modseq_num(v[0].s, &validity)) == NULL || *p != 0 || validity != session->box->hdr->uidvalidity ||
+       (p = modseq_num(v[1].s, &modseq)) == NULL || *p != 0) {
+        free(v);
+        return;
+    }
+    known = (n >= 3 && v[2].kind == 0);
+    if(known && !set_parse(&uids, v[2].s, session->uidnext - 1)) {
+        free(v);
+        set_free(&uids);
+        return;
+    }
+
+    session_vanished(session, modseq, known ? &uids : NULL);
+    for(i = 0; i < session->exists && share_msg(session->box, i, &msg, NULL, NULL); i++) {
+        if(msg.modseq <= modseq || (uint32_t)msg.id >= session->uidnext || (known && !set_has(&uids, msg.id)))
+            continue;
+        sprintf(resp, "%d FETCH (UID %d", i+1, msg.id);
+        msg_flags(&msg, resp);
+        sprintf(resp + strlen(resp), " MODSEQ (%llu))", (unsigned long long)msg.modseq);
+        respond("*", resp, NULL, session);
+    }
+
+    free(v);
+    set_free(&uids);
+}
+
+// Cria o inotify do processo. Sem ele o IDLE só não avisa das mudanças
+void notify_init() {
+    if((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        perror("inotify_init1 :(\n");
+}
+
+// Passa a acompanhar as chegadas, remoções e renomeações em 'cur/' e
+// 'new/' da caixa
+void notify_watch(share_t *share) {
+    char const *dirs[2] = {"cur", "new"};
+    char path[MAXLINE+1];
+    int i;
+
+    if(notify_fd == -1) return;
+    for(i = 0; i < 2; i++) {
+        if(share->wd[i] != -1) continue;
+        sprintf(path, "%s/Maildir/%s", share->user, dirs[i]);
+        share->wd[i] = inotify_add_watch(notify_fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        if(share->wd[i] == -1 && errno != ENOENT)
+            perror(path);
+    }
+}
+
+void notify_unwatch(share_t *share) {
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        if(share->wd[i] != -1) inotify_rm_watch(notify_fd, share->wd[i]);
+        share->wd[i] = -1;
+    }
+}
 
-        // Registra o tamanho do conteúdo
-        if(content) {
-            if(multipart && strstr(line, boundary)) {
-                // O conteúdo termina na divisão
-                content = false;
-                if(text)
-                    sprintf(parts[part], "%s NIL NIL \"%s\" %d %d NIL NIL NIL NIL", type, encoding, msg->bs.psize[part], plines);
-                else
-                    sprintf(parts[part], "%s NIL NIL \"%s\" %d NIL %s NIL NIL", type, encoding, msg->bs.psize[part], disposition);
+// Lê os eventos do inotify e envia as mudanças das caixas alteradas
+// para as sessões em IDLE, marcando-as com 'pushed'. Cada caixa é relida
+// uma única vez, não importa quantos eventos ela teve
+void notify_event() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event const *ev;
+    char path[MAXLINE+1];
+    share_t *share;
+    ssize_t n;
+    char *p;
+    int i;
 
-            } else {
-                plines++;
-                msg->bs.psize[part] += strlen(line);
+    while((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+        for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event const*)p;
+            for(share = shares; share != NULL; share = share->next) {
+                // Sem espaço na fila do kernel, eventos se perderam
+                if(ev->mask & IN_Q_OVERFLOW) share->changed = true;
+                for(i = 0; i < 2; i++) {
+                    if(ev->wd != share->wd[i]) continue;
+                    share->changed = true;
+                    if(ev->mask & IN_IGNORED) share->wd[i] = -1;
+                }
             }
         }
     }
 
-    // Grava a quantidade de partes
-    msg->bs.nparts = part;
-    int i;
-    s = msg->bs.str;
+    for(share = shares; share != NULL; share = share->next) {
+        if(!share->changed) continue;
+        sprintf(path, "%s/Maildir", share->user);
+        if(share_open(share, path) == -1)
+            perror(path);
+    }
 
-    if(!multipart) {
-        sprintf(s, "%s NIL NIL \"%s\" %d %d NIL NIL NIL NIL", type, encoding, msg->bs.psize[1], plines);
-    } else {
-        sprintf(s, "(");
+    for(i = 0; i < nidlers; i++)
+        if(idlers[i]->state == SELECTED && idlers[i]->box->changed && session_update(idlers[i], true))
+            idlers[i]->pushed = true;
 
-        for(i = 1; i <= part; i++)
-            sprintf(s+strlen(s), "(%s)", parts[i]);
+    for(share = shares; share != NULL; share = share->next)
+        share->changed = false;
+}
 
-        sprintf(s+strlen(s), " \"mixed\" (\"boundary\" \"%s\") NIL (\"%s\") NIL)", boundary, lang);
+// Coloca a sessão na lista das que estão em IDLE
+void idle_add(session_t *session) {
+    if(nidlers == idlecap) {
+        idlecap = idlecap ? 2*idlecap : 16;
+        idlers = (session_t**)realloc(idlers, idlecap*sizeof(session_t*));
     }
+    session->idle = true;
+    session->idlepos = nidlers;
+    idlers[nidlers++] = session;
+}
+
+// Tira a sessão da lista, colocando a última no seu lugar
+void idle_del(session_t *session) {
+    session->idle = false;
+    idlers[session->idlepos] = idlers[--nidlers];
+    idlers[session->idlepos]->idlepos = session->idlepos;
+}
 
-    // Aloca espaço para o header
-    msg->header = (char*)malloc((msg->hsize+1)*sizeof(char));
-    strncpy(msg->header, msg->text, msg->hsize);
-    msg->header[msg->hsize] = 0;
+// Espalhamento do nome de um comando, sem diferenciar maiúsculas
+// de minúsculas
+unsigned cmdhash(char const *name) {
+    uint32_t h = 0;
 
-    // Volta para o início do arquivo
-    fclose(file);
+    for(; *name; name++)
+        h = 31*h + (*name | 0x20);
+
+    return (uint32_t)(h * CMDSEED) >> (32 - CMDBITS);
 }
 
-// Atualiza o nome do arquivo com as
-// flags da mensagem
-void upd_flags(msg_t *msg) {
-    char *comma;
-    char newfp[MAXLINE+1];
+// Monta a tabela de espalhamento a partir da lista de 'n' comandos.
+// CMDSEED foi escolhida para que não haja colisões entre os comandos
+// conhecidos; um comando novo que colida é detectado aqui
+void cmdtable_init(cmdtable_t *table, cmdinfo_t const *list, int n) {
+    int i;
+    unsigned h;
+
+    memset(table, 0, sizeof(cmdtable_t));
+    for(i = 0; i < n; i++) {
+        h = cmdhash(list[i].name);
+        if(table->slot[h] != NULL) {
+            fprintf(stderr, "Colisão entre os comandos %s e %s\n", table->slot[h]->name, list[i].name);
+            exit(8);
+        }
+        table->slot[h] = &list[i];
+    }
+}
 
-    strcpy(newfp, msg->filepath);
-    comma = strchr(newfp, ',');
-    comma[1] = 0;
+// Retorna a entrada do comando a partir do nome
+// (NULL se não for encontrado na tabela)
+cmdinfo_t const *findcmd(cmdtable_t const *table, char const *name) {
+    cmdinfo_t const *cmd = table->slot[cmdhash(name)];
 
-    if(msg->seen)    strcat(newfp, "S");
-    if(msg->deleted) strcat(newfp, "D");
+    if(cmd == NULL || strcasecmp(cmd->name, name))
+        return NULL;
+
+    return cmd;
+}
 
-    rename(msg->filepath, newfp);
-    strcpy(msg->filepath, newfp);
+// Separa a linha de comando 'line', de tamanho 'len', em tag, nome do
+// comando e argumentos, sem copiar nada: os trechos apontam para a
+// própria linha, que é alterada para que cada um termine em '\0'.
+// Retorna -1 se a linha não estiver bem formada
+int parse_cmdline(cmdline_t *cmdline, char *line, size_t len) {
+    char *p, *q, *end;
+
+    cmdline->argc = 0;
+    cmdline->tag = cmdline->name = NULL;
+
+    // Ignora o fim de linha
+    end = line + len;
+    if(end > line && end[-1] == '\n') end--;
+    if(end > line && end[-1] == '\r') end--;
+    if(end < line + len) *end = 0;
+
+    // Tag e nome do comando
+    for(p = line; p < end && *p == ' '; p++);
+    for(q = p; q < end && *q != ' '; q++);
+    if(q == p) return 0;
+    cmdline->tag = p;
+
+    for(p = q; p < end && *p == ' '; p++);
+    if(q < end) *q = 0;
+    for(q = p; q < end && *q != ' '; q++);
+    if(q == p) return 0;
+    cmdline->name = p;
+    p = q;
+    if(p < end) *p++ = 0;
+
+    return parse_args(p, end, &cmdline->argv, &cmdline->argc, &cmdline->cap);
+}
+
+// Separa os argumentos que vão de 'p' até 'end' em 'argv', que tem
+// espaço para 'cap' e já tem 'argc' argumentos. Também serve para o
+// conteúdo de uma lista, que fica como o texto original.
+// Retorna -1 se os argumentos forem inválidos
+int parse_args(char *p, char *end, slice_t **argv, int *argc, int *cap) {
+    char *q, *w;
+    size_t size;
+    bool sync;
+    int depth;
+    slice_t *arg;
+
+    while(p < end) {
+        if(*p == ' ') {
+            p++;
+            continue;
+        }
+
+        if(*argc == *cap) {
+            *cap = *cap ? 2*(*cap) : 8;
+            *argv = (slice_t*)realloc(*argv, (*cap)*sizeof(slice_t));
+        }
+        arg = &(*argv)[(*argc)++];
+        arg->kind = (*p == '"' || *p == '(' || *p == '{') ? *p : 0;
+
+        switch(*p) {
+            case '"':
+                // String entre aspas. Os escapes são removidos no lugar
+                for(q = w = p+1; q < end && *q != '"'; q++) {
+                    if(*q == '\\' && q+1 < end) q++;
+                    *w++ = *q;
+                }
+                if(q == end) return -1;
+
+                arg->s = p+1;
+                arg->len = w - (p+1);
+                *w = 0;
+                p = q+1;
+                break;
+
+            case '(':
+                // Lista, que pode conter listas, strings e literais
+                depth = 1;
+                for(q = p+1; q < end && depth > 0; q++) {
+                    if(*q == '(') depth++;
+                    else if(*q == ')') depth--;
+                    else if(*q == '"') {
+                        for(q++; q < end && *q != '"'; q++)
+                            if(*q == '\\') q++;
+                    } else if(*q == '{' && (w = parse_literal(q, end, &size, &sync)) != NULL) {
+                        q = w + size - 1;
+                    }
+                }
+                if(depth > 0) return -1;
+
+                arg->s = p+1;
+                arg->len = (q-1) - (p+1);
+                q[-1] = 0;
+                p = q;
+                break;
+
+            case '{':
+                // Literal: {n}, fim de linha e n bytes
+                if((q = parse_literal(p, end, &size, &sync)) == NULL || q + size > end)
+                    return -1;
+
+                arg->s = q;
+                arg->len = size;
+                p = q + size;
+                break;
+
+            default:
+                // Átomo, que pode conter uma seção entre colchetes com
+                // espaços, como em BODY[HEADER.FIELDS (FROM TO)]
+                depth = 0;
+                for(q = p; q < end && (*q != ' ' || depth > 0); q++) {
+                    if(*q == '[') depth++;
+                    else if(*q == ']') depth--;
+                }
+
+                arg->s = p;
+                arg->len = q - p;
+                p = q;
+                break;
+        }
+
+        // Cada argumento termina em um espaço ou no fim de linha
+        if(p < end && *p != ' ') return -1;
+        if(p < end) *p++ = 0;
+    }
+
+    return 0;
+}
+
+// Interpreta o cabeçalho de um literal ({n} ou {n+}, seguido do fim de
+// linha) que começa em 'p', gravando em 'size' o tamanho e em 'sync' se
+// o cliente espera a confirmação do servidor antes de enviá-lo.
+// Retorna o começo do conteúdo, ou NULL se não for um literal
+char *parse_literal(char *p, char *end, size_t *size, bool *sync) {
+    if(p >= end || *p++ != '{') return NULL;
+
+    *size = 0;
+    if(p >= end || !isdigit((unsigned char)*p)) return NULL;
+    while(p < end && isdigit((unsigned char)*p)) {
+        // Um tamanho que não cabe em size_t daria a volta e viraria um
+        // literal pequeno, desalinhando o resto da conexão
+        if(*size > (SIZE_MAX - 9)/10) return NULL;
+        *size = 10*(*size) + (*p++ - '0');
+    }
+
+    *sync = true;
+    if(p < end && *p == '+') {
+        *sync = false;
+        p++;
+    }
+
+    if(p >= end || *p++ != '}') return NULL;
+    if(p < end && *p == '\r') p++;
+    if(p >= end || *p++ != '\n') return NULL;
+
+    return p;
+}
+
+// Cabeçalho de literal no final de 'line' (uma linha ou um comando
+// inteiro), de tamanho 'len' e terminada em '\n', gravando o tamanho e
+// se ele é síncrono como parse_literal. Retorna o começo do cabeçalho,
+// ou NULL se não houver
+char *literal_tail(char *line, size_t len, size_t *size, bool *sync) {
+    char *nl = line + len - 1, *p;
+
+    for(p = nl; p > line && p[-1] != '{'; p--);
+    if(p == line || parse_literal(p-1, nl+1, size, sync) != nl+1)
+        return NULL;
+
+    return p-1;
+}
+
+// Monta a árvore de partes da mensagem, já mapeada por msg_load em
+// 'text', com uma única passada pelo texto, e guarda o tamanho e as
+// linhas do header e as linhas do arquivo, para que não seja necessário
+// abrir o arquivo referente novamente. A BODYSTRUCTURE é escrita em
+// 'structure' (SHAREBS bytes), e as chaves do SORT e do THREAD em 'keys'
+// (SHAREKEYS bytes)
+void parse_msg(msg_t *msg, char const *text, char *structure, char *keys) {
+    mime_t mime = {NULL, 0, 0, 0};
+
+    mime_parse(&mime, text, msg->fsize);
+    msg->hsize  = mime.parts[0].hlen;
+    msg->hlines = mime.parts[0].bline;
+    msg->flines = mime.lines;
+
+    if(!mime_structure(&mime, text, structure, SHAREBS))
+        log_printf(LOG_ERROR, "[BODYSTRUCTURE da mensagem %d grande demais, descrita como uma parte só]\n", msg->id);
+    sort_keys(msg, &mime, text, keys);
+
+    mime_free(&mime);
+    msg->parsed = true;
+}
+
+// Memória ocupada pelo mapeamento de 'len' bytes, em páginas inteiras
+size_t map_size(size_t len) {
+    static size_t page = 0;
+
+    if(page == 0) page = sysconf(_SC_PAGESIZE);
+    return (len + page - 1)/page*page;
+}
+
+// Caminho do arquivo de nome 'name'
+void msg_path(char const *name, session_t *session, char *path) {
+    snprintf(path, MAXLINE+1, "%s/Maildir/cur/%s", session->user, name);
+}
+
+// Abre o arquivo da mensagem 'uid', de nome 'name', e grava o caminho
+// em 'path'. Se ele não existir mais o nome é relido da caixa, já que
+// o diário de flags de outra sessão pode tê-lo renomeado depois que ele
+// foi lido. Retorna o descritor, ou -1 se a mensagem não pôde ser aberta
+int msg_open(session_t *session, uint32_t uid, char const *name, char *path) {
+    char cur[NAME_MAX+1];
+    msg_t msg;
+    int fd;
+
+    msg_path(name, session, path);
+    if((fd = open(path, O_RDONLY)) != -1 || errno != ENOENT) return fd;
+
+    if(!share_msg(session->box, share_uid(session->box, uid), &msg, cur, NULL) || (uint32_t)msg.id != uid)
+        return -1;
+    msg_path(cur, session, path);
+    return open(path, O_RDONLY);
+}
+
+// Mapeia na memória o arquivo de nome 'name' da mensagem e retorna o
+// texto, que vale até o próximo msg_unmap. Na primeira vez também
+// calcula o tamanho do header e a BODYSTRUCTURE, que são gravados na
+// caixa compartilhada e em 'structure' (se não for NULL). As páginas
+// mapeadas são do cache do kernel, que pode descartá-las sob pressão de
+// memória e relê-las do arquivo quando necessário.
+// Retorna NULL se o arquivo não pôde ser lido
+char *msg_load(msg_t *msg, char const *name, char *structure, session_t *session) {
+    char path[MAXLINE+1], bs[SHAREBS], keys[SHAREKEYS];
+    struct stat st;
+    void *text;
+    int fd;
+
+    if((fd = msg_open(session, msg->id, name, path)) == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if(fd != -1) close(fd);
+        return NULL;
+    }
+
+    msg->fsize = st.st_size;
+    text = NULL;
+    if(msg->fsize > 0 && (text = mmap(NULL, msg->fsize, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    if(text != NULL) {
+        if(session->nmaps == session->mapcap) {
+            session->mapcap = session->mapcap ? 2*session->mapcap : 16;
+            session->maps = (map_t*)realloc(session->maps, session->mapcap*sizeof(map_t));
+        }
+        session->maps[session->nmaps].text = (char*)text;
+        session->maps[session->nmaps].len = msg->fsize;
+        session->nmaps++;
+        session->mapped += map_size(msg->fsize);
+    }
+
+    if(!msg->parsed) {
+        parse_msg(msg, text ? (char*)text : "", bs, keys);
+        share_lock(session->box);
+        share_set(session->box, msg, NULL, bs, keys);
+        share_unlock(session->box);
+        if(structure != NULL) strcpy(structure, bs);
+    }
+
+    return text ? (char*)text : "";
+}
+
+// Examina a mensagem 'msg', que ainda não foi, como o msg_load, mas sem
+// manter o texto mapeado, e grava as chaves de ordenação em 'keys'
+// (SHAREKEYS bytes). Retorna false se o arquivo não pôde ser lido
+bool msg_parse(msg_t *msg, char *keys, session_t *session) {
+    char bs[SHAREBS], *text;
+    share_t *box = session->box;
+    size_t len;
+    msg_t cur;
+
+    if((text = search_map(session, msg->id, &len)) == NULL) return false;
+    msg->fsize = len;
+    parse_msg(msg, text, bs, keys);
+    if(len > 0) munmap(text, len);
+
+    // As flags podem ter mudado enquanto isso
+    share_lock(box);
+    if(share_msg(box, share_uid(box, msg->id), &cur, NULL, NULL) && cur.id == msg->id) {
+        msg->seen = cur.seen;
+        msg->deleted = cur.deleted;
+        share_set(box, msg, NULL, bs, keys);
+    }
+    share_unlock(box);
+
+    return true;
+}
+
+// Desfaz o mapeamento de todas as mensagens da sessão. Só pode ser
+// chamada entre comandos, quando nenhuma resposta pendente aponta para
+// o texto delas
+void msg_unmap(session_t *session) {
+    int i;
+
+    for(i = 0; i < session->nmaps; i++)
+        munmap(session->maps[i].text, session->maps[i].len);
+    session->nmaps = 0;
+    session->mapped = 0;
+}
+
+// Acrescenta as flags da mensagem a 's', como na resposta do FETCH
+void msg_flags(msg_t const *msg, char *s) {
+    strcat(s, " FLAGS (");
+    if(msg->deleted) strcat(s, " \\Deleted");
+    if(msg->seen) strcat(s, " \\Seen");
+    strcat(s, ")");
+}
+
+// Converte o conjunto de mensagens 'arg' em intervalos de posições
+// [lo, hi) na caixa. Se 'uid' for verdadeiro ele tem UIDs, que são
+// procurados por busca binária, e senão números de sequência, que já
+// são as posições. Retorna false se o conjunto for inválido
+bool msg_set(session_t *session, char const *arg, bool uid, set_t *set) {
+    share_t *box = session->box;
+    uint32_t star = 0;
+    int exists, lo, hi, i, n;
+    msg_t last;
+
+    // O '*' é o maior número em uso
+    exists = share_exists(box);
+    if(!uid)
+        star = exists;
+    else if(exists > 0 && share_msg(box, exists-1, &last, NULL, NULL))
+        star = last.id;
+
+    if(!set_parse(set, arg, star)) return false;
+
+    // Como os intervalos estão em ordem e separados, as posições também
+    // ficam, e os que não têm nenhuma mensagem são descartados
+    for(i = n = 0; i < set->n; i++) {
+        if(uid) {
+            lo = share_uid(box, set->r[i].lo);
+            hi = (set->r[i].hi == UINT32_MAX) ? exists : share_uid(box, set->r[i].hi + 1);
+        } else {
+            lo = (set->r[i].lo > 0) ? set->r[i].lo - 1 : 0;
+            hi = (set->r[i].hi < (uint32_t)exists) ? (int)set->r[i].hi : exists;
+        }
+
+        if(lo < hi) {
+            set->r[n].lo = lo;
+            set->r[n].hi = hi;
+            n++;
+        }
+    }
+    set->n = n;
+
+    return true;
+}
+
+// Lê um modseq de 's' para 'v' e retorna o que vem depois dele, ou NULL
+// se não houver um número válido
+char const *modseq_num(char const *s, uint64_t *v) {
+    unsigned long long n;
+    char *end;
+
+    if(!isdigit((unsigned char)*s)) return NULL;
+
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if(errno != 0 || n > INT64_MAX) return NULL;
+
+    *v = n;
+    return end;
+}
+
+// Lê os modificadores do FETCH em 'arg' (sem os parênteses):
+// "CHANGEDSINCE modseq" e, no UID FETCH com o QRESYNC, "VANISHED".
+// Retorna false se eles forem inválidos
+bool fetch_changed(slice_t const *arg, uint64_t *changed, bool *vanished) {
+    char const *p = arg->s;
+    bool since = false;
+
+    *vanished = false;
+    if(arg->kind != '(') return false;
+
+    while(*p != 0) {
+        if(!since && !strncasecmp(p, "CHANGEDSINCE ", 13)) {
+            if((p = modseq_num(p + 13, changed)) == NULL) return false;
+            since = true;
+        } else if(!*vanished && !strncasecmp(p, "VANISHED", 8)) {
+            p += 8;
+            *vanished = true;
+        } else {
+            return false;
+        }
+
+        if(*p == ' ') p++;
+        else if(*p != 0) return false;
+    }
+
+    return since;
+}
+
+// Lê o modificador "UNCHANGEDSINCE modseq" do STORE em 'arg' (sem os
+// parênteses). Retorna false se ele for inválido
+bool store_unchanged(slice_t const *arg, uint64_t *unchanged) {
+    char const *p = arg->s;
+
+    return arg->kind == '(' && !strncasecmp(p, "UNCHANGEDSINCE ", 15) &&
+           (p = modseq_num(p + 15, unchanged)) != NULL && *p == 0;
+}
+
+// Separa os itens do FETCH em 'arg' (já em maiúsculas e sem os
+// parênteses da lista) em 'items', e a sua quantidade em 'n'. Os
+// macros ALL, FAST e FULL viram os itens que representam. Retorna false
+// se algum item for inválido
+bool fetch_parse(char *arg, fetch_t *items, int *n) {
+    static char const *macros[][2] = {{"ALL",  "FLAGS INTERNALDATE RFC822.SIZE ENVELOPE"},
+                                      {"FAST", "FLAGS INTERNALDATE RFC822.SIZE"},
+                                      {"FULL", "FLAGS INTERNALDATE RFC822.SIZE ENVELOPE BODY"}};
+    static char expanded[MAXLINE+1];
+    char *p, *q;
+    fetch_t *item;
+    int depth, m;
+
+    for(m = 0; m < 3; m++) {
+        if(!strcmp(arg, macros[m][0])) {
+            strcpy(expanded, macros[m][1]);
+            arg = expanded;
+        }
+    }
+
+    *n = 0;
+    for(p = arg; *p != 0; p = q) {
+        if(*p == ' ') {
+            q = p+1;
+            continue;
+        }
+
+        // Cada item vai até um espaço fora dos colchetes
+        for(q = p, depth = 0; *q != 0 && (*q != ' ' || depth > 0); q++) {
+            if(*q == '[') depth++;
+            else if(*q == ']') depth--;
+        }
+        if(*q != 0) *q++ = 0;
+
+        if(*n == FETCHITEMS) return false;
+        item = &items[(*n)++];
+        memset(item, 0, sizeof(fetch_t));
+        item->octets = -1;
+
+        if(!strcmp(p, "UID"))                item->item = F_UID;
+        else if(!strcmp(p, "FLAGS"))         item->item = F_FLAGS;
+        else if(!strcmp(p, "RFC822.SIZE"))   item->item = F_SIZE;
+        else if(!strcmp(p, "INTERNALDATE"))  item->item = F_DATE;
+        else if(!strcmp(p, "ENVELOPE"))      item->item = F_ENVELOPE;
+        else if(!strcmp(p, "BODY"))          item->item = F_BODY;
+        else if(!strcmp(p, "BODYSTRUCTURE")) item->item = F_STRUCTURE;
+        else if(!strcmp(p, "MODSEQ"))        item->item = F_MODSEQ;
+        else if(!strcmp(p, "RFC822"))        item->item = F_RFC822;
+        else if(!strcmp(p, "RFC822.HEADER")) item->item = F_RFC822HEADER;
+        else if(!strcmp(p, "RFC822.TEXT"))   item->item = F_RFC822TEXT;
+        else if(!strncmp(p, "BODY[", 5)) {
+            item->item = F_SECTION;
+            if(!fetch_section(p+5, item)) return false;
+        } else if(!strncmp(p, "BODY.PEEK[", 10)) {
+            item->item = F_SECTION;
+            item->peek = true;
+            if(!fetch_section(p+10, item)) return false;
+        } else {
+            return false;
+        }
+    }
+
+    return *n > 0;
+}
+
+// Lê a seção que começa em 'p', depois do '[': os números da parte
+// separados por pontos, o que se quer dela, o ']' e o trecho
+// <origin.octets>, se houver. O ']' é trocado por '\0', para que
+// 'item->spec' seja o texto entre os colchetes
+bool fetch_section(char *p, fetch_t *item) {
+    char *end;
+    long v;
+
+    item->spec = p;
+    while(isdigit((unsigned char)*p)) {
+        v = strtol(p, &end, 10);
+        if(v <= 0 || v > INT_MAX || item->npath == FETCHPATH) return false;
+        item->path[item->npath++] = v;
+        p = end;
+        if(*p != '.') break;
+        p++;
+    }
+    if(item->npath > 0 && p[-1] == '.' && *p == ']') return false;
+
+    if(*p == ']') {
+        item->sec = SEC_ALL;
+    } else if(!strncmp(p, "HEADER.FIELDS.NOT (", 19) || !strncmp(p, "HEADER.FIELDS (", 15)) {
+        item->sec = (p[13] == '.') ? SEC_FIELDSNOT : SEC_FIELDS;
+        p = strchr(p, '(') + 1;
+        item->fields = p;
+        if((p = strchr(p, ')')) == NULL) return false;
+        p++;
+    } else if(!strncmp(p, "HEADER]", 7)) {
+        item->sec = SEC_HEADER;
+        p += 6;
+    } else if(!strncmp(p, "TEXT]", 5)) {
+        item->sec = SEC_TEXT;
+        p += 4;
+    } else if(item->npath > 0 && !strncmp(p, "MIME]", 5)) {
+        item->sec = SEC_MIME;
+        p += 4;
+    } else {
+        return false;
+    }
+    if(*p != ']') return false;
+    *p++ = 0;
+
+    // Trecho <origin.octets>
+    if(*p == '<') {
+        item->origin = strtol(p+1, &end, 10);
+        if(end == p+1 || *end != '.' || item->origin < 0) return false;
+        p = end+1;
+        item->octets = strtol(p, &end, 10);
+        if(end == p || *end != '>' || item->octets <= 0) return false;
+        p = end+1;
+    }
+
+    return *p == 0;
+}
+
+// Envia o que já foi montado da resposta em 'line', terminado pelo
+// tamanho 'len' do literal que vem em seguida. 'first' indica se esta
+// é a primeira linha da resposta
+void fetch_literal(buf_t *line, size_t len, bool *first, session_t *session) {
+    char size[32];
+
+    sprintf(size, " {%zu}", len);
+    buf_append(line, size, strlen(size) + 1);
+    respond(*first ? "*" : NULL, line->data, NULL, session);
+    line->len = 0;
+    *first = false;
+}
+
+// Responde ao FETCH da mensagem 'msg', na posição 'i', com os 'n' itens
+// pedidos, na ordem em que foram pedidos e depois do UID. O texto da
+// mensagem só é mapeado, e as suas partes só são encontradas, se algum
+// item precisar deles; a mensagem inteira vai direto do arquivo. As
+// seções e os trechos são enviados da memória mapeada, sem cópia, com
+// exceção do HEADER.FIELDS. Retorna false, sem responder nada, se o
+// arquivo da mensagem não pôde ser lido
+bool fetch_msg(fetch_t const *items, int n, int i, msg_t *msg, char const *name, char *bs, session_t *session) {
+    char tmp[MAXLINE+1], path[MAXLINE+1];
+    buf_t line = {NULL, 0, 0}, fields = {NULL, 0, 0};
+    mime_t mime = {NULL, 0, 0, 0};
+    fetch_t const *item;
+    char *text = NULL;
+    char const *data;
+    bool needtext = false, needtree = false, needfile = false, seen = false, flags = false, modseq = false, first = true;
+    bool whole, copy;
+    size_t off, len, start;
+    struct stat st;
+    struct tm tm;
+    time_t date;
+    int k, p, fd = -1;
+
+    for(k = 0; k < n; k++) {
+        item = &items[k];
+        whole = (item->item == F_RFC822 || (item->item == F_SECTION && item->sec == SEC_ALL &&
+                 item->npath == 0 && item->octets < 0));
+        if(item->item == F_ENVELOPE || item->item == F_BODY || item->item == F_RFC822HEADER ||
+           item->item == F_RFC822TEXT || (item->item == F_STRUCTURE && !msg->parsed) ||
+           (item->item == F_SECTION && !whole)) needtext = true;
+        if(whole) needfile = true;
+        if(item->item == F_ENVELOPE || item->item == F_BODY || (item->item == F_SECTION && item->npath > 0)) needtree = true;
+        if(item->item == F_RFC822 || item->item == F_RFC822TEXT || (item->item == F_SECTION && !item->peek)) seen = true;
+    }
+
+    if(needtext && (text = msg_load(msg, name, bs, session)) == NULL) return false;
+
+    // Sem o texto, a mensagem inteira vai direto do arquivo, que é
+    // aberto antes de a resposta começar
+    if(!needtext && needfile) {
+        if((fd = msg_open(session, msg->id, name, path)) == -1 || fstat(fd, &st) == -1) {
+            perror(path);
+            if(fd != -1) close(fd);
+            return false;
+        }
+    }
+    if(needtree) mime_parse(&mime, text, msg->fsize);
+
+    // O \Seen é gravado antes, para já aparecer nesta resposta. Se o
+    // diário não puder ser gravado a mensagem continua não lida
+    seen = seen && !msg->seen;
+    if(seen) {
+        msg->seen = true;
+        if(upd_flags(msg, UINT64_MAX, session) == -1) seen = false;
+    }
+
+    sprintf(tmp, "%d FETCH (UID %d", i+1, msg->id);
+    buf_append(&line, tmp, strlen(tmp));
+
+    for(k = 0; k < n; k++) {
+        item = &items[k];
+        tmp[0] = 0;
+
+        switch(item->item) {
+            case F_UID:
+                break;
+
+            case F_MODSEQ:
+                // Vai no final, já com o \Seen que este FETCH marcar
+                modseq = true;
+                break;
+
+            case F_FLAGS:
+                msg_flags(msg, tmp);
+                flags = true;
+                break;
+
+            case F_SIZE:
+                sprintf(tmp, " RFC822.SIZE %d", msg->fsize);
+                break;
+
+            case F_DATE:
+                // A data de entrega é a da última alteração do arquivo
+                date = msg->date;
+                localtime_r(&date, &tm);
+                strftime(tmp, sizeof(tmp), " INTERNALDATE \"%d-%b-%Y %H:%M:%S %z\"", &tm);
+                break;
+
+            case F_ENVELOPE:
+                buf_append(&line, " ENVELOPE ", 10);
+                mime_envelope(&line, &mime, 0, text);
+                break;
+
+            case F_BODY:
+                buf_append(&line, " BODY ", 6);
+                mime_body(&line, &mime, 0, text, false);
+                break;
+
+            case F_STRUCTURE:
+                buf_append(&line, " BODYSTRUCTURE ", 15);
+                buf_append(&line, bs, strlen(bs));
+                break;
+
+            case F_RFC822HEADER:
+                buf_append(&line, " RFC822.HEADER", 14);
+                fetch_literal(&line, msg->hsize, &first, session);
+                respond_data(text, msg->hsize, session);
+                break;
+
+            case F_RFC822TEXT:
+                buf_append(&line, " RFC822.TEXT", 12);
+                fetch_literal(&line, msg->fsize - msg->hsize, &first, session);
+                respond_data(text + msg->hsize, msg->fsize - msg->hsize, session);
+                break;
+
+            case F_RFC822:
+            case F_SECTION:
+                if(item->item == F_RFC822) sprintf(tmp, " RFC822");
+                else sprintf(tmp, " BODY[%s]", item->spec);
+                if(item->octets >= 0) sprintf(tmp+strlen(tmp), "<%ld>", item->origin);
+                buf_append(&line, tmp, strlen(tmp));
+                tmp[0] = 0;
+
+                // A mensagem inteira vai direto do arquivo, com o tamanho
+                // exato que ele tem agora
+                if(text == NULL) {
+                    fetch_literal(&line, st.st_size, &first, session);
+                    respond_file(dup(fd), st.st_size, session);
+                    break;
+                }
+
+                // Encontra o trecho da mensagem pedido
+                p = 0;
+                if(item->npath > 0 && (p = mime_part(&mime, item->path, item->npath)) == -1) {
+                    buf_append(&line, " NIL", 4);
+                    break;
+                }
+                if(item->npath > 0 && item->sec != SEC_ALL && item->sec != SEC_MIME) {
+                    // HEADER e TEXT de uma parte são os da mensagem contida nela
+                    if(!mime.parts[p].message || mime.parts[p].child == -1) {
+                        buf_append(&line, " NIL", 4);
+                        break;
+                    }
+                    p = mime.parts[p].child;
+                }
+
+                if(item->sec == SEC_ALL && item->npath == 0) {
+                    off = 0;
+                    len = msg->fsize;
+                } else if(item->sec == SEC_ALL) {
+                    off = mime.parts[p].boff;
+                    len = mime.parts[p].blen;
+                } else if(item->sec == SEC_TEXT) {
+                    off = item->npath ? mime.parts[p].boff : (size_t)msg->hsize;
+                    len = item->npath ? mime.parts[p].blen : (size_t)(msg->fsize - msg->hsize);
+                } else {
+                    off = item->npath ? mime.parts[p].hoff : 0;
+                    len = item->npath ? mime.parts[p].hlen : (size_t)msg->hsize;
+                }
+
+                // Só alguns campos do cabeçalho, que são copiados
+                data = text + off;
+                copy = (item->sec == SEC_FIELDS || item->sec == SEC_FIELDSNOT);
+                if(copy) {
+                    fields.len = 0;
+                    mime_fields(&fields, data, len, item->fields, item->sec == SEC_FIELDSNOT);
+                    data = fields.data;
+                    len = fields.len;
+                }
+
+                // Trecho <origin.octets>
+                if(item->octets >= 0) {
+                    start = (item->origin < (long)len) ? (size_t)item->origin : len;
+                    data += start;
+                    len -= start;
+                    if((size_t)item->octets < len) len = item->octets;
+                }
+
+                fetch_literal(&line, len, &first, session);
+                if(copy) respond_copy(data, len, session);
+                else respond_data(data, len, session);
+                break;
+        }
+
+        if(tmp[0] != 0) buf_append(&line, tmp, strlen(tmp));
+    }
+
+    // Avisa o cliente que a mensagem foi marcada como lida, se ele não
+    // pediu as flags (e do novo modseq, com o CONDSTORE)
+    if(seen && !flags) {
+        tmp[0] = 0;
+        msg_flags(msg, tmp);
+        buf_append(&line, tmp, strlen(tmp));
+    }
+    if(modseq || (seen && session->condstore)) {
+        sprintf(tmp, " MODSEQ (%llu)", (unsigned long long)msg->modseq);
+        buf_append(&line, tmp, strlen(tmp));
+    }
+
+    buf_append(&line, ")", 2);
+    respond(first ? "*" : NULL, line.data, NULL, session);
+
+    buf_free(&line);
+    buf_free(&fields);
+    mime_free(&mime);
+    if(fd != -1) close(fd);
+
+    return true;
+}
+
+// Acrescenta um critério 'op' vazio ao SEARCH e retorna a sua posição
+int search_key(search_t *search, searchop_t op) {
+    searchkey_t *key;
+
+    if(search->n == search->cap) {
+        search->cap = search->cap ? 2*search->cap : 16;
+        search->keys = (searchkey_t*)realloc(search->keys, search->cap*sizeof(searchkey_t));
+    }
+    key = &search->keys[search->n];
+    memset(key, 0, sizeof(searchkey_t));
+    key->op = op;
+    key->a = key->b = -1;
+
+    return search->n++;
+}
+
+// Interpreta os critérios em 'argv', que precisam valer todos, como um
+// AND de cada um com os anteriores. Retorna a posição do critério que
+// os reúne, ou -1 se algum for inválido
+int search_list(search_t *search, slice_t *argv, int argc, session_t *session) {
+    int k = 0, root = -1, key, and;
+
+    while(k < argc) {
+        if((key = search_parse(search, argv, argc, &k, session)) == -1) return -1;
+        if(root == -1) {
+            root = key;
+            continue;
+        }
+
+        and = search_key(search, K_AND);
+        search->keys[and].a = root;
+        search->keys[and].b = key;
+        search->keys[and].text = search->keys[root].text || search->keys[key].text;
+        root = and;
+    }
+
+    return root;
+}
+
+// Interpreta o critério que começa em argv[*k] e avança '*k' para depois
+// dele. Os critérios que um NOT ou um OR contém são interpretados antes
+// dele, e uma lista entre parênteses vira um AND. Retorna a posição do
+// critério, ou -1 se ele for inválido
+int search_parse(search_t *search, slice_t *argv, int argc, int *k, session_t *session) {
+    slice_t *arg = &argv[(*k)++], *sub = NULL;
+    searchname_t const *name = NULL;
+    searchkey_t *key;
+    char const *p;
+    uint64_t modseq = 0;
+    char *end;
+    int i, j, a = -1, b = -1, n = 0, cap = 0;
+    bool ok = true;
+
+    if(arg->kind == '(') {
+        i = (parse_args(arg->s, arg->s + arg->len, &sub, &n, &cap) == -1 || n == 0) ? -1 : search_list(search, sub, n, session);
+        free(sub);
+        return i;
+    }
+    if(arg->kind != 0) return -1;
+
+    // Um conjunto de números de sequência, ou um critério pelo nome
+    if(isdigit((unsigned char)arg->s[0]) || arg->s[0] == '*') {
+        i = search_key(search, K_SET);
+        ok = msg_set(session, arg->s, false, &search->keys[i].set);
+    } else {
+        for(j = 0; j < (int)(sizeof(search_names)/sizeof(search_names[0])) && name == NULL; j++)
+            if(!strcasecmp(arg->s, search_names[j].name)) name = &search_names[j];
+        if(name == NULL) return -1;
+
+        if(name->arg == A_KEY || name->arg == A_KEYS) {
+            if(*k >= argc || (a = search_parse(search, argv, argc, k, session)) == -1) return -1;
+            if(name->arg == A_KEYS && (*k >= argc || (b = search_parse(search, argv, argc, k, session)) == -1)) return -1;
+        } else if(name->arg != A_NONE && (*k + (name->arg == A_FIELD) >= argc || argv[*k].kind == '(')) {
+            return -1;
+        }
+
+        i = search_key(search, name->op);
+        key = &search->keys[i];
+        key->a = a;
+        key->b = b;
+        switch(name->arg) {
+            case A_NONE:
+            case A_KEY:
+            case A_KEYS:
+                break;
+
+            case A_STRING:
+                key->field = name->field;
+                key->s = argv[(*k)++].s;
+                break;
+
+            case A_FIELD:
+                key->field = argv[(*k)++].s;
+                key->s = argv[(*k)++].s;
+                break;
+
+            case A_NUMBER:
+                key->num = strtol(argv[*k].s, &end, 10);
+                ok = (argv[*k].kind == 0 && end > argv[*k].s && *end == 0 && key->num >= 0);
+                (*k)++;
+                break;
+
+            case A_DATE:
+                ok = search_date(argv[(*k)++].s, &key->num, false);
+                break;
+
+            case A_UIDS:
+                ok = (argv[*k].kind == 0 && msg_set(session, argv[*k].s, true, &key->set));
+                (*k)++;
+                break;
+
+            case A_MODSEQ:
+                // Só há um modseq por mensagem, então o nome e o tipo da
+                // flag não fazem diferença
+                if(argv[*k].kind == '"') *k += 2;
+                ok = (*k < argc && argv[*k].kind == 0 && (p = modseq_num(argv[*k].s, &modseq)) != NULL && *p == 0);
+                key->num = modseq;
+                (*k)++;
+                session->condstore = true;
+                break;
+        }
+    }
+    if(!ok) return -1;
+
+    // As posições viram intervalos fechados, para o set_has
+    key = &search->keys[i];
+    if(key->op == K_SET)
+        for(j = 0; j < key->set.n; j++) key->set.r[j].hi--;
+
+    // Procurar um texto vazio não precisa do texto
+    if((key->op == K_BODY || key->op == K_TEXT) && key->s[0] == 0) key->op = K_ALL;
+
+    key->text = (key->op == K_HEADER || key->op == K_BODY || key->op == K_TEXT || key->op == K_SENTBEFORE ||
+                 key->op == K_SENTON || key->op == K_SENTSINCE || (a != -1 && search->keys[a].text) ||
+                 (b != -1 && search->keys[b].text));
+    return i;
+}
+
+// Lê a data 's' do SEARCH ("1-Feb-1994"), ou a data do campo Date
+// ("Tue, 1 Feb 1994 ...") se 'sent' for verdadeiro, para 'day', em dias
+// desde 1970. Retorna false se ela for inválida
+bool search_date(char const *s, long *day, bool sent) {
+    static char const months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    char const *p;
+    int d, y, n = 0;
+
+    if(sent) {
+        // O dia da semana é opcional, e o ano pode ter dois dígitos
+        if((p = strchr(s, ',')) != NULL) s = p + 1;
+        if(sscanf(s, "%d %3[A-Za-z] %d", &d, mon, &y) != 3) return false;
+        if(y < 50) y += 2000;
+        else if(y < 1000) y += 1900;
+    } else if(sscanf(s, "%2d-%3[A-Za-z]-%4d%n", &d, mon, &y, &n) != 3 || s[n] != 0) {
+        return false;
+    }
+
+    if(strlen(mon) != 3 || (p = strcasestr(months, mon)) == NULL || (p - months) % 3 != 0 || d < 1 || d > 31)
+        return false;
+
+    *day = civil_day(y, (p - months)/3 + 1, d);
+    return true;
+}
+
+// Acrescenta ao índice invertido da caixa as mensagens que chegaram
+// desde a última busca de qualquer processo, e o reescreve sem as
+// removidas quando elas forem a maioria. Uma mensagem que não pôde ser
+// lida interrompe a indexação, e ela e as seguintes continuam sendo
+// candidatas em todas as buscas até a próxima tentativa
+void search_index(session_t *session) {
+    char maildir[MAXLINE+1];
+    share_t *box = session->box;
+    buf_t rec = {NULL, 0, 0}, doc = {NULL, 0, 0};
+    mime_t mime = {NULL, 0, 0, 0};
+    uint32_t *uids;
+    fti_t *fti;
+    char *text;
+    size_t len;
+    msg_t msg;
+    int i, n;
+
+    sprintf(maildir, "%s/Maildir", session->user);
+    if(box->fti == NULL) box->fti = fti_new();
+    fti = box->fti;
+    if(fti_open(fti, maildir, box->hdr->uidvalidity) == -1) return;
+
+    for(i = share_uid(box, fti->last + 1); share_msg(box, i, &msg, NULL, NULL); i++) {
+        if((text = search_map(session, msg.id, &len)) == NULL) break;
+
+        doc.len = 0;
+        mime_parse(&mime, text, len);
+        fti_doc(&doc, &mime, text);
+        if(len > 0) munmap(text, len);
+
+        fti_add(fti, msg.id, doc.data, doc.len, &rec);
+        if(rec.len >= (1 << 20)) fti_write(fti, &rec);
+    }
+    fti_write(fti, &rec);
+
+    n = share_exists(box);
+    if(fti->records > 2*n + FTISLACK) {
+        uids = (uint32_t*)malloc((n + 1)*sizeof(uint32_t));
+        for(i = 0; i < n && share_msg(box, i, &msg, NULL, NULL); i++) uids[i] = msg.id;
+        fti_compact(fti, maildir, uids, i);
+        free(uids);
+    }
+    fti_unlock(fti);
+
+    buf_free(&rec);
+    buf_free(&doc);
+    mime_free(&mime);
+}
+
+// Verifica se o charset 's' é aceito: só o ASCII, e o UTF-8, do qual ele
+// é parte
+bool search_charset(char const *s) {
+    return !strcasecmp(s, "US-ASCII") || !strcasecmp(s, "UTF-8");
+}
+
+// Avalia os critérios do SEARCH em 'argv' para todas as mensagens da
+// caixa e grava a posição, o UID, a data de entrega, o tamanho e o
+// modseq das que os satisfazem em 'hits', liberado por quem chamou com
+// sort_free. Se algum critério for o MODSEQ, o maior modseq entre elas
+// vai para 'modseq' (senão ele fica 0). Retorna o número delas, ou -1 se
+// os critérios forem inválidos
+int search_all(slice_t *argv, int argc, session_t *session, sortmsg_t **hits, uint64_t *modseq) {
+    search_t search = {NULL, 0, 0, 0};
+    share_t *box = session->box;
+    int root, k, n = 0, cap = 0;
+    searchkey_t *key;
+    searchmsg_t m;
+    sortmsg_t *h;
+    bool text = false, bymodseq = false;
+
+    // Todos os critérios precisam valer
+    if(argc < 1 || (root = search_list(&search, argv, argc, session)) == -1) {
+        search_free(&search);
+        return -1;
+    }
+
+    // O índice invertido recebe as mensagens novas e diz quais podem
+    // ter o texto de cada critério. Sem nenhuma palavra no texto, o nome
+    // do campo procurado também serve
+    for(k = 0; k < search.n; k++) {
+        if(search.keys[k].op == K_HEADER || search.keys[k].op == K_BODY || search.keys[k].op == K_TEXT) text = true;
+        if(search.keys[k].op == K_MODSEQ) bymodseq = true;
+    }
+    if(text) {
+        search_index(session);
+        search.last = box->fti->last;
+        for(k = 0; k < search.n; k++) {
+            key = &search.keys[k];
+            if(key->op != K_HEADER && key->op != K_BODY && key->op != K_TEXT) continue;
+            if((key->cand = fti_query(box->fti, key->s)) == NULL && key->op == K_HEADER)
+                key->cand = fti_query(box->fti, key->field);
+        }
+    }
+
+    *hits = NULL;
+    *modseq = 0;
+    memset(&m, 0, sizeof(m));
+    for(m.i = 0; share_msg(box, m.i, &m.msg, NULL, NULL); m.i++) {
+        m.loaded = m.failed = m.built = false;
+        if(search_eval(&search, root, &m, session)) {
+            if(n == cap) {
+                cap = cap ? 2*cap : 64;
+                *hits = (sortmsg_t*)realloc(*hits, cap*sizeof(sortmsg_t));
+            }
+            h = &(*hits)[n++];
+            memset(h, 0, sizeof(*h));
+            h->i = m.i;
+            h->uid = m.msg.id;
+            h->date = h->sent = m.msg.date;
+            h->size = m.msg.fsize;
+            h->modseq = m.msg.modseq;
+            if(bymodseq && h->modseq > *modseq) *modseq = h->modseq;
+        }
+        if(m.loaded && m.len > 0) munmap(m.text, m.len);
+    }
+
+    buf_free(&m.doc);
+    mime_free(&m.mime);
+    search_free(&search);
+    return n;
+}
+
+// Lê do índice da caixa as chaves de ordenação das mensagens 'hits',
+// examinando antes as que ainda não foram. Uma mensagem que sumiu ou
+// não pôde ser lida fica com as chaves vazias
+void search_keys(sortmsg_t *hits, int n, session_t *session) {
+    char keys[SHAREKEYS];
+    sortmsg_t *h;
+    msg_t msg;
+    int k;
+
+    for(k = 0; k < n; k++) {
+        h = &hits[k];
+        keys[0] = 0;
+        if(!share_keys(session->box, h->i, &msg, keys) || (uint32_t)msg.id != h->uid ||
+           (!msg.parsed && !msg_parse(&msg, keys, session))) {
+            keys[0] = 0;
+            msg.parsed = msg.reply = false;
+        }
+        if(msg.parsed) h->sent = msg.sent;
+        h->reply = msg.reply;
+        sort_split(h, keys);
+    }
+}
+
+// Mapeia na memória o arquivo da mensagem 'uid' e grava o tamanho em
+// 'len'. O nome é relido se o arquivo não existir mais, já que o diário
+// de flags pode tê-lo renomeado. O texto é desmapeado por quem chamou
+// (se 'len' não for 0). Retorna NULL se ele não pôde ser lido
+char *search_map(session_t *session, uint32_t uid, size_t *len) {
+    char name[NAME_MAX+1], path[MAXLINE+1];
+    struct stat st;
+    void *text;
+    msg_t msg;
+    int fd;
+
+    if(!share_msg(session->box, share_uid(session->box, uid), &msg, name, NULL) || (uint32_t)msg.id != uid)
+        return NULL;
+    if((fd = msg_open(session, uid, name, path)) == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if(fd != -1) close(fd);
+        return NULL;
+    }
+
+    *len = st.st_size;
+    text = (*len > 0) ? mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0) : (void*)"";
+    close(fd);
+    if(text == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    return (char*)text;
+}
+
+// Mapeia o texto da mensagem e monta a sua árvore de partes, na primeira
+// vez. Retorna false se o texto não pôde ser lido
+bool search_load(searchmsg_t *m, session_t *session) {
+    if(!m->loaded && !m->failed) {
+        if((m->text = search_map(session, m->msg.id, &m->len)) == NULL) {
+            m->failed = true;
+        } else {
+            mime_parse(&m->mime, m->text, m->len);
+            m->loaded = true;
+        }
+    }
+
+    return m->loaded;
+}
+
+// Avalia o critério 'k' para a mensagem 'm'. Uma mensagem que o índice
+// invertido descarta nem tem o texto conferido; as que chegaram depois
+// da indexação ('last') são sempre conferidas
+bool search_eval(search_t const *search, int k, searchmsg_t *m, session_t *session) {
+    searchkey_t const *key = &search->keys[k];
+    msg_t const *msg = &m->msg;
+    char date[64];
+    struct tm tm;
+    time_t t;
+    span_t v;
+    long day = 0;
+    int a, b;
+
+    if(key->cand != NULL && (uint32_t)msg->id <= search->last && !(key->cand[msg->id/8] & (1 << (msg->id % 8))))
+        return false;
+
+    switch(key->op) {
+        case K_ALL:       return true;
+        case K_NONE:      return false;
+        case K_SEEN:      return msg->seen;
+        case K_UNSEEN:    return !msg->seen;
+        case K_DELETED:   return msg->deleted;
+        case K_UNDELETED: return !msg->deleted;
+        case K_RECENT:    return set_has(&session->recents, msg->id);
+        case K_NEW:       return !msg->seen && set_has(&session->recents, msg->id);
+        case K_OLD:       return !set_has(&session->recents, msg->id);
+        case K_LARGER:    return msg->fsize > key->num;
+        case K_SMALLER:   return msg->fsize < key->num;
+        case K_SET:       return set_has(&key->set, m->i);
+        case K_MODSEQ:    return msg->modseq >= (uint64_t)key->num;
+
+        case K_BEFORE:
+        case K_ON:
+        case K_SINCE:
+            // A data de entrega no fuso local, como no INTERNALDATE
+            t = msg->date;
+            localtime_r(&t, &tm);
+            day = civil_day(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+            break;
+
+        case K_SENTBEFORE:
+        case K_SENTON:
+        case K_SENTSINCE:
+            if(!search_load(m, session) || !mime_field(&m->mime, 0, m->text, "Date", &v)) return false;
+            snprintf(date, sizeof(date), "%.*s", (int)v.len, v.s);
+            if(!search_date(date, &day, true)) return false;
+            break;
+
+        case K_HEADER:
+            return search_load(m, session) && mime_field(&m->mime, 0, m->text, key->field, &v) &&
+                   fti_match(v.s, v.len, key->s);
+
+        case K_BODY:
+        case K_TEXT:
+            if(!search_load(m, session)) return false;
+            if(!m->built) {
+                m->doc.len = 0;
+                m->hdoc = fti_doc(&m->doc, &m->mime, m->text);
+                m->built = true;
+            }
+            if(key->op == K_TEXT) return fti_match(m->doc.data, m->doc.len, key->s);
+            return fti_match(m->doc.data + m->hdoc, m->doc.len - m->hdoc, key->s);
+
+        case K_NOT:
+            return !search_eval(search, key->a, m, session);
+
+        case K_OR:
+        case K_AND:
+            // O lado que não precisa do texto vai primeiro, e pode
+            // dispensar o outro
+            a = key->a;
+            b = key->b;
+            if(search->keys[a].text && !search->keys[b].text) {
+                a = key->b;
+                b = key->a;
+            }
+            if(key->op == K_OR) return search_eval(search, a, m, session) || search_eval(search, b, m, session);
+            return search_eval(search, a, m, session) && search_eval(search, b, m, session);
+    }
+
+    // As datas são comparadas sem o horário
+    if(key->op == K_BEFORE || key->op == K_SENTBEFORE) return day < key->num;
+    if(key->op == K_ON || key->op == K_SENTON) return day == key->num;
+    return day >= key->num;
+}
+
+// Libera a memória dos critérios
+void search_free(search_t *search) {
+    int k;
+
+    for(k = 0; k < search->n; k++) {
+        set_free(&search->keys[k].set);
+        free(search->keys[k].cand);
+    }
+    free(search->keys);
+}
+
+// Grava as flags de 'msg' na caixa compartilhada, onde valem na hora,
+// e registra no diário o nome que o arquivo deve ter, para que ele seja
+// renomeado depois junto com os outros. O nome atual é relido com a
+// caixa travada, já que outra sessão pode tê-lo mudado. O novo modseq
+// fica em 'msg'. Retorna 0 se a mensagem foi alterada depois do modseq
+// 'unchanged' (o UNCHANGEDSINCE do CONDSTORE) e ficou como estava, -1 se
+// o diário não pôde ser gravado, caso em que a caixa também fica como
+// estava, e 1 se deu certo
+int upd_flags(msg_t *msg, uint64_t unchanged, session_t *session) {
+    char *comma;
+    char old[NAME_MAX+1], name[NAME_MAX+1], maildir[MAXLINE+1];
+    share_t *box = session->box;
+    msg_t cur;
+    int i;
+
+    sprintf(maildir, "%s/Maildir", session->user);
+    share_lock(box);
+    i = share_uid(box, msg->id);
+    if(!share_msg(box, i, &cur, old, NULL) || cur.id != msg->id) {
+        share_unlock(box);
+        return 1;
+    }
+    if(cur.modseq > unchanged || (cur.seen == msg->seen && cur.deleted == msg->deleted)) {
+        share_unlock(box);
+        msg->modseq = cur.modseq;
+        return cur.modseq <= unchanged;
+    }
+
+    snprintf(name, sizeof(name), "%s", old);
+    if((comma = strchr(name, ',')) != NULL) {
+        comma[1] = 0;
+        if(msg->seen)    strcat(name, "S");
+        if(msg->deleted) strcat(name, "D");
+    }
+
+    // Sem a linha no diário a mudança se perderia, então ela não vale
+    if(!share_journal(box, maildir, msg->id, old, name)) {
+        share_unlock(box);
+        msg->seen = cur.seen;
+        msg->deleted = cur.deleted;
+        msg->modseq = cur.modseq;
+        return -1;
+    }
+    share_set(box, msg, NULL, NULL, NULL);
+    msg->modseq = box->msgs[i].modseq;
+    share_unlock(box);
+
+    if(box->hdr->journal >= JOURNALMAX || !flush_arm())
+        share_flush(box, maildir);
+
+    return 1;
+}
+
+// Cria o timerfd dos diários de flags do processo
+void flush_init() {
+    if((flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+        perror("timerfd_create :(\n");
+}
+
+// Agenda a aplicação dos diários, se ainda não estiver agendada.
+// Retorna false se não houver o timerfd
+bool flush_arm() {
+    struct itimerspec its;
+
+    if(flush_fd == -1) return false;
+    if(flush_armed) return true;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = FLUSHDELAY;
+    if(timerfd_settime(flush_fd, 0, &its, NULL) == -1)
+        return false;
+
+    flush_armed = true;
+    return true;
+}
+
+// Aplica os diários que este processo escreveu, quando o timerfd avisar
+void flush_event() {
+    char path[MAXLINE+1];
+    share_t *share;
+    uint64_t n;
+
+    if(read(flush_fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("timerfd :(\n");
+    flush_armed = false;
+
+    for(share = shares; share != NULL; share = share->next) {
+        if(!share->pending) continue;
+        sprintf(path, "%s/Maildir", share->user);
+        share_flush(share, path);
+    }
+}
+
+// Verifica se a linha de comando 'line', terminada pelo cabeçalho de
+// literal em 'tail', é de um APPEND cujo literal é o da mensagem, que
+// não espera no buffer de entrada. Para isso a caixa deve vir antes
+// dele; se a própria caixa for o literal, o comando segue o caminho
+// normal
+bool append_cmd(char const *line, char const *tail) {
+    char const *p = line;
+
+    for(; p < tail && *p == ' '; p++);
+    for(; p < tail && *p != ' '; p++);
+    for(; p < tail && *p == ' '; p++);
+    if(tail - p < 7 || strncasecmp(p, "APPEND ", 7) != 0) return false;
+
+    for(p += 7; p < tail && *p == ' '; p++);
+    return p < tail;
+}
+
+// Lê a data de entrega do APPEND ("dd-Mon-yyyy hh:mm:ss +zzzz", com o
+// dia talvez começando por um espaço) para 't', em segundos desde 1970
+// no UTC. Retorna false se ela for inválida
+bool append_date(char const *s, int64_t *t) {
+    char date[64], *p = date;
+    int i;
+
+    // Os dois primeiros '-' separam o dia, o mês e o ano, como os
+    // espaços do campo Date
+    snprintf(date, sizeof(date), "%s", s);
+    for(i = 0; i < 2 && (p = strchr(p, '-')) != NULL; i++)
+        *p = ' ';
+
+    return i == 2 && sort_date(date, strlen(date), t);
+}
+
+// Começa a receber uma mensagem do APPEND, de 'size' bytes, com as
+// flags e a data de entrega opcionais de 'argv': cria o arquivo em
+// 'tmp/'. Das flags só são guardadas as que a caixa conhece. 'sync'
+// indica que o cliente espera a confirmação antes de enviar o literal,
+// que cabe a quem chama. Se algo estiver errado, o APPEND inteiro é
+// recusado e retorna false
+bool append_begin(session_t *session, slice_t *argv, int argc, size_t size, bool sync) {
+    static unsigned count = 0;
+    char path[MAXLINE+1], *flag, *saveptr;
+    struct timespec now;
+    staged_t *st, msg;
+    int k = 0, fd;
+
+    memset(&msg, 0, sizeof(msg));
+    if(k < argc && argv[k].kind == '(') {
+        for(flag = strtok_r(argv[k].s, " ", &saveptr); flag != NULL; flag = strtok_r(NULL, " ", &saveptr)) {
+            if(!strcasecmp(flag, "\\Seen")) msg.seen = true;
+            else if(!strcasecmp(flag, "\\Deleted")) msg.deleted = true;
+        }
+        k++;
+    }
+    if(k < argc && argv[k].kind == '"' && append_date(argv[k].s, &msg.date))
+        k++;
+    if(k != argc) {
+        append_fail(session, "BAD", "APPEND Argumentos inválidos", size, sync);
+        return false;
+    }
+
+    // Um literal vazio cancela o MULTIAPPEND inteiro
+    if(size == 0 || size > MAXAPPEND) {
+        append_fail(session, "NO", size ? "[TOOBIG] APPEND Mensagem grande demais" : "APPEND Mensagem vazia", size, sync);
+        return false;
+    }
+
+    // Nome no formato do Maildir, em que a ordem dos nomes é a ordem de
+    // chegada, a mesma dos UIDs
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(msg.name, sizeof(msg.name), "%lld.M%06ldP%dQ%u.ep1", (long long)now.tv_sec, now.tv_nsec/1000,
+             (int)getpid(), ++count);
+    msg.size = size;
+
+    sprintf(path, "%s/Maildir/tmp", session->user);
+    if(access(path, F_OK) == -1 && errno == ENOENT) mkdir(path, 0700);
+    sprintf(path, "%s/Maildir/tmp/%s", session->user, msg.name);
+    if((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) == -1) {
+        perror(path);
+        append_fail(session, "NO", "APPEND Não foi possível gravar a mensagem", size, sync);
+        return false;
+    }
+
+    if(session->nstaged == session->stagecap) {
+        session->stagecap = session->stagecap ? 2*session->stagecap : 4;
+        session->staged = (staged_t*)realloc(session->staged, session->stagecap*sizeof(staged_t));
+    }
+    st = &session->staged[session->nstaged++];
+    *st = msg;
+
+    session->appendfd = fd;
+    session->appendleft = size;
+    return true;
+}
+
+// Grava 'len' bytes do literal no arquivo da mensagem. Uma falha não
+// interrompe a recepção, que continua até o fim do literal, mas faz o
+// APPEND ser recusado no final
+void append_write(session_t *session, char const *data, size_t len) {
+    ssize_t n;
+
+    while(len > 0 && !session->appendfail) {
+        if((n = write(session->appendfd, data, len)) == -1) {
+            if(errno == EINTR) continue;
+            perror("APPEND :(\n");
+            session->appendfail = true;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Recebe os 'len' bytes seguintes do literal, que já estavam no buffer
+// de entrada
+void append_data(session_t *session, char const *data, size_t len) {
+    append_write(session, data, len);
+    session->appendleft -= len;
+    if(session->appendleft == 0) append_close(session);
+}
+
+// Grava direto do socket para o arquivo o que já chegou do literal, sem
+// copiar os dados para o processo: do socket para um pipe e do pipe
+// para o arquivo, com splice. Se o sistema de arquivos não aceitar o
+// splice, o pipe é lido e gravado normalmente. Retorna -1 se a conexão
+// foi fechada
+int append_splice(session_t *session) {
+    static int pipefd[2] = {-1, -1};
+    char buf[MAXLINE];
+    ssize_t n, m;
+    size_t chunk;
+
+    if(pipefd[0] == -1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe :(\n");
+        return 0;
+    }
+
+    while(session->appendleft > 0) {
+        chunk = session->appendleft < 65536 ? session->appendleft : 65536;
+        if((n = splice(session->connfd, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == 0)
+            return -1;
+        if(n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        session->appendleft -= n;
+
+        // O pipe sempre é esvaziado antes do próximo trecho
+        for(; n > 0; n -= m) {
+            m = session->appendfail ? -1 : splice(pipefd[0], NULL, session->appendfd, NULL, n, SPLICE_F_MOVE);
+            if(m > 0) continue;
+            if((m = read(pipefd[0], buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf))) <= 0) {
+                // O que ficou no pipe se perde: o APPEND vai ser recusado,
+                // e o resto do literal é lido normalmente. O pipe é
+                // trocado por um novo na próxima vez
+                perror("pipe :(\n");
+                session->appendfail = true;
+                close(pipefd[0]);
+                close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                if(session->appendleft == 0) append_close(session);
+                return 0;
+            }
+            append_write(session, buf, m);
+        }
+    }
+
+    append_close(session);
+    return 0;
+}
+
+// Termina o arquivo de uma mensagem, já com o literal inteiro: aplica a
+// data de entrega e adianta a gravação no disco, que o fsync em grupo
+// só precisa esperar
+void append_close(session_t *session) {
+    staged_t *st = &session->staged[session->nstaged-1];
+    struct timespec ts[2];
+
+    if(st->date != 0) {
+        ts[0].tv_sec = ts[1].tv_sec = st->date;
+        ts[0].tv_nsec = ts[1].tv_nsec = 0;
+        futimens(session->appendfd, ts);
+    }
+    sync_file_range(session->appendfd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    close(session->appendfd);
+    session->appendfd = -1;
+
+    if(session->trace)
+        log_printf(LOG_TRACE, "%d C: [%zu bytes da mensagem]\n", session->id, st->size);
+}
+
+// Interpreta o restante da linha do APPEND depois de um literal: o fim
+// do comando, ou as flags, a data e o literal da próxima mensagem do
+// MULTIAPPEND
+void append_next(session_t *session, char *line, size_t len) {
+    slice_t *argv = NULL;
+    int argc = 0, cap = 0;
+    size_t size;
+    bool sync;
+    char *tail, *p;
+
+    if(session->trace)
+        log_data(session->id, "C", line, len);
+
+    if((tail = literal_tail(line, len, &size, &sync)) == NULL) {
+        for(p = line; p < line + len && (*p == '\r' || *p == '\n'); p++);
+        if(p == line + len)
+            append_end(session);
+        else
+            append_fail(session, "BAD", "APPEND Argumentos inválidos", 0, true);
+        return;
+    }
+
+    if(parse_args(line, tail, &argv, &argc, &cap) == -1)
+        append_fail(session, "BAD", "APPEND Argumentos inválidos", size, sync);
+    else if(append_begin(session, argv, argc, size, sync) && sync)
+        respond("+", "Pronto para o literal", NULL, session);
+    free(argv);
+}
+
+// Fim do APPEND: as mensagens esperam o fsync em grupo, e os comandos
+// seguintes da sessão esperam a confirmação
+void append_end(session_t *session) {
+    if(session->appendfail) {
+        append_fail(session, "NO", "APPEND Não foi possível gravar a mensagem", 0, true);
+        return;
+    }
+
+    if(ncommit == commitcap) {
+        commitcap = commitcap ? 2*commitcap : 16;
+        committers = (session_t**)realloc(committers, commitcap*sizeof(session_t*));
+    }
+    session->appending = false;
+    session->committing = true;
+    session->commitpos = ncommit;
+    committers[ncommit++] = session;
+}
+
+// Recusa o APPEND em andamento, apagando as mensagens já gravadas em
+// 'tmp/'. Um literal não-síncrono de 'size' bytes, que o cliente envia
+// mesmo assim, é descartado junto com o restante da linha
+void append_fail(session_t *session, char const *status, char const *message, size_t size, bool sync) {
+    respond(session->appendtag, status, message, session);
+    append_clear(session, true);
+
+    if(!sync && size > 0) {
+        session->skip = size;
+        session->discard = true;
+    }
+}
+
+// Esquece as mensagens do APPEND da sessão, apagando os arquivos de
+// 'tmp/' se 'remove' for verdadeiro
+void append_clear(session_t *session, bool remove) {
+    char path[MAXLINE+1];
+    int i;
+
+    if(session->appendfd != -1) close(session->appendfd);
+    for(i = 0; remove && i < session->nstaged; i++) {
+        sprintf(path, "%s/Maildir/tmp/%s", session->user, session->staged[i].name);
+        unlink(path);
+    }
+
+    session->appendfd = -1;
+    session->nstaged = 0;
+    session->appendleft = 0;
+    session->appending = session->appendfail = false;
+}
+
+// Fsync em grupo dos APPENDs terminados nesta iteração do loop de
+// eventos. Para cada usuário, um único syncfs grava no disco o conteúdo
+// de todas as mensagens, que então são renomeadas para 'cur/' com as
+// flags, e um fsync do diretório grava os nomes novos. As mensagens
+// recebem UIDs na próxima leitura da caixa, na ordem dos nomes, que é a
+// de chegada; ela só é relida aqui se alguma das sessões a tiver
+// selecionada, para receber o EXISTS antes da confirmação. Assim um
+// envio em massa não relê a caixa inteira a cada APPEND. As sessões
+// atendidas vão para 'committed'
+void append_commit() {
+    char path[MAXLINE+1], from[MAXLINE+1], to[MAXLINE+1];
+    session_t *session;
+    staged_t const *st;
+    share_t *share;
+    char const *user;
+    bool ok, selected;
+    int i, j, k, fd;
+
+    if(ncommit > committedcap) {
+        committedcap = commitcap;
+        committed = (session_t**)realloc(committed, committedcap*sizeof(session_t*));
+    }
+    memcpy(committed, committers, ncommit*sizeof(session_t*));
+    ncommitted = ncommit;
+    ncommit = 0;
+
+    for(i = 0; i < ncommitted; i++) {
+        user = committed[i]->user;
+        for(j = 0; j < i && committed[j]->user != user; j++);
+        if(j < i) continue;
+
+        sprintf(path, "%s/Maildir/tmp", user);
+        if(!(ok = ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1 && syncfs(fd) == 0)))
+            perror(path);
+        if(fd != -1) close(fd);
+
+        selected = false;
+        for(j = i; j < ncommitted; j++) {
+            session = committed[j];
+            if(session->user != user) continue;
+            if(!ok) session->appendfail = true;
+            if(session->state == SELECTED) selected = true;
+
+            for(k = 0; k < session->nstaged && !session->appendfail; k++) {
+                st = &session->staged[k];
+                sprintf(from, "%s/Maildir/tmp/%s", user, st->name);
+                sprintf(to, "%s/Maildir/cur/%s:2,%s%s", user, st->name, st->seen ? "S" : "", st->deleted ? "D" : "");
+                if(rename(from, to) == -1) {
+                    perror(to);
+                    session->appendfail = true;
+                    break;
+                }
+            }
+
+            // O MULTIAPPEND é tudo ou nada: se uma mensagem falhou, as
+            // que já estavam em 'cur/' são apagadas
+            while(session->appendfail && k-- > 0) {
+                st = &session->staged[k];
+                sprintf(to, "%s/Maildir/cur/%s:2,%s%s", user, st->name, st->seen ? "S" : "", st->deleted ? "D" : "");
+                unlink(to);
+            }
+        }
+
+        sprintf(path, "%s/Maildir/cur", user);
+        if((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 || fsync(fd) == -1)
+            perror(path);
+        if(fd != -1) close(fd);
+
+        sprintf(path, "%s/Maildir", user);
+        if(selected && (share = share_get(user)) != NULL) {
+            if(share_open(share, path) == -1) perror(path);
+            share_put(share);
+        }
+    }
+
+    for(i = 0; i < ncommitted; i++) {
+        session = committed[i];
+        session->committing = false;
+        if(session->appendfail) {
+            append_fail(session, "NO", "APPEND Não foi possível gravar a mensagem", 0, true);
+            continue;
+        }
+
+        if(session->state == SELECTED) session_update(session, true);
+        respond(session->appendtag, "OK", "APPEND completado", session);
+        append_clear(session, false);
+    }
 }
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Log do servidor. As mensagens são formatadas pelo processo
+// trabalhador e colocadas em um anel em memória, sem travas, e uma
+// thread separada as escreve na saída padrão. Assim o loop de eventos
+// nunca espera pela escrita do log, e se o anel encher as mensagens
+// novas são descartadas
+
+// Níveis de log: erros, abertura e fechamento de conexões, e a
+// transcrição do protocolo (desligada por padrão)
+typedef enum {LOG_ERROR, LOG_INFO, LOG_TRACE} loglevel_t;
+
+// Tamanho do anel (potência de 2), tamanho máximo de uma mensagem e
+// quantos bytes de uma linha do protocolo (ou literal) são mantidos
+#define LOGSIZE (1 << 20)
+#define LOGLINE 1024
+#define LOGTRUNC 256
+
+// Anel com um produtor (o loop de eventos) e um consumidor (a thread
+// de escrita). 'head' só é alterado pelo produtor e 'tail' só pelo
+// consumidor, sempre crescendo, e a posição no anel é o resto da
+// divisão por LOGSIZE
+typedef struct {char data[LOGSIZE]; size_t head, tail; unsigned long dropped;} logring_t;
+
+// Nível atual e amostragem da transcrição: só uma a cada 'log_sample'
+// sessões tem o protocolo registrado
+loglevel_t log_level = LOG_INFO;
+int log_sample = 1;
+logring_t *logring = NULL;
+
+//========================================= FUNÇÕES =========================================
+void log_init();
+void *log_writer(void *arg);
+void log_put(char const *s, size_t len);
+void log_printf(loglevel_t level, char const *fmt, ...);
+void log_data(int id, char const *dir, char const *data, size_t len);
+
+
+// Cria o anel e a thread de escrita do processo atual
+void log_init() {
+    pthread_t thread;
+
+    logring = (logring_t*)calloc(1, sizeof(logring_t));
+    if(pthread_create(&thread, NULL, log_writer, NULL) != 0) {
+        perror("pthread_create :(\n");
+        exit(9);
+    }
+    pthread_detach(thread);
+}
+
+// Thread de escrita: envia para a saída padrão tudo o que estiver no
+// anel, esperando um pouco quando ele estiver vazio
+void *log_writer(void *arg) {
+    struct timespec pause = {0, 5000000};
+    size_t head, tail, i, n;
+    ssize_t w;
+
+    (void)arg;
+    for(;;) {
+        tail = logring->tail;
+        head = __atomic_load_n(&logring->head, __ATOMIC_ACQUIRE);
+        if(head == tail) {
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // Escreve até o fim do anel, o restante vai na próxima volta
+        i = tail & (LOGSIZE-1);
+        n = head - tail;
+        if(n > LOGSIZE - i) n = LOGSIZE - i;
+        if((w = write(STDOUT_FILENO, logring->data + i, n)) < 0) {
+            if(errno != EINTR && errno != EAGAIN) w = n;
+            else w = 0;
+        }
+        __atomic_store_n(&logring->tail, tail + w, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// Coloca 'len' bytes no anel, ou os descarta se não couberem
+void log_put(char const *s, size_t len) {
+    char note[64];
+    size_t head, room, i, n;
+
+    // Sem o anel (fora dos processos trabalhadores) escreve direto
+    if(logring == NULL) {
+        fwrite(s, 1, len, stdout);
+        return;
+    }
+
+    head = logring->head;
+    room = LOGSIZE - (head - __atomic_load_n(&logring->tail, __ATOMIC_ACQUIRE));
+
+    // Avisa quantas mensagens foram descartadas assim que houver espaço
+    if(logring->dropped > 0 && room >= len + sizeof(note)) {
+        n = sprintf(note, "[%lu mensagens de log descartadas]\n", logring->dropped);
+        logring->dropped = 0;
+        log_put(note, n);
+        head = logring->head;
+        room -= n;
+    }
+
+    if(len > room) {
+        logring->dropped++;
+        return;
+    }
+
+    i = head & (LOGSIZE-1);
+    n = (len < LOGSIZE - i) ? len : LOGSIZE - i;
+    memcpy(logring->data + i, s, n);
+    memcpy(logring->data, s + n, len - n);
+    __atomic_store_n(&logring->head, head + len, __ATOMIC_RELEASE);
+}
+
+// Registra uma mensagem formatada como no printf, se o nível 'level'
+// estiver ligado
+void log_printf(loglevel_t level, char const *fmt, ...) {
+    char line[LOGLINE];
+    va_list ap;
+    int n;
+
+    if(level > log_level) return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if(n >= (int)sizeof(line)) n = sizeof(line)-1;
+    if(n > 0) log_put(line, n);
+}
+
+// Registra uma linha do protocolo da sessão 'id' ("C" para o cliente e
+// "S" para o servidor). Linhas longas e literais são truncados em
+// LOGTRUNC bytes, com o tamanho original indicado no final
+void log_data(int id, char const *dir, char const *data, size_t len) {
+    char line[LOGLINE];
+    int n;
+
+    if(len <= LOGTRUNC) {
+        n = snprintf(line, sizeof(line), "%d %s: %.*s", id, dir, (int)len, data);
+        if(len == 0 || data[len-1] != '\n') line[n++] = '\n';
+    } else {
+        n = snprintf(line, sizeof(line), "%d %s: %.*s... [%zu bytes]\n", id, dir, LOGTRUNC, data, len);
+    }
+
+    if(n >= (int)sizeof(line)) n = sizeof(line)-1;
+    log_put(line, n);
+}
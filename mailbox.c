@@ -0,0 +1,739 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Índice da caixa de mensagens selecionada
+
+// Mensagem da caixa. O nome do arquivo, a BODYSTRUCTURE e as chaves de
+// ordenação do SORT e do THREAD (sort.c) ficam na área de strings da
+// caixa, referenciados pela posição ('name', 'bs' e 'keys'). O tamanho
+// do header, as contagens de linhas, a BODYSTRUCTURE, as chaves, a data
+// do campo Date ('sent') e se o assunto é de uma resposta ('reply') só
+// são calculados na primeira vez que o texto for necessário ('parsed').
+// 'modseq' é o valor do contador de alterações da caixa quando a
+// mensagem chegou ou teve as flags alteradas pela última vez, 'date' é a
+// data de entrega (a da última alteração do arquivo) e 'recent' indica
+// que nenhuma sessão a viu ainda
+typedef struct {uint64_t modseq; int64_t date, sent; int id, fsize, hsize, hlines, flines; uint32_t name, bs, keys;
+                bool seen, deleted, parsed, recent, reply;} msg_t;
+
+// As mensagens ficam em um vetor contínuo ordenado por UID, de forma
+// que o número de sequência de uma mensagem é a sua posição + 1 e a
+// busca por UID é uma busca binária. 'modseq' é o contador de
+// alterações, 'uidvalidity' e 'uidnext' vêm da lista de UIDs, 'mtime'
+// é a data de modificação de 'cur/' quando a caixa foi lida e 'dirty'
+// indica que o índice em disco ficou desatualizado. 'moved' tem os
+// nomes (separados por '\0') das mensagens que mbox_deliver acabou de
+// trazer de 'new/'
+typedef struct {msg_t *msgs; int exists, cap; buf_t strings; uint64_t modseq; uint32_t uidvalidity, uidnext;
+                char *maildir; struct timespec mtime; bool dirty; buf_t moved;} mailbox_t;
+
+// Tabela de espalhamento dos nomes das mensagens de uma caixa (sem as
+// flags), com a posição + 1 de cada uma ou 0 nas posições livres
+typedef struct {int *slot; unsigned mask;} names_t;
+
+// Índice em disco de cada caixa, em 'Maildir/ep1.index': o cabeçalho,
+// o vetor de mensagens e a área de strings, exatamente como ficam na
+// memória. Ele vale enquanto a data de modificação de 'cur/' for a
+// mesma gravada no cabeçalho, já que criar, remover ou renomear uma
+// mensagem altera essa data; o conteúdo de uma mensagem nunca muda
+// depois de entregue. Uma data zerada indica que o índice precisa ser
+// conferido com o diretório no próximo SELECT
+#define MBOXINDEX "ep1.index"
+#define MBOXMAGIC 0x78646931u
+#define MBOXVERSION 7
+typedef struct {uint32_t magic, version, msgsize, strings; int64_t sec, nsec; int32_t exists; uint64_t modseq;
+                uint32_t uidvalidity, uidnext;} mboxhdr_t;
+
+// Lista de UIDs de cada caixa, em 'Maildir/ep1.uidlist', que ao
+// contrário do índice não pode ser perdida: ela garante que um UID
+// nunca muda nem é reaproveitado. A primeira linha é "1 V<uidvalidity>
+// N<uidnext>" e cada uma das seguintes é "<uid> <nome>", com o nome do
+// arquivo sem as flags. UIDs novos são acrescentados no final e só são
+// usados depois de gravados no disco; uma linha incompleta no final é
+// de um acréscimo interrompido e é descartada. A lista é reescrita sem
+// as mensagens removidas quando crescer demais
+#define MBOXUIDLIST "ep1.uidlist"
+
+//========================================= FUNÇÕES =========================================
+msg_t *mbox_add(mailbox_t *mbox);
+uint32_t mbox_str(mailbox_t *mbox, char const *s);
+char const *mbox_get(mailbox_t const *mbox, uint32_t off);
+int msg_cmp(void const *a, void const *b);
+void mbox_sort(mailbox_t *mbox);
+int mbox_uid(mailbox_t const *mbox, uint32_t uid);
+void mbox_clear(mailbox_t *mbox);
+void mbox_free(mailbox_t *mbox);
+msg_t parse_title(char const *name);
+int mbox_open(mailbox_t *mbox, char const *maildir);
+int mbox_deliver(mailbox_t *mbox, char const *maildir);
+int mbox_read(mailbox_t *mbox, char const *file);
+void mbox_compact(mailbox_t *mbox);
+void mbox_write(mailbox_t *mbox);
+int mbox_scan(mailbox_t *mbox, char const *cur);
+void mbox_assign(mailbox_t *mbox, bool known);
+int uidlist_open(mailbox_t *mbox, char const *file, off_t *size);
+void uidlist_load(mailbox_t *list, int fd);
+void uidlist_write(mailbox_t *mbox, char const *file);
+bool same_file(char const *a, char const *b);
+unsigned name_hash(char const *name);
+void names_init(names_t *names, mailbox_t const *mbox);
+int names_find(names_t const *names, mailbox_t const *mbox, char const *name);
+int name_cmp(void const *a, void const *b);
+int fresh_cmp(void const *a, void const *b, void *mbox);
+
+
+// Adiciona uma mensagem vazia no final da caixa
+msg_t *mbox_add(mailbox_t *mbox) {
+    if(mbox->exists == mbox->cap) {
+        mbox->cap = mbox->cap ? 2*mbox->cap : 64;
+        mbox->msgs = (msg_t*)realloc(mbox->msgs, mbox->cap*sizeof(msg_t));
+    }
+
+    memset(&mbox->msgs[mbox->exists], 0, sizeof(msg_t));
+    return &mbox->msgs[mbox->exists++];
+}
+
+// Copia a string 's' para a área de strings e retorna a sua posição
+uint32_t mbox_str(mailbox_t *mbox, char const *s) {
+    uint32_t off = mbox->strings.len;
+
+    buf_append(&mbox->strings, s, strlen(s)+1);
+    return off;
+}
+
+// String na posição 'off' da área de strings. O ponteiro só vale até a
+// próxima string adicionada
+char const *mbox_get(mailbox_t const *mbox, uint32_t off) {
+    return mbox->strings.data + off;
+}
+
+// Compara duas mensagens pelo UID, para o qsort
+int msg_cmp(void const *a, void const *b) {
+    return ((msg_t const*)a)->id - ((msg_t const*)b)->id;
+}
+
+// Ordena as mensagens por UID
+void mbox_sort(mailbox_t *mbox) {
+    qsort(mbox->msgs, mbox->exists, sizeof(msg_t), msg_cmp);
+}
+
+// Posição da primeira mensagem com UID maior ou igual a 'uid', ou
+// 'exists' se não houver nenhuma
+int mbox_uid(mailbox_t const *mbox, uint32_t uid) {
+    int lo = 0, hi = mbox->exists, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if((uint32_t)mbox->msgs[mid].id < uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Esvazia a caixa, mantendo a memória alocada
+void mbox_clear(mailbox_t *mbox) {
+    mbox->exists = 0;
+    mbox->strings.len = 0;
+    mbox->mtime.tv_sec = mbox->mtime.tv_nsec = 0;
+    mbox->dirty = false;
+}
+
+// Libera a memória da caixa
+void mbox_free(mailbox_t *mbox) {
+    free(mbox->msgs);
+    free(mbox->maildir);
+    buf_free(&mbox->strings);
+    buf_free(&mbox->moved);
+    memset(mbox, 0, sizeof(mailbox_t));
+}
+
+// Extrai as flags de uma mensagem a partir do nome do arquivo. O UID
+// vem da lista de UIDs
+msg_t parse_title(char const *name) {
+    char *token, *saveptr, filename[NAME_MAX+1];
+    msg_t msg;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    snprintf(filename, sizeof(filename), "%s", name);
+
+    // Primeira parte do nome identifica o arquivo
+    token = strtok_r(filename, ":", &saveptr);
+
+    // Versão do Maildir
+    token = strtok_r(NULL, ",", &saveptr);
+
+    // Flags
+    msg.seen = false;
+    msg.deleted = false;
+    token = strtok_r(NULL, "\n\r", &saveptr);
+    if(!token)
+        return msg;
+
+    for(i = 0; i < (int)strlen(token); i++) {
+        switch(token[i]) {
+            case 'S':
+                msg.seen = true;
+                break;
+            case 'D':
+                msg.deleted = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return msg;
+}
+
+// Carrega a caixa do Maildir 'maildir'. A caixa pode já vir preenchida
+// (da memória compartilhada); vazia, ela é lida do índice em disco. Se
+// 'cur/' não mudou desde então não há mais nada a fazer; senão o
+// diretório é percorrido e só os arquivos que a caixa não conhece são
+// examinados, e o índice é regravado. Retorna -1 se 'cur/' não pôde
+// ser lido
+int mbox_open(mailbox_t *mbox, char const *maildir) {
+    char cur[PATH_MAX], file[PATH_MAX];
+    struct timespec now;
+    struct stat st;
+
+    free(mbox->maildir);
+    mbox->maildir = strdup(maildir);
+
+    snprintf(cur, sizeof(cur), "%s/cur", maildir);
+    snprintf(file, sizeof(file), "%s/" MBOXINDEX, maildir);
+    if(stat(cur, &st) == -1)
+        return -1;
+
+    if(mbox->exists == 0 && mbox->strings.len == 0)
+        mbox_read(mbox, file);
+
+    if(mbox->mtime.tv_sec != 0 && mbox->mtime.tv_sec == st.st_mtim.tv_sec && mbox->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return 0;
+
+    // A data é lida antes do diretório: o que mudar durante a leitura
+    // altera a data e invalida o índice
+    if(mbox_scan(mbox, cur) == -1)
+        return -1;
+    mbox_sort(mbox);
+
+    // Alterações dentro do mesmo tique do relógio do sistema de arquivos
+    // não mudam a data, então uma data recente ainda não é confiável
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec - st.st_mtim.tv_sec < 2)
+        st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+
+    if(mbox->dirty || mbox->mtime.tv_sec != st.st_mtim.tv_sec || mbox->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        mbox->mtime = st.st_mtim;
+        mbox_write(mbox);
+    }
+    return 0;
+}
+
+// Lê o índice 'file' para a caixa (que deve estar vazia).
+// Retorna -1 se ele não existir ou for inválido
+int mbox_read(mailbox_t *mbox, char const *file) {
+    mboxhdr_t hdr;
+    struct stat st;
+    size_t size;
+    int fd, i;
+
+    if((fd = open(file, O_RDONLY)) == -1)
+        return -1;
+
+    size = 0;
+    if(fstat(fd, &st) == 0 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+       hdr.magic == MBOXMAGIC && hdr.version == MBOXVERSION && hdr.msgsize == sizeof(msg_t) && hdr.exists >= 0)
+        size = sizeof(hdr) + hdr.exists*sizeof(msg_t) + hdr.strings;
+
+    if(size == 0 || size != (size_t)st.st_size) {
+        close(fd);
+        return -1;
+    }
+
+    if(hdr.exists > mbox->cap) {
+        mbox->cap = hdr.exists;
+        mbox->msgs = (msg_t*)realloc(mbox->msgs, mbox->cap*sizeof(msg_t));
+    }
+    buf_reserve(&mbox->strings, hdr.strings);
+
+    if(read(fd, mbox->msgs, hdr.exists*sizeof(msg_t)) != (ssize_t)(hdr.exists*sizeof(msg_t)) ||
+       read(fd, mbox->strings.data, hdr.strings) != (ssize_t)hdr.strings) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // Confere as posições das strings, que sempre terminam em '\0'
+    if(hdr.strings == 0 || mbox->strings.data[hdr.strings-1] != 0)
+        return -1;
+    for(i = 0; i < hdr.exists; i++) {
+        if(mbox->msgs[i].name >= hdr.strings || mbox->msgs[i].bs >= hdr.strings || mbox->msgs[i].keys >= hdr.strings)
+            return -1;
+    }
+
+    mbox->exists = hdr.exists;
+    mbox->strings.len = hdr.strings;
+    mbox->mtime.tv_sec = hdr.sec;
+    mbox->mtime.tv_nsec = hdr.nsec;
+    mbox->modseq = hdr.modseq;
+    mbox->uidvalidity = hdr.uidvalidity;
+    mbox->uidnext = hdr.uidnext;
+    return 0;
+}
+
+// Compacta a área de strings, descartando os nomes antigos das
+// mensagens renomeadas
+void mbox_compact(mailbox_t *mbox) {
+    buf_t strings = {NULL, 0, 0};
+    char const *s;
+    msg_t *msg;
+    int i;
+
+    buf_append(&strings, "", 1);
+    for(i = 0; i < mbox->exists; i++) {
+        msg = &mbox->msgs[i];
+        s = mbox_get(mbox, msg->name);
+        msg->name = strings.len;
+        buf_append(&strings, s, strlen(s)+1);
+
+        if(msg->parsed) {
+            s = mbox_get(mbox, msg->bs);
+            msg->bs = strings.len;
+            buf_append(&strings, s, strlen(s)+1);
+            s = mbox_get(mbox, msg->keys);
+            msg->keys = strings.len;
+            buf_append(&strings, s, strlen(s)+1);
+        } else {
+            msg->bs = msg->keys = 0;
+        }
+    }
+    buf_free(&mbox->strings);
+    mbox->strings = strings;
+}
+
+// Grava o índice da caixa, já compactada, primeiro em um arquivo
+// temporário que depois substitui o anterior, para que ninguém leia um
+// índice pela metade
+void mbox_write(mailbox_t *mbox) {
+    char file[PATH_MAX], tmp[PATH_MAX+16];
+    struct iovec iov[3];
+    mboxhdr_t hdr;
+    ssize_t size;
+    int fd;
+
+    mbox_compact(mbox);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MBOXMAGIC;
+    hdr.version = MBOXVERSION;
+    hdr.msgsize = sizeof(msg_t);
+    hdr.strings = mbox->strings.len;
+    hdr.sec = mbox->mtime.tv_sec;
+    hdr.nsec = mbox->mtime.tv_nsec;
+    hdr.exists = mbox->exists;
+    hdr.modseq = mbox->modseq;
+    hdr.uidvalidity = mbox->uidvalidity;
+    hdr.uidnext = mbox->uidnext;
+
+    snprintf(file, sizeof(file), "%s/" MBOXINDEX, mbox->maildir);
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror(tmp);
+        return;
+    }
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = mbox->msgs;
+    iov[1].iov_len = mbox->exists*sizeof(msg_t);
+    iov[2].iov_base = mbox->strings.data;
+    iov[2].iov_len = mbox->strings.len;
+    size = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+    if(writev(fd, iov, 3) != size || close(fd) == -1 || rename(tmp, file) == -1) {
+        perror(tmp);
+        unlink(tmp);
+        return;
+    }
+
+    mbox->dirty = false;
+}
+
+// Lê o diretório 'cur', aproveitando da caixa atual (lida do índice)
+// o que já se sabe de cada arquivo, encontrado pelo nome. Os arquivos
+// novos só têm o tamanho e a data lidos; o conteúdo é analisado no
+// primeiro FETCH que precisar dele, e o UID vem da lista de UIDs.
+// Mensagens novas ou com flags diferentes recebem um novo 'modseq', e
+// a caixa é marcada como alterada se algum arquivo mudou
+int mbox_scan(mailbox_t *mbox, char const *cur) {
+    mailbox_t old = *mbox;
+    names_t names;
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    msg_t *msg, *prev;
+    bool fresh = false;
+    int i;
+
+    if((dir = opendir(cur)) == NULL)
+        return -1;
+
+    // Sem o índice, o contador de alterações recomeça de um valor tirado
+    // do relógio, para não voltar atrás de um que um cliente já viu
+    if(old.uidvalidity == 0 && mbox->modseq < ((uint64_t)time(NULL) << 10))
+        mbox->modseq = (uint64_t)time(NULL) << 10;
+
+    names_init(&names, &old);
+    mbox->msgs = NULL;
+    mbox->exists = mbox->cap = 0;
+    memset(&mbox->strings, 0, sizeof(buf_t));
+
+    while((ent = readdir(dir)) != NULL) {
+        if(ent->d_name[0] == '.') continue;
+        if(ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN) continue;
+
+        msg = mbox_add(mbox);
+        *msg = parse_title(ent->d_name);
+
+        // Mesmo arquivo, talvez com outras flags: só o nome muda
+        i = names_find(&names, &old, ent->d_name);
+        prev = (i >= 0) ? &old.msgs[i] : NULL;
+        if(prev != NULL) {
+            if(strcmp(mbox_get(&old, prev->name), ent->d_name) != 0) mbox->dirty = true;
+            if(msg->seen == prev->seen && msg->deleted == prev->deleted) msg->modseq = prev->modseq;
+            msg->id     = prev->id;
+            msg->date   = prev->date;
+            msg->recent = prev->recent;
+            msg->fsize  = prev->fsize;
+            msg->hsize  = prev->hsize;
+            msg->hlines = prev->hlines;
+            msg->flines = prev->flines;
+            msg->sent   = prev->sent;
+            msg->reply  = prev->reply;
+            if((msg->parsed = prev->parsed)) {
+                msg->bs = mbox_str(mbox, mbox_get(&old, prev->bs));
+                msg->keys = mbox_str(mbox, mbox_get(&old, prev->keys));
+            }
+
+        } else if(fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+            msg->fsize = st.st_size;
+            msg->date  = st.st_mtime;
+            mbox->dirty = true;
+            fresh = true;
+
+        } else {
+            mbox->exists--;
+            continue;
+        }
+
+        msg->name = mbox_str(mbox, ent->d_name);
+        if(msg->modseq == 0) msg->modseq = ++mbox->modseq;
+    }
+    closedir(dir);
+    free(names.slot);
+
+    // Os arquivos novos recebem UIDs, e uma caixa desconhecida também
+    // recebe a sua lista de UIDs
+    if(fresh || old.uidvalidity == 0) mbox_assign(mbox, old.uidvalidity != 0);
+
+    if(mbox->exists != old.exists) mbox->dirty = true;
+    free(old.msgs);
+    buf_free(&old.strings);
+    return 0;
+}
+
+// Dá UIDs às mensagens novas da caixa (as com UID 0), na ordem dos
+// nomes, que no Maildir é a ordem de entrega. Se a caixa não era
+// conhecida ('known' falso, sem índice nem memória compartilhada), as
+// mensagens que já estão na lista de UIDs mantêm o seu. As demais
+// recebem UIDs novos, gravados na lista antes de serem usados, e as
+// que acabaram de chegar de 'new/' são recentes
+void mbox_assign(mailbox_t *mbox, bool known) {
+    char file[PATH_MAX], line[NAME_MAX+32];
+    char const **moved = NULL, *name;
+    buf_t add = {NULL, 0, 0};
+    mailbox_t list;
+    names_t names;
+    int *fresh, nfresh = 0, nmoved = 0, i, j, n, fd;
+    size_t used = 0;
+    off_t size = 0;
+    msg_t *msg;
+
+    snprintf(file, sizeof(file), "%s/" MBOXUIDLIST, mbox->maildir);
+    fd = uidlist_open(mbox, file, &size);
+
+    fresh = (int*)malloc(mbox->exists*sizeof(int));
+    for(i = 0; i < mbox->exists; i++)
+        if(mbox->msgs[i].id == 0) fresh[nfresh++] = i;
+    qsort_r(fresh, nfresh, sizeof(int), fresh_cmp, mbox);
+
+    if(!known && fd != -1) {
+        memset(&list, 0, sizeof(list));
+        uidlist_load(&list, fd);
+        names_init(&names, &list);
+        for(j = 0; j < nfresh; j++) {
+            msg = &mbox->msgs[fresh[j]];
+            if((i = names_find(&names, &list, mbox_get(mbox, msg->name))) >= 0)
+                msg->id = list.msgs[i].id;
+        }
+        free(names.slot);
+        mbox_free(&list);
+    }
+
+    for(name = mbox->moved.data; name < mbox->moved.data + mbox->moved.len; name += strlen(name)+1) {
+        moved = (char const**)realloc(moved, (nmoved+1)*sizeof(char*));
+        moved[nmoved++] = name;
+    }
+    qsort(moved, nmoved, sizeof(char*), name_cmp);
+
+    for(j = 0; j < nfresh; j++) {
+        msg = &mbox->msgs[fresh[j]];
+        if(msg->id != 0) continue;
+
+        name = mbox_get(mbox, msg->name);
+        msg->id = mbox->uidnext++;
+        msg->recent = (bsearch(&name, moved, nmoved, sizeof(char*), name_cmp) != NULL);
+        n = snprintf(line, sizeof(line), "%d %.*s\n", msg->id, (int)strcspn(name, ":"), name);
+        buf_append(&add, line, n);
+    }
+
+    if(fd == -1 || (add.len > 0 && (write(fd, add.data, add.len) != (ssize_t)add.len || fdatasync(fd) == -1)))
+        perror(file);
+
+    // Reescreve a lista se ela tiver muito mais mensagens removidas do
+    // que existentes
+    for(i = 0; i < mbox->exists; i++)
+        used += strcspn(mbox_get(mbox, mbox->msgs[i].name), ":") + 12;
+    if(fd != -1 && size + add.len > 2*used + 65536)
+        uidlist_write(mbox, file);
+
+    if(fd != -1) close(fd);
+    buf_free(&add);
+    free(moved);
+    free(fresh);
+}
+
+// Abre a lista de UIDs 'file', criando-a se não existir ou se o
+// cabeçalho estiver inválido, e atualiza 'uidvalidity' e 'uidnext' da
+// caixa com o que está nela. O próximo UID é o do cabeçalho ou o
+// seguinte ao da última linha, que é o maior. Retorna o descritor,
+// aberto para acréscimos, e o tamanho da lista em 'size', ou -1
+int uidlist_open(mailbox_t *mbox, char const *file, off_t *size) {
+    char buf[4096+1], *p, *q;
+    unsigned validity, next;
+    struct stat st;
+    uint32_t uid;
+    ssize_t n;
+    off_t off;
+    int fd, tries;
+
+    if(mbox->uidvalidity == 0) mbox->uidvalidity = time(NULL);
+    if(mbox->uidnext == 0) mbox->uidnext = 1;
+
+    for(tries = 0; ; tries++) {
+        if((fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0600)) == -1)
+            return -1;
+
+        n = (fstat(fd, &st) == 0) ? pread(fd, buf, 64, 0) : -1;
+        buf[n > 0 ? n : 0] = 0;
+        if(strchr(buf, '\n') != NULL && sscanf(buf, "1 V%u N%u", &validity, &next) == 2)
+            break;
+
+        // Lista nova ou perdida: recomeça com o que a caixa sabe
+        close(fd);
+        if(tries > 0) return -1;
+        uidlist_write(mbox, file);
+    }
+
+    mbox->uidvalidity = validity;
+    if(next > mbox->uidnext) mbox->uidnext = next;
+
+    // Última linha, descartando o que vier depois dela
+    off = (st.st_size > 4096) ? st.st_size - 4096 : 0;
+    if((n = pread(fd, buf, st.st_size - off, off)) > 0) {
+        buf[n] = 0;
+        if((p = memrchr(buf, '\n', n)) != NULL && p != buf + n - 1) {
+            if(ftruncate(fd, off + (p - buf) + 1) == 0)
+                st.st_size = off + (p - buf) + 1;
+        }
+        if(p != NULL) {
+            *p = 0;
+            q = memrchr(buf, '\n', p - buf);
+            if(q != NULL && sscanf(q+1, "%u ", &uid) == 1 && uid >= mbox->uidnext)
+                mbox->uidnext = uid + 1;
+        }
+    }
+
+    *size = st.st_size;
+    return fd;
+}
+
+// Lê todas as linhas da lista de UIDs aberta em 'fd' para 'list' (o
+// UID e o nome de cada mensagem)
+void uidlist_load(mailbox_t *list, int fd) {
+    struct stat st;
+    char *data, *p, *end, *nl, *sp;
+    msg_t *msg;
+
+    if(fstat(fd, &st) == -1 || (data = (char*)malloc(st.st_size + 1)) == NULL)
+        return;
+    if(pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        return;
+    }
+
+    // A primeira linha é o cabeçalho
+    end = data + st.st_size;
+    p = memchr(data, '\n', st.st_size);
+    for(p = p ? p+1 : end; p < end && (nl = memchr(p, '\n', end - p)) != NULL; p = nl+1) {
+        *nl = 0;
+        if((sp = strchr(p, ' ')) == NULL) continue;
+        msg = mbox_add(list);
+        msg->id = atoi(p);
+        msg->name = mbox_str(list, sp+1);
+    }
+    free(data);
+}
+
+// Reescreve a lista de UIDs só com as mensagens existentes, primeiro
+// em um arquivo temporário que depois substitui o anterior, como o
+// índice, mas esperando tudo chegar ao disco
+void uidlist_write(mailbox_t *mbox, char const *file) {
+    char tmp[PATH_MAX+16], line[NAME_MAX+32];
+    buf_t out = {NULL, 0, 0};
+    char const *name;
+    int fd, i, n;
+
+    n = snprintf(line, sizeof(line), "1 V%u N%u\n", mbox->uidvalidity, mbox->uidnext);
+    buf_append(&out, line, n);
+    for(i = 0; i < mbox->exists; i++) {
+        if(mbox->msgs[i].id == 0) continue;
+        name = mbox_get(mbox, mbox->msgs[i].name);
+        n = snprintf(line, sizeof(line), "%d %.*s\n", mbox->msgs[i].id, (int)strcspn(name, ":"), name);
+        buf_append(&out, line, n);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror(tmp);
+        buf_free(&out);
+        return;
+    }
+
+    if(write(fd, out.data, out.len) != (ssize_t)out.len || fsync(fd) == -1 || close(fd) == -1 || rename(tmp, file) == -1) {
+        perror(tmp);
+        unlink(tmp);
+    } else if((fd = open(mbox->maildir, O_RDONLY | O_DIRECTORY)) != -1) {
+        // A troca de nome também precisa chegar ao disco
+        fsync(fd);
+        close(fd);
+    }
+    buf_free(&out);
+}
+
+// Move as mensagens entregues em 'new/' para 'cur/', sem flags, e
+// guarda os nomes novos em 'mbox->moved'. Retorna quantas foram movidas
+int mbox_deliver(mailbox_t *mbox, char const *maildir) {
+    char path[PATH_MAX], name[NAME_MAX+4];
+    struct dirent *ent;
+    int curfd, n = 0;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/new", maildir);
+    if((dir = opendir(path)) == NULL)
+        return 0;
+
+    snprintf(path, sizeof(path), "%s/cur", maildir);
+    if((curfd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+        closedir(dir);
+        return 0;
+    }
+
+    while((ent = readdir(dir)) != NULL) {
+        if(ent->d_name[0] == '.') continue;
+        if(ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN) continue;
+
+        snprintf(name, sizeof(name), "%s%s", ent->d_name, strchr(ent->d_name, ':') ? "" : ":2,");
+        if(renameat(dirfd(dir), ent->d_name, curfd, name) == -1) {
+            if(errno != ENOENT) perror(name);
+            continue;
+        }
+        buf_append(&mbox->moved, name, strlen(name)+1);
+        n++;
+    }
+    closedir(dir);
+    close(curfd);
+
+    return n;
+}
+
+// Verifica se dois nomes são do mesmo arquivo do Maildir, ou seja, se
+// são iguais até as flags (a partir do ':')
+bool same_file(char const *a, char const *b) {
+    size_t n = strcspn(a, ":");
+
+    return n == strcspn(b, ":") && strncmp(a, b, n) == 0;
+}
+
+// Espalhamento do nome de uma mensagem até as flags (FNV-1a)
+unsigned name_hash(char const *name) {
+    uint32_t h = 2166136261u;
+
+    for(; *name && *name != ':'; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+
+    return h;
+}
+
+// Monta a tabela dos nomes das mensagens de 'mbox'
+void names_init(names_t *names, mailbox_t const *mbox) {
+    unsigned size = 64, h;
+    int i;
+
+    while(size < 2u*mbox->exists) size *= 2;
+    names->slot = (int*)calloc(size, sizeof(int));
+    names->mask = size - 1;
+
+    for(i = 0; i < mbox->exists; i++) {
+        for(h = name_hash(mbox_get(mbox, mbox->msgs[i].name)) & names->mask; names->slot[h]; h = (h+1) & names->mask);
+        names->slot[h] = i+1;
+    }
+}
+
+// Posição em 'mbox' da mensagem do mesmo arquivo que 'name', ou -1
+int names_find(names_t const *names, mailbox_t const *mbox, char const *name) {
+    unsigned h;
+
+    for(h = name_hash(name) & names->mask; names->slot[h]; h = (h+1) & names->mask) {
+        if(same_file(mbox_get(mbox, mbox->msgs[names->slot[h]-1].name), name))
+            return names->slot[h]-1;
+    }
+
+    return -1;
+}
+
+// Compara dois nomes, para o qsort e o bsearch
+int name_cmp(void const *a, void const *b) {
+    return strcmp(*(char const**)a, *(char const**)b);
+}
+
+// Compara as posições de duas mensagens de 'mbox' pelo nome, com os
+// números em ordem numérica
+int fresh_cmp(void const *a, void const *b, void *mbox) {
+    return strverscmp(mbox_get((mailbox_t*)mbox, ((mailbox_t*)mbox)->msgs[*(int const*)a].name),
+                      mbox_get((mailbox_t*)mbox, ((mailbox_t*)mbox)->msgs[*(int const*)b].name));
+}
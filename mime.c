@@ -0,0 +1,803 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+// Estrutura MIME das mensagens (RFC 2045 e 2046)
+
+// Trecho do texto de uma mensagem. 'quoted' indica que ele veio de uma
+// string entre aspas, com as barras invertidas ainda no texto
+typedef struct {char const *s; size_t len; bool quoted;} span_t;
+
+// Parte de uma mensagem. A parte 0 é a mensagem inteira e as demais
+// aparecem na ordem do texto, cada uma depois da que a contém
+// ('parent'). Os filhos de uma parte formam uma lista ('child' é o
+// primeiro, 'next' o irmão seguinte e 'last' o último). Os deslocamentos
+// são em bytes desde o começo da mensagem: o cabeçalho vai de 'hoff' até
+// a linha em branco (inclusive) e o corpo começa em 'boff', na linha
+// 'bline', e tem 'lines' linhas. Uma parte multipart guarda a sua
+// 'boundary', e uma message/rfc822 tem como único filho a mensagem que
+// ela contém
+typedef struct {size_t hoff, hlen, boff, blen; int bline, lines, parent, child, next, last;
+                span_t boundary; bool body, multipart, message, digest;} part_t;
+
+// Partes de uma mensagem e a quantidade de linhas do texto
+typedef struct {part_t *parts; int n, cap, lines;} mime_t;
+
+// Profundidade máxima de partes multipart umas dentro das outras. As
+// mais internas são tratadas como partes simples
+#define MIMEDEPTH 64
+
+// Campos do ENVELOPE, na ordem em que são escritos
+enum {E_DATE, E_SUBJECT, E_FROM, E_SENDER, E_REPLYTO, E_TO, E_CC, E_BCC, E_INREPLYTO, E_MESSAGEID, E_N};
+char const *const envelope_names[E_N] = {"Date", "Subject", "From", "Sender", "Reply-To", "To", "Cc", "Bcc",
+                                         "In-Reply-To", "Message-ID"};
+
+//========================================= FUNÇÕES =========================================
+void mime_parse(mime_t *mime, char const *text, size_t len);
+void mime_free(mime_t *mime);
+int mime_new(mime_t *mime, int parent, size_t off);
+void mime_header(mime_t *mime, int p, char const *text, size_t off, int line);
+void mime_end(mime_t *mime, int p, size_t end, int line);
+bool mime_delim(char const *s, size_t len, span_t const *boundary, bool *close);
+bool mime_field(mime_t const *mime, int p, char const *text, char const *name, span_t *v);
+void mime_lookup(mime_t const *mime, int p, char const *text, simdnames_t const *names, span_t *v);
+size_t mime_unfold(char const *h, size_t hlen, size_t pos, size_t next, span_t *v);
+char const *mime_skip(char const *p, char const *end);
+char const *mime_token(char const *p, char const *end, span_t *t);
+char const *mime_value(char const *p, char const *end, span_t *t);
+bool mime_ctype(mime_t const *mime, int p, char const *text, span_t *type, span_t *subtype, span_t *params);
+bool mime_param(span_t const *params, char const *name, span_t *v);
+bool mime_is(span_t const *t, char const *s);
+void mime_puts(buf_t *out, char const *s);
+void mime_string(buf_t *out, span_t const *t);
+void mime_nstring(buf_t *out, mime_t const *mime, int p, char const *text, char const *name);
+void mime_params(buf_t *out, span_t const *params);
+void mime_disposition(buf_t *out, mime_t const *mime, int p, char const *text);
+void mime_language(buf_t *out, mime_t const *mime, int p, char const *text);
+char const *mime_address(char const *s, char const *end, span_t *dname, span_t *box, span_t *host);
+void mime_addresses(buf_t *out, span_t const *v);
+void mime_envelope(buf_t *out, mime_t const *mime, int p, char const *text);
+void mime_body(buf_t *out, mime_t const *mime, int p, char const *text, bool ext);
+bool mime_structure(mime_t const *mime, char const *text, char *s, size_t size);
+int mime_part(mime_t const *mime, int const *path, int n);
+bool mime_listed(char const *list, char const *name, size_t len);
+void mime_fields(buf_t *out, char const *h, size_t len, char const *list, bool not);
+
+
+// Percorre uma única vez os 'len' bytes de 'text', linha por linha,
+// montando a árvore de partes em 'mime'. No cabeçalho de uma parte só é
+// procurada a linha em branco, e no corpo só as linhas que começam com
+// "--" são comparadas com as boundaries das partes multipart abertas.
+// As demais são puladas de uma vez pelos kernels de simd.c
+void mime_parse(mime_t *mime, char const *text, size_t len) {
+    int open[MIMEDEPTH];
+    int depth, cur, line, last, d, p;
+    size_t pos, next, end;
+    char const *nl;
+    char a, b;
+    bool close;
+
+    mime->n = 0;
+    depth = 0;
+    cur = mime_new(mime, -1, 0);
+    for(pos = 0, line = 0; pos < len; pos = next, line++) {
+        // As linhas que não mudam o estado são só contadas: no cabeçalho
+        // interessa a linha em branco e no corpo de uma multipart as que
+        // começam com '-'. Fora delas o corpo vai até o fim do texto
+        if(mime->parts[cur].body) a = b = (depth > 0) ? '-' : 0;
+        else a = '\n', b = '\r';
+        if(text[pos] != a && text[pos] != b) {
+            nl = (a != 0) ? simd.line(text + pos, len - pos, a, b) : NULL;
+            if(nl == NULL) {
+                line += simd.count(text + pos, len - pos, '\n') + (text[len-1] != '\n');
+                break;
+            }
+            line += simd.count(text + pos, nl + 1 - (text + pos), '\n');
+            pos = nl + 1 - text;
+        }
+
+        next = ((nl = memchr(text + pos, '\n', len - pos)) != NULL) ? (size_t)(nl - text) + 1 : len;
+
+        // A linha em branco termina o cabeçalho. Uma parte multipart
+        // passa a ter as suas boundaries procuradas, e uma message/rfc822
+        // começa o cabeçalho da mensagem que contém
+        if(!mime->parts[cur].body && (text[pos] == '\n' || (text[pos] == '\r' && next - pos == 2 && text[pos+1] == '\n'))) {
+            mime_header(mime, cur, text, next, line + 1);
+            if(mime->parts[cur].multipart) {
+                if(depth < MIMEDEPTH) open[depth++] = cur;
+                else mime->parts[cur].multipart = false;
+            } else if(mime->parts[cur].message) {
+                cur = mime_new(mime, cur, next);
+            }
+            continue;
+        }
+
+        if(depth == 0 || next - pos < 3 || text[pos] != '-' || text[pos+1] != '-') continue;
+
+        // Procura a boundary da parte aberta mais interna primeiro; a de
+        // uma externa também fecha as internas
+        for(d = depth-1; d >= 0; d--)
+            if(mime_delim(text + pos + 2, next - pos - 2, &mime->parts[open[d]].boundary, &close)) break;
+        if(d < 0) continue;
+
+        // O fim de linha antes da boundary faz parte dela, e se ele vem
+        // logo depois de outro a última linha do corpo estava vazia
+        end = pos;
+        if(end > 0 && text[end-1] == '\n') end--;
+        if(end > 0 && text[end-1] == '\r') end--;
+        last = (end > 0 && text[end-1] == '\n') ? line - 1 : line;
+        for(p = cur; p != open[d]; p = mime->parts[p].parent)
+            mime_end(mime, p, end, last);
+
+        // Depois da boundary final vem o epílogo, que não é de nenhuma parte
+        if(close) {
+            depth = d;
+            cur = open[d];
+        } else {
+            depth = d + 1;
+            cur = mime_new(mime, open[d], next);
+        }
+    }
+
+    mime->lines = line;
+    for(p = cur; p != -1; p = mime->parts[p].parent)
+        mime_end(mime, p, len, line);
+}
+
+// Libera a memória das partes
+void mime_free(mime_t *mime) {
+    free(mime->parts);
+    mime->parts = NULL;
+    mime->n = mime->cap = 0;
+}
+
+// Começa uma parte filha de 'parent' com o cabeçalho em 'off'.
+// Retorna a sua posição
+int mime_new(mime_t *mime, int parent, size_t off) {
+    part_t *part;
+    int p;
+
+    if(mime->n == mime->cap) {
+        mime->cap = mime->cap ? 2*mime->cap : 16;
+        mime->parts = (part_t*)realloc(mime->parts, mime->cap*sizeof(part_t));
+    }
+    p = mime->n++;
+    part = &mime->parts[p];
+    memset(part, 0, sizeof(part_t));
+    part->hoff = off;
+    part->parent = parent;
+    part->child = part->next = part->last = -1;
+
+    if(parent != -1) {
+        if(mime->parts[parent].child == -1) mime->parts[parent].child = p;
+        else mime->parts[mime->parts[parent].last].next = p;
+        mime->parts[parent].last = p;
+    }
+
+    return p;
+}
+
+// Termina o cabeçalho da parte 'p', cujo corpo começa em 'off', na
+// linha 'line', e classifica a parte pelo seu Content-Type. Sem ele, as
+// partes de uma multipart/digest são mensagens e as demais são texto
+void mime_header(mime_t *mime, int p, char const *text, size_t off, int line) {
+    part_t *part = &mime->parts[p];
+    span_t type, subtype, params;
+
+    part->hlen = off - part->hoff;
+    part->boff = off;
+    part->bline = line;
+    part->body = true;
+
+    if(!mime_ctype(mime, p, text, &type, &subtype, &params)) {
+        part->message = (part->parent != -1 && mime->parts[part->parent].digest);
+        return;
+    }
+
+    if(mime_is(&type, "multipart")) {
+        part->multipart = mime_param(&params, "boundary", &part->boundary) && part->boundary.len > 0;
+        part->digest = mime_is(&subtype, "digest");
+    } else if(mime_is(&type, "message")) {
+        part->message = mime_is(&subtype, "rfc822") || mime_is(&subtype, "global");
+    }
+}
+
+// Termina a parte 'p' em 'end', com a última linha do corpo antes da
+// linha 'line'
+void mime_end(mime_t *mime, int p, size_t end, int line) {
+    part_t *part = &mime->parts[p];
+
+    if(!part->body) {
+        part->hlen = end - part->hoff;
+        part->boff = end;
+        part->bline = line;
+        part->body = true;
+    }
+    part->blen = (end > part->boff) ? end - part->boff : 0;
+    part->lines = (line > part->bline) ? line - part->bline : 0;
+}
+
+// Verifica se a linha 's' (sem o "--" inicial) é a 'boundary', seguida
+// ou não de "--" ('close') e de espaços
+bool mime_delim(char const *s, size_t len, span_t const *boundary, bool *close) {
+    size_t i;
+
+    if(len < boundary->len || memcmp(s, boundary->s, boundary->len)) return false;
+
+    i = boundary->len;
+    *close = (i + 2 <= len && s[i] == '-' && s[i+1] == '-');
+    if(*close) i += 2;
+    while(i < len && isspace((unsigned char)s[i])) i++;
+
+    return i == len;
+}
+
+// Encontra o campo 'name' do cabeçalho da parte 'p' e devolve em 'v' o
+// seu valor, com as linhas de continuação e sem os espaços das pontas
+bool mime_field(mime_t const *mime, int p, char const *text, char const *name, span_t *v) {
+    char const *h = text + mime->parts[p].hoff, *nl;
+    size_t hlen = mime->parts[p].hlen, n = strlen(name), pos, next;
+
+    for(pos = 0; pos < hlen; pos = next) {
+        next = ((nl = memchr(h + pos, '\n', hlen - pos)) != NULL) ? (size_t)(nl - h) + 1 : hlen;
+        if(next - pos <= n || h[pos+n] != ':' || strncasecmp(h + pos, name, n)) continue;
+
+        mime_unfold(h, hlen, pos + n + 1, next, v);
+        return true;
+    }
+
+    return false;
+}
+
+// Procura de uma vez, no cabeçalho da parte 'p', todos os campos do
+// conjunto 'names', escrevendo o valor do i-ésimo em v[i] (com v[i].s
+// NULL se ele não existir)
+void mime_lookup(mime_t const *mime, int p, char const *text, simdnames_t const *names, span_t *v) {
+    char const *h = text + mime->parts[p].hoff, *nl;
+    size_t hlen = mime->parts[p].hlen, pos, next;
+    int i;
+
+    for(i = 0; i < names->n; i++) v[i].s = NULL;
+    for(pos = 0; pos < hlen; pos = next) {
+        next = ((nl = memchr(h + pos, '\n', hlen - pos)) != NULL) ? (size_t)(nl - h) + 1 : hlen;
+        if((i = simd.field(names, h + pos, hlen - pos)) < 0 || v[i].s != NULL) continue;
+
+        next = mime_unfold(h, hlen, pos + names->len[i] + 1, next, &v[i]);
+    }
+}
+
+// Escreve em 'v' o valor de campo que começa em 'pos' no cabeçalho 'h',
+// cuja primeira linha termina em 'next', juntando as linhas de
+// continuação. Retorna o começo do campo seguinte
+size_t mime_unfold(char const *h, size_t hlen, size_t pos, size_t next, span_t *v) {
+    char const *nl, *end;
+
+    // O valor continua nas linhas que começam com espaço
+    while(next < hlen && (h[next] == ' ' || h[next] == '\t'))
+        next = ((nl = memchr(h + next, '\n', hlen - next)) != NULL) ? (size_t)(nl - h) + 1 : hlen;
+
+    v->s = h + pos;
+    end = h + next;
+    while(v->s < end && isspace((unsigned char)*v->s)) v->s++;
+    while(end > v->s && isspace((unsigned char)end[-1])) end--;
+    v->len = end - v->s;
+    v->quoted = false;
+    return next;
+}
+
+// Pula espaços, quebras de linha e comentários entre parênteses
+char const *mime_skip(char const *p, char const *end) {
+    int depth;
+
+    for(;;) {
+        while(p < end && isspace((unsigned char)*p)) p++;
+        if(p == end || *p != '(') return p;
+
+        for(depth = 0; p < end; p++) {
+            if(*p == '\\' && p+1 < end) p++;
+            else if(*p == '(') depth++;
+            else if(*p == ')' && --depth == 0) break;
+        }
+        if(p < end) p++;
+    }
+}
+
+// Lê em 't' um token, que termina em um espaço ou em um dos
+// separadores do RFC 2045 (tspecials). Retorna o que vem depois dele
+char const *mime_token(char const *p, char const *end, span_t *t) {
+    p = mime_skip(p, end);
+    t->s = p;
+    t->quoted = false;
+    while(p < end && !isspace((unsigned char)*p) && *p > ' ' && strchr("()<>@,;:\\\"/[]?=", *p) == NULL) p++;
+    t->len = p - t->s;
+
+    return p;
+}
+
+// Lê em 't' um valor, que é um token ou uma string entre aspas
+char const *mime_value(char const *p, char const *end, span_t *t) {
+    p = mime_skip(p, end);
+    if(p == end || *p != '"') return mime_token(p, end, t);
+
+    t->s = ++p;
+    t->quoted = true;
+    while(p < end && *p != '"') {
+        if(*p == '\\' && p+1 < end) p++;
+        p++;
+    }
+    t->len = p - t->s;
+
+    return (p < end) ? p+1 : p;
+}
+
+// Lê o Content-Type da parte 'p': o tipo, o subtipo e o trecho com os
+// parâmetros. Retorna false se a parte não tiver um Content-Type válido
+bool mime_ctype(mime_t const *mime, int p, char const *text, span_t *type, span_t *subtype, span_t *params) {
+    char const *s, *end;
+    span_t v;
+
+    if(!mime_field(mime, p, text, "Content-Type", &v)) return false;
+
+    end = v.s + v.len;
+    s = mime_token(v.s, end, type);
+    s = mime_skip(s, end);
+    if(type->len == 0 || s == end || *s != '/') return false;
+    s = mime_token(s+1, end, subtype);
+    if(subtype->len == 0) return false;
+
+    params->s = s;
+    params->len = end - s;
+    params->quoted = false;
+    return true;
+}
+
+// Procura o parâmetro 'name' na lista 'params' ("; a=b; c="d"")
+bool mime_param(span_t const *params, char const *name, span_t *v) {
+    char const *p = params->s, *end = params->s + params->len;
+    span_t attr;
+
+    for(;;) {
+        // O que não for um parâmetro é ignorado até o próximo ';'
+        p = mime_skip(p, end);
+        if(p == end) return false;
+        if(*p++ != ';') continue;
+
+        p = mime_token(p, end, &attr);
+        p = mime_skip(p, end);
+        if(p == end || *p != '=') continue;
+
+        p = mime_value(p+1, end, v);
+        if(attr.len == strlen(name) && !strncasecmp(attr.s, name, attr.len)) return true;
+    }
+}
+
+// Compara o trecho 't' com 's', sem diferenciar maiúsculas
+bool mime_is(span_t const *t, char const *s) {
+    return t->len == strlen(s) && !strncasecmp(t->s, s, t->len);
+}
+
+// Escreve a string 's' em 'out'
+void mime_puts(buf_t *out, char const *s) {
+    buf_append(out, s, strlen(s));
+}
+
+// Escreve o trecho 't' como uma string do IMAP: entre aspas, ou como um
+// literal se tiver caracteres de 8 bits. As quebras de linha são
+// removidas e, se ele veio de uma string entre aspas, as barras
+// invertidas também
+void mime_string(buf_t *out, span_t const *t) {
+    char num[32];
+    size_t i, n = 0;
+    bool literal = false;
+    char c;
+
+    if(t == NULL) {
+        mime_puts(out, "NIL");
+        return;
+    }
+
+    for(i = 0; i < t->len; i++) {
+        c = t->s[i];
+        if(t->quoted && c == '\\' && i+1 < t->len) c = t->s[++i];
+        else if(c == '\r' || c == '\n') continue;
+        if((unsigned char)c >= 0x80 || c == 0) literal = true;
+        n++;
+    }
+
+    if(literal) {
+        sprintf(num, "{%zu}\r\n", n);
+        mime_puts(out, num);
+    } else {
+        mime_puts(out, "\"");
+    }
+
+    for(i = 0; i < t->len; i++) {
+        c = t->s[i];
+        if(t->quoted && c == '\\' && i+1 < t->len) c = t->s[++i];
+        else if(c == '\r' || c == '\n') continue;
+        if(!literal && (c == '"' || c == '\\')) buf_append(out, "\\", 1);
+        buf_append(out, &c, 1);
+    }
+
+    if(!literal) mime_puts(out, "\"");
+}
+
+// Escreve o valor do campo 'name' da parte 'p', ou NIL se não houver
+void mime_nstring(buf_t *out, mime_t const *mime, int p, char const *text, char const *name) {
+    span_t v;
+
+    mime_string(out, mime_field(mime, p, text, name, &v) ? &v : NULL);
+}
+
+// Escreve a lista de parâmetros ("nome" "valor" ...), ou NIL se não houver
+void mime_params(buf_t *out, span_t const *params) {
+    char const *p = params->s, *end = params->s + params->len;
+    span_t attr, v;
+    bool first = true;
+
+    for(;;) {
+        p = mime_skip(p, end);
+        if(p == end) break;
+        if(*p++ != ';') continue;
+
+        p = mime_token(p, end, &attr);
+        p = mime_skip(p, end);
+        if(attr.len == 0 || p == end || *p != '=') continue;
+        p = mime_value(p+1, end, &v);
+
+        mime_puts(out, first ? "(" : " ");
+        mime_string(out, &attr);
+        mime_puts(out, " ");
+        mime_string(out, &v);
+        first = false;
+    }
+
+    mime_puts(out, first ? "NIL" : ")");
+}
+
+// Escreve o Content-Disposition da parte 'p' ("tipo" (parâmetros)), ou NIL
+void mime_disposition(buf_t *out, mime_t const *mime, int p, char const *text) {
+    span_t v, type, params;
+    char const *s;
+
+    if(!mime_field(mime, p, text, "Content-Disposition", &v)) {
+        mime_puts(out, "NIL");
+        return;
+    }
+
+    s = mime_token(v.s, v.s + v.len, &type);
+    if(type.len == 0) {
+        mime_puts(out, "NIL");
+        return;
+    }
+
+    params.s = s;
+    params.len = v.s + v.len - s;
+    params.quoted = false;
+
+    mime_puts(out, "(");
+    mime_string(out, &type);
+    mime_puts(out, " ");
+    mime_params(out, &params);
+    mime_puts(out, ")");
+}
+
+// Escreve a lista de idiomas do Content-Language da parte 'p', ou NIL
+void mime_language(buf_t *out, mime_t const *mime, int p, char const *text) {
+    char const *s, *end;
+    span_t v, lang;
+    bool first = true;
+
+    if(mime_field(mime, p, text, "Content-Language", &v)) {
+        end = v.s + v.len;
+        for(s = v.s; s < end; ) {
+            lang.s = s = mime_skip(s, end);
+            while(s < end && *s != ',' && !isspace((unsigned char)*s)) s++;
+            lang.len = s - lang.s;
+            lang.quoted = false;
+            while(s < end && (*s == ',' || isspace((unsigned char)*s))) s++;
+            if(lang.len == 0) continue;
+
+            mime_puts(out, first ? "(" : " ");
+            mime_string(out, &lang);
+            first = false;
+        }
+    }
+
+    mime_puts(out, first ? "NIL" : ")");
+}
+
+// Lê o endereço que começa em 's', até a próxima vírgula fora de aspas
+// e de <>, gravando o nome, a caixa e o domínio de "Nome" <caixa@domínio>
+// ou de caixa@domínio (com tamanho 0 os que faltarem). Retorna o fim do
+// endereço
+char const *mime_address(char const *s, char const *end, span_t *dname, span_t *box, span_t *host) {
+    char const *a = s, *lt = NULL, *gt = NULL, *at;
+    bool quote, angle;
+
+    for(quote = angle = false; s < end && (quote || angle || *s != ','); s++) {
+        if(*s == '\\' && s+1 < end) {
+            s++;
+        } else if(*s == '"') {
+            quote = !quote;
+        } else if(!quote && *s == '<') {
+            lt = s;
+            angle = true;
+        } else if(!quote && *s == '>' && angle) {
+            gt = s;
+            angle = false;
+        }
+    }
+
+    dname->len = 0;
+    if(gt != NULL) {
+        mime_value(a, lt, dname);
+        if(!dname->quoted) {
+            dname->s = mime_skip(a, lt);
+            dname->len = lt - dname->s;
+            while(dname->len > 0 && isspace((unsigned char)dname->s[dname->len-1])) dname->len--;
+        }
+        box->s = lt + 1;
+        box->len = gt - box->s;
+    } else {
+        box->s = a;
+        box->len = s - a;
+        while(box->len > 0 && isspace((unsigned char)box->s[box->len-1])) box->len--;
+    }
+    box->quoted = host->quoted = false;
+
+    host->len = 0;
+    if((at = memrchr(box->s, '@', box->len)) != NULL) {
+        host->s = at + 1;
+        host->len = box->s + box->len - host->s;
+        box->len = at - box->s;
+    }
+
+    return s;
+}
+
+// Escreve a lista de endereços do valor 'v' de um campo, cada um como
+// (nome NIL caixa domínio), ou NIL se 'v' for NULL
+void mime_addresses(buf_t *out, span_t const *v) {
+    char const *s, *end, *a;
+    span_t dname, box, host;
+    bool first = true;
+
+    if(v == NULL) {
+        mime_puts(out, "NIL");
+        return;
+    }
+
+    end = v->s + v->len;
+    for(s = v->s; s < end; s++) {
+        a = mime_skip(s, end);
+        if((s = mime_address(a, end, &dname, &box, &host)) == a) continue;
+
+        mime_puts(out, first ? "((" : " (");
+        mime_string(out, dname.len ? &dname : NULL);
+        mime_puts(out, " NIL ");
+        mime_string(out, &box);
+        mime_puts(out, " ");
+        mime_string(out, host.len ? &host : NULL);
+        mime_puts(out, ")");
+        first = false;
+
+        if(s == end) break;
+    }
+
+    mime_puts(out, first ? "NIL" : ")");
+}
+
+// Escreve o ENVELOPE do cabeçalho da parte 'p' (RFC 3501, 7.4.2). Os
+// campos são procurados todos numa passada pelo cabeçalho; o Sender e o
+// Reply-To valem o From se não existirem
+void mime_envelope(buf_t *out, mime_t const *mime, int p, char const *text) {
+    static simdnames_t names;
+    span_t v[E_N];
+
+    if(names.n == 0) simd_names(&names, envelope_names, E_N);
+    mime_lookup(mime, p, text, &names, v);
+
+    mime_puts(out, "(");
+    mime_string(out, v[E_DATE].s ? &v[E_DATE] : NULL);
+    mime_puts(out, " ");
+    mime_string(out, v[E_SUBJECT].s ? &v[E_SUBJECT] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_FROM].s ? &v[E_FROM] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_SENDER].s ? &v[E_SENDER] : v[E_FROM].s ? &v[E_FROM] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_REPLYTO].s ? &v[E_REPLYTO] : v[E_FROM].s ? &v[E_FROM] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_TO].s ? &v[E_TO] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_CC].s ? &v[E_CC] : NULL);
+    mime_puts(out, " ");
+    mime_addresses(out, v[E_BCC].s ? &v[E_BCC] : NULL);
+    mime_puts(out, " ");
+    mime_string(out, v[E_INREPLYTO].s ? &v[E_INREPLYTO] : NULL);
+    mime_puts(out, " ");
+    mime_string(out, v[E_MESSAGEID].s ? &v[E_MESSAGEID] : NULL);
+    mime_puts(out, ")");
+}
+
+// Escreve a BODYSTRUCTURE da parte 'p', com os dados de extensão se
+// 'ext' for true
+void mime_body(buf_t *out, mime_t const *mime, int p, char const *text, bool ext) {
+    part_t const *part = &mime->parts[p];
+    span_t type, subtype, params, enc;
+    char num[64];
+    bool message = false;
+    int c;
+
+    if(!mime_ctype(mime, p, text, &type, &subtype, &params)) {
+        message = part->message;
+        type.s = message ? "message" : "text";
+        subtype.s = message ? "rfc822" : "plain";
+        params.s = message ? "" : "; charset=us-ascii";
+        type.len = strlen(type.s);
+        subtype.len = strlen(subtype.s);
+        params.len = strlen(params.s);
+        type.quoted = subtype.quoted = params.quoted = false;
+    }
+
+    mime_puts(out, "(");
+
+    // Multipart: as partes, o subtipo e a extensão
+    if(part->multipart && part->child != -1) {
+        for(c = part->child; c != -1; c = mime->parts[c].next)
+            mime_body(out, mime, c, text, ext);
+        mime_puts(out, " ");
+        mime_string(out, &subtype);
+        if(ext) {
+            mime_puts(out, " ");
+            mime_params(out, &params);
+            mime_puts(out, " ");
+            mime_disposition(out, mime, p, text);
+            mime_puts(out, " ");
+            mime_language(out, mime, p, text);
+            mime_puts(out, " ");
+            mime_nstring(out, mime, p, text, "Content-Location");
+        }
+        mime_puts(out, ")");
+        return;
+    }
+
+    // Parte simples: tipo, subtipo, parâmetros, id, descrição, codificação
+    // e tamanho
+    mime_string(out, &type);
+    mime_puts(out, " ");
+    mime_string(out, &subtype);
+    mime_puts(out, " ");
+    mime_params(out, &params);
+    mime_puts(out, " ");
+    mime_nstring(out, mime, p, text, "Content-ID");
+    mime_puts(out, " ");
+    mime_nstring(out, mime, p, text, "Content-Description");
+    mime_puts(out, " ");
+    if(mime_field(mime, p, text, "Content-Transfer-Encoding", &enc)) {
+        mime_string(out, &enc);
+    } else {
+        mime_puts(out, "\"7BIT\"");
+    }
+    sprintf(num, " %zu", part->blen);
+    mime_puts(out, num);
+
+    // A mensagem contida tem o envelope e a estrutura dela, e as
+    // mensagens e os textos têm a quantidade de linhas
+    if(part->message && part->child != -1) {
+        mime_puts(out, " ");
+        mime_envelope(out, mime, part->child, text);
+        mime_puts(out, " ");
+        mime_body(out, mime, part->child, text, ext);
+    }
+    if((part->message && part->child != -1) || mime_is(&type, "text")) {
+        sprintf(num, " %d", part->lines);
+        mime_puts(out, num);
+    }
+
+    if(ext) {
+        mime_puts(out, " ");
+        mime_nstring(out, mime, p, text, "Content-MD5");
+        mime_puts(out, " ");
+        mime_disposition(out, mime, p, text);
+        mime_puts(out, " ");
+        mime_language(out, mime, p, text);
+        mime_puts(out, " ");
+        mime_nstring(out, mime, p, text, "Content-Location");
+    }
+    mime_puts(out, ")");
+}
+
+// Escreve em 's' ('size' bytes) a BODYSTRUCTURE da mensagem. Se ela não
+// couber, tenta sem os dados de extensão e, por último, descreve a
+// mensagem como uma parte só. Retorna false nesse último caso
+bool mime_structure(mime_t const *mime, char const *text, char *s, size_t size) {
+    buf_t out = {NULL, 0, 0};
+    bool ok = true;
+
+    mime_body(&out, mime, 0, text, true);
+    if(out.len >= size) {
+        out.len = 0;
+        mime_body(&out, mime, 0, text, false);
+    }
+
+    if(out.len < size) {
+        memcpy(s, out.data, out.len);
+        s[out.len] = 0;
+    } else {
+        snprintf(s, size, "(\"application\" \"octet-stream\" NIL NIL NIL \"7BIT\" %zu)", mime->parts[0].blen);
+        ok = false;
+    }
+
+    buf_free(&out);
+    return ok;
+}
+
+// Encontra a parte de número 'path' ('n' números, como o 2.1 de
+// BODY[2.1]): cada número escolhe uma das partes de uma multipart, e
+// depois de uma message/rfc822 os números seguintes são da mensagem
+// contida. Uma mensagem que não é multipart só tem a parte 1, que é o
+// seu corpo. Retorna a posição da parte, ou -1 se ela não existir
+int mime_part(mime_t const *mime, int const *path, int n) {
+    int m = 0, p = 0, i, c, k;
+
+    for(i = 0; i < n; i++) {
+        if(i > 0) {
+            if(mime->parts[p].message && mime->parts[p].child != -1) m = mime->parts[p].child;
+            else if(mime->parts[p].multipart) m = p;
+            else return -1;
+        }
+
+        if(mime->parts[m].multipart && mime->parts[m].child != -1) {
+            for(c = mime->parts[m].child, k = 1; c != -1 && k < path[i]; c = mime->parts[c].next) k++;
+            if(c == -1) return -1;
+            p = c;
+        } else {
+            if(path[i] != 1) return -1;
+            p = m;
+        }
+    }
+
+    return p;
+}
+
+// Verifica se o nome 'name' ('len' bytes) está na lista 'list' de
+// nomes separados por espaços (com ou sem aspas), que termina em ')' ou
+// no fim da string
+bool mime_listed(char const *list, char const *name, size_t len) {
+    char const *s = list, *t;
+
+    for(;;) {
+        while(*s == ' ' || *s == '"') s++;
+        if(*s == 0 || *s == ')') return false;
+
+        for(t = s; *t != 0 && *t != ' ' && *t != '"' && *t != ')'; t++);
+        if((size_t)(t - s) == len && !strncasecmp(s, name, len)) return true;
+        s = t;
+    }
+}
+
+// Escreve em 'out' os campos do cabeçalho [h, h+len), com as linhas de
+// continuação, cujos nomes estão na lista 'list' (ou, com 'not', não
+// estão), seguidos da linha em branco, como no BODY[HEADER.FIELDS]
+void mime_fields(buf_t *out, char const *h, size_t len, char const *list, bool not) {
+    char const *nl, *colon;
+    size_t pos, next;
+
+    for(pos = 0; pos < len; pos = next) {
+        next = ((nl = memchr(h + pos, '\n', len - pos)) != NULL) ? (size_t)(nl - h) + 1 : len;
+        while(next < len && (h[next] == ' ' || h[next] == '\t'))
+            next = ((nl = memchr(h + next, '\n', len - next)) != NULL) ? (size_t)(nl - h) + 1 : len;
+
+        if((colon = memchr(h + pos, ':', next - pos)) == NULL) continue;
+        if(mime_listed(list, h + pos, colon - (h + pos)) != not)
+            buf_append(out, h + pos, next - pos);
+    }
+
+    mime_puts(out, "\r\n");
+}
@@ -0,0 +1,741 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+// Caixa compartilhada entre as sessões de um mesmo usuário, em todos os
+// processos trabalhadores. O índice da caixa (as mensagens e a área de
+// strings) fica em um segmento de memória compartilhada, '/ep1.<usuário>',
+// de forma que as sessões não guardam cópias próprias e vêem na hora
+// as flags alteradas pelas outras. O texto das mensagens continua sendo
+// mapeado por cada sessão, mas as páginas são as mesmas do cache do
+// kernel
+//
+// Quem altera o segmento segura uma trava exclusiva (flock) no arquivo
+// e incrementa 'seq' antes e depois da alteração. Quem só lê não trava:
+// copia o que precisa e confere que 'seq' era par e não mudou no meio
+// (seqlock), repetindo a leitura se mudou
+
+// O segmento tem tamanho fixo e é esparso: depois do cabeçalho vêm o
+// registro das mensagens removidas, as mensagens e por último a área de
+// strings, cada um com espaço para o seu máximo. Só as páginas usadas
+// ocupam memória
+#define SHAREMAGIC 0x65726873u
+#define SHAREVERSION 8
+#define SHAREEXP (1 << 16)
+#define SHAREMSGS (1 << 20)
+#define SHARESTRINGS (256 << 20)
+#define SHAREEXPOFF 4096
+#define SHAREMSGOFF (SHAREEXPOFF + SHAREEXP*sizeof(expunge_t))
+#define SHARESTROFF (SHAREMSGOFF + SHAREMSGS*sizeof(msg_t))
+#define SHARESIZE (SHARESTROFF + SHARESTRINGS)
+
+// Tamanho máximo da BODYSTRUCTURE e das chaves de ordenação de uma
+// mensagem
+#define SHAREBS 16384
+#define SHAREKEYS 2048
+
+// Diário das flags de cada caixa, em 'Maildir/ep1.journal'. Uma flag
+// alterada vale na hora no segmento, mas o arquivo da mensagem só é
+// renomeado depois, junto com os outros: cada alteração acrescenta ao
+// diário uma linha "<uid> <nome atual> <nome novo>", e share_flush
+// faz as renomeações (só a última de cada arquivo) e esvazia o diário.
+// Depois de JOURNALMAX alterações pendentes o diário é aplicado na hora
+#define SHAREJOURNAL "ep1.journal"
+#define JOURNALMAX 4096
+
+// Linha do diário lida por share_replay, com a sua posição
+typedef struct {char *old, *name; uint32_t uid; int pos;} journal_t;
+
+// Mensagem que deixou de existir, com o 'modseq' da remoção. O
+// registro é circular, com as SHAREEXP remoções mais recentes
+typedef struct {uint64_t modseq; uint32_t uid;} expunge_t;
+
+// Cabeçalho do segmento. 'dev' e 'ino' identificam o diretório 'cur/'
+// de onde a caixa foi lida, 'sec' e 'nsec' a sua data de modificação
+// (como no índice em disco), 'gen' muda a cada vez que a caixa é
+// relida, 'modseq' é o contador de alterações, 'nexp' quantas remoções
+// já foram registradas, 'expfrom' o 'modseq' a partir do qual o registro
+// tem todas elas, 'uidvalidity' e 'uidnext' vêm da lista de UIDs,
+// 'journal' é quantas linhas o diário tem e 'dirty' indica que o índice
+// em disco está desatualizado
+typedef struct {uint32_t magic, version, msgsize, seq, gen, strings; int32_t exists; bool dirty;
+                uint64_t dev, ino, modseq, nexp, expfrom; int64_t sec, nsec; uint32_t uidvalidity, uidnext, journal;} sharehdr_t;
+
+// Segmento mapeado neste processo, um por usuário, compartilhado pelas
+// sessões do processo ('refs'). 'wd' são os inotify de 'cur/' e 'new/'
+// (-1 se não houver), 'changed' marca que eles avisaram de mudanças,
+// 'jfd' é o diário aberto para acréscimos (-1 se não estiver),
+// 'pending' marca que este processo acrescentou linhas a ele e 'fti' é
+// o índice invertido da caixa para o SEARCH (NULL até a primeira busca)
+typedef struct share_s {char *user; int fd, refs, jfd; sharehdr_t *hdr; expunge_t *exps; msg_t *msgs; char *strings;
+                        int wd[2]; bool changed, pending; fti_t *fti; struct share_s *next;} share_t;
+
+share_t *shares = NULL;
+
+//========================================= FUNÇÕES =========================================
+share_t *share_get(char const *user);
+void share_put(share_t *share);
+void share_lock(share_t *share);
+void share_unlock(share_t *share);
+void share_repair(share_t const *share);
+uint32_t share_begin(share_t const *share);
+bool share_retry(share_t const *share, uint32_t seq);
+void share_write(share_t *share);
+int share_open(share_t *share, char const *maildir);
+void share_copy(share_t *share, mailbox_t *mbox);
+int share_publish(share_t *share, mailbox_t *mbox, bool same);
+void share_expunge(share_t *share, mailbox_t *mbox);
+void share_save(share_t *share, char const *maildir);
+int share_exists(share_t const *share);
+int share_uid(share_t const *share, uint32_t uid);
+bool share_msg(share_t const *share, int i, msg_t *msg, char *name, char *bs);
+void share_vanished(share_t *share, uint64_t modseq, uint64_t upto, set_t const *uids, set_t *out);
+bool share_keys(share_t const *share, int i, msg_t *msg, char *keys);
+int share_set(share_t *share, msg_t const *msg, char const *name, char const *bs, char const *keys);
+void share_room(share_t *share, size_t len);
+uint32_t share_str(share_t *share, char const *s);
+int share_recent(share_t *share, uint32_t uid, set_t *uids);
+bool share_journal(share_t *share, char const *maildir, uint32_t uid, char const *old, char const *name);
+void share_flush(share_t *share, char const *maildir);
+void share_replay(share_t *share, char const *maildir);
+int journal_cmp(void const *a, void const *b);
+
+
+// Segmento do usuário 'user', mapeado na primeira vez
+share_t *share_get(char const *user) {
+    char name[NAME_MAX+1];
+    share_t *share;
+    struct stat st;
+    void *p;
+    int fd;
+
+    for(share = shares; share != NULL; share = share->next) {
+        if(!strcmp(share->user, user)) {
+            share->refs++;
+            return share;
+        }
+    }
+
+    snprintf(name, sizeof(name), "/ep1.%s", user);
+    if((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) == -1) {
+        perror(name);
+        return NULL;
+    }
+
+    // O arquivo é esparso, então ocupar todo o tamanho não custa nada
+    if(fstat(fd, &st) == -1 || (st.st_size < (off_t)SHARESIZE && ftruncate(fd, SHARESIZE) == -1) ||
+       (p = mmap(NULL, SHARESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(name);
+        close(fd);
+        return NULL;
+    }
+
+    share = (share_t*)calloc(1, sizeof(share_t));
+    share->user = strdup(user);
+    share->fd = fd;
+    share->refs = 1;
+    share->hdr = (sharehdr_t*)p;
+    share->exps = (expunge_t*)((char*)p + SHAREEXPOFF);
+    share->wd[0] = share->wd[1] = -1;
+    share->jfd = -1;
+    share->msgs = (msg_t*)((char*)p + SHAREMSGOFF);
+    share->strings = (char*)p + SHARESTROFF;
+    share->next = shares;
+    shares = share;
+
+    // Um segmento novo, ou de outra versão do servidor, começa vazio
+    share_lock(share);
+    if(share->hdr->magic != SHAREMAGIC || share->hdr->version != SHAREVERSION || share->hdr->msgsize != sizeof(msg_t)) {
+        memset(share->hdr, 0, sizeof(sharehdr_t));
+        share->hdr->magic = SHAREMAGIC;
+        share->hdr->version = SHAREVERSION;
+        share->hdr->msgsize = sizeof(msg_t);
+    }
+    share_unlock(share);
+
+    return share;
+}
+
+// Libera uma referência ao segmento. A última desfaz o mapeamento neste
+// processo
+void share_put(share_t *share) {
+    share_t **p;
+
+    if(share == NULL || --share->refs > 0) return;
+
+    for(p = &shares; *p != share; p = &(*p)->next);
+    *p = share->next;
+
+    munmap(share->hdr, SHARESIZE);
+    if(share->jfd != -1) close(share->jfd);
+    fti_free(share->fti);
+    close(share->fd);
+    free(share->user);
+    free(share);
+}
+
+// Trava o segmento para alteração, esperando quem estiver alterando
+void share_lock(share_t *share) {
+    while(flock(share->fd, LOCK_EX) == -1 && errno == EINTR);
+    share_repair(share);
+}
+
+void share_unlock(share_t *share) {
+    flock(share->fd, LOCK_UN);
+}
+
+// Com a trava obtida, um 'seq' ímpar significa que um processo morreu
+// no meio de uma alteração (a trava é liberada pelo kernel). O conteúdo
+// pode estar pela metade, então é descartado e a caixa é relida do
+// índice em disco no próximo SELECT
+void share_repair(share_t const *share) {
+    sharehdr_t *hdr = share->hdr;
+
+    if((hdr->seq & 1) == 0) return;
+
+    hdr->exists = 0;
+    hdr->strings = 0;
+    hdr->nexp = 0;
+    hdr->dev = hdr->ino = 0;
+    hdr->sec = hdr->nsec = 0;
+    hdr->dirty = false;
+    hdr->gen++;
+    __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Início de uma leitura sem trava: espera a alteração em andamento
+// terminar e retorna o 'seq' a ser conferido por share_retry. Se a
+// trava estiver livre com uma alteração em andamento, quem alterava
+// morreu e o segmento é reparado
+uint32_t share_begin(share_t const *share) {
+    uint32_t seq;
+
+    while((seq = __atomic_load_n(&share->hdr->seq, __ATOMIC_ACQUIRE)) & 1) {
+        if(flock(share->fd, LOCK_EX | LOCK_NB) == 0) {
+            share_repair(share);
+            flock(share->fd, LOCK_UN);
+        } else {
+            sched_yield();
+        }
+    }
+
+    return seq;
+}
+
+// Verifica se o segmento foi alterado durante a leitura
+bool share_retry(share_t const *share, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&share->hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Marca o início e o fim de uma alteração, com a trava já obtida
+void share_write(share_t *share) {
+    __atomic_add_fetch(&share->hdr->seq, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Carrega a caixa do Maildir 'maildir' no segmento, depois de trazer
+// as mensagens entregues em 'new/'. Se ele já tem a caixa e 'cur/' não
+// mudou, não há nada a fazer; senão a caixa é relida aproveitando o
+// que o segmento (ou o índice em disco) já sabe. Retorna -1 se 'cur/'
+// não pôde ser lido e -2 se a caixa não cabe no segmento
+int share_open(share_t *share, char const *maildir) {
+    char cur[PATH_MAX];
+    sharehdr_t *hdr = share->hdr;
+    mailbox_t mbox;
+    struct stat st;
+    bool same;
+    int ret = 0;
+
+    snprintf(cur, sizeof(cur), "%s/cur", maildir);
+    memset(&mbox, 0, sizeof(mbox));
+
+    share_lock(share);
+
+    // Renomeia o que o diário tiver pendente, também de um processo que
+    // morreu antes (o segmento foi perdido ou reparado), para que os
+    // nomes em 'cur/' tenham as flags atuais
+    if(hdr->journal > 0 || hdr->dev == 0)
+        share_replay(share, maildir);
+
+    mbox_deliver(&mbox, maildir);
+    if(stat(cur, &st) == -1) {
+        ret = -1;
+    } else if(hdr->dev != st.st_dev || hdr->ino != st.st_ino || hdr->sec == 0 ||
+       hdr->sec != st.st_mtim.tv_sec || hdr->nsec != st.st_mtim.tv_nsec) {
+        same = (hdr->dev == st.st_dev && hdr->ino == st.st_ino);
+        if(same) share_copy(share, &mbox);
+
+        if(mbox_open(&mbox, maildir) == -1) ret = -1;
+        else if(share_publish(share, &mbox, same) == -1) ret = -2;
+        else {
+            hdr->dev = st.st_dev;
+            hdr->ino = st.st_ino;
+        }
+    }
+    mbox_free(&mbox);
+    share_unlock(share);
+
+    return ret;
+}
+
+// Copia o conteúdo do segmento para 'mbox', com a trava já obtida
+void share_copy(share_t *share, mailbox_t *mbox) {
+    sharehdr_t *hdr = share->hdr;
+
+    mbox_clear(mbox);
+    if(hdr->exists > mbox->cap) {
+        mbox->cap = hdr->exists;
+        mbox->msgs = (msg_t*)realloc(mbox->msgs, mbox->cap*sizeof(msg_t));
+    }
+    memcpy(mbox->msgs, share->msgs, hdr->exists*sizeof(msg_t));
+    mbox->exists = hdr->exists;
+    buf_append(&mbox->strings, share->strings, hdr->strings);
+    mbox->mtime.tv_sec = hdr->sec;
+    mbox->mtime.tv_nsec = hdr->nsec;
+    mbox->modseq = hdr->modseq;
+    mbox->uidvalidity = hdr->uidvalidity;
+    mbox->uidnext = hdr->uidnext;
+    mbox->dirty = hdr->dirty;
+}
+
+// Substitui o conteúdo do segmento por 'mbox', com a trava já obtida.
+// Se for a mesma caixa ('same'), as mensagens que deixaram de existir
+// são registradas; senão o registro recomeça. Retorna -1 se a caixa
+// não couber
+int share_publish(share_t *share, mailbox_t *mbox, bool same) {
+    sharehdr_t *hdr = share->hdr;
+
+    mbox_compact(mbox);
+    if(mbox->exists > SHAREMSGS || mbox->strings.len > SHARESTRINGS)
+        return -1;
+
+    share_write(share);
+    if(same) {
+        share_expunge(share, mbox);
+    } else {
+        hdr->nexp = 0;
+        hdr->expfrom = mbox->modseq;
+    }
+    memcpy(share->msgs, mbox->msgs, mbox->exists*sizeof(msg_t));
+    memcpy(share->strings, mbox->strings.data, mbox->strings.len);
+    hdr->exists = mbox->exists;
+    hdr->strings = mbox->strings.len;
+    hdr->sec = mbox->mtime.tv_sec;
+    hdr->nsec = mbox->mtime.tv_nsec;
+    hdr->modseq = mbox->modseq;
+    hdr->uidvalidity = mbox->uidvalidity;
+    hdr->uidnext = mbox->uidnext;
+    hdr->dirty = mbox->dirty;
+    hdr->gen++;
+    share_write(share);
+
+    return 0;
+}
+
+// Registra as mensagens do segmento que não estão em 'mbox', todas com
+// um mesmo 'modseq' novo. As duas listas estão ordenadas por UID
+void share_expunge(share_t *share, mailbox_t *mbox) {
+    sharehdr_t *hdr = share->hdr;
+    expunge_t *exp;
+    uint64_t modseq = 0;
+    int i, j;
+
+    for(i = j = 0; i < hdr->exists; i++) {
+        while(j < mbox->exists && mbox->msgs[j].id < share->msgs[i].id) j++;
+        if(j < mbox->exists && mbox->msgs[j].id == share->msgs[i].id) continue;
+
+        // Uma remoção sobrescrita deixa de ser conhecida
+        if(modseq == 0) modseq = ++mbox->modseq;
+        exp = &share->exps[hdr->nexp++ % SHAREEXP];
+        if(hdr->nexp > SHAREEXP && exp->modseq > hdr->expfrom) hdr->expfrom = exp->modseq;
+        exp->uid = share->msgs[i].id;
+        exp->modseq = modseq;
+    }
+}
+
+// Grava o índice em disco se o segmento tiver alterações que ainda não
+// estão nele: mensagens analisadas pela primeira vez ou flags alteradas
+void share_save(share_t *share, char const *maildir) {
+    mailbox_t mbox;
+
+    share_lock(share);
+    if(share->hdr->dirty) {
+        memset(&mbox, 0, sizeof(mbox));
+        share_copy(share, &mbox);
+        mbox.maildir = strdup(maildir);
+        mbox_write(&mbox);
+        share->hdr->dirty = mbox.dirty;
+        mbox_free(&mbox);
+    }
+    share_unlock(share);
+}
+
+// Quantidade de mensagens na caixa
+int share_exists(share_t const *share) {
+    return __atomic_load_n(&share->hdr->exists, __ATOMIC_ACQUIRE);
+}
+
+// Posição da primeira mensagem com UID maior ou igual a 'uid', ou a
+// quantidade de mensagens se não houver nenhuma
+int share_uid(share_t const *share, uint32_t uid) {
+    int lo, hi, mid;
+    uint32_t seq;
+
+    do {
+        seq = share_begin(share);
+        lo = 0;
+        hi = share->hdr->exists;
+        while(lo < hi) {
+            mid = lo + (hi - lo)/2;
+            if((uint32_t)share->msgs[mid].id < uid)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    } while(share_retry(share, seq));
+
+    return lo;
+}
+
+// Copia a mensagem na posição 'i' para 'msg', e o seu nome e a sua
+// BODYSTRUCTURE para 'name' (NAME_MAX+1 bytes) e 'bs' (SHAREBS bytes),
+// se não forem NULL. Retorna false se a posição não existe mais
+bool share_msg(share_t const *share, int i, msg_t *msg, char *name, char *bs) {
+    uint32_t seq;
+
+    do {
+        seq = share_begin(share);
+        if(i < 0 || i >= share->hdr->exists) {
+            if(share_retry(share, seq)) continue;
+            return false;
+        }
+
+        *msg = share->msgs[i];
+        if(name != NULL && msg->name < SHARESTRINGS)
+            snprintf(name, NAME_MAX+1, "%s", share->strings + msg->name);
+        if(bs != NULL && msg->bs < SHARESTRINGS)
+            snprintf(bs, SHAREBS, "%s", msg->parsed ? share->strings + msg->bs : "");
+    } while(share_retry(share, seq));
+
+    return true;
+}
+
+// Grava em 'out' os UIDs de 'uids' (de todos, se for NULL) removidos
+// depois de 'modseq' e até 'upto', para o VANISHED do QRESYNC. Se o
+// registro não alcança 'modseq', vão todos os UIDs de 'uids' abaixo do
+// UIDNEXT que não existem mais, o que o RFC 7162 permite, a não ser os
+// removidos depois de 'upto'
+void share_vanished(share_t *share, uint64_t modseq, uint64_t upto, set_t const *uids, set_t *out) {
+    sharehdr_t *hdr = share->hdr;
+    range_t all;
+    range_t const *r;
+    expunge_t const *exp;
+    uint32_t *v, lo, hi, next;
+    uint64_t e;
+    bool gaps;
+    int i, j, k, n = 0, nr;
+
+    out->n = 0;
+    share_lock(share);
+
+    // As remoções do registro que valem: as que a sessão já deveria
+    // conhecer, ou, para os buracos, as que ela ainda não viu
+    gaps = (modseq < hdr->expfrom);
+    v = (uint32_t*)malloc((hdr->nexp < SHAREEXP ? hdr->nexp : SHAREEXP)*sizeof(uint32_t) + 1);
+    for(e = (hdr->nexp > SHAREEXP) ? hdr->nexp - SHAREEXP : 0; e < hdr->nexp; e++) {
+        exp = &share->exps[e % SHAREEXP];
+        if(gaps ? exp->modseq > upto : (exp->modseq > modseq && exp->modseq <= upto)) v[n++] = exp->uid;
+    }
+    qsort(v, n, sizeof(uint32_t), uid_cmp);
+
+    if(!gaps) {
+        for(k = 0; k < n; k++)
+            if((k == 0 || v[k] != v[k-1]) && (uids == NULL || set_has(uids, v[k]))) set_add(out, v[k]);
+    } else {
+        all.lo = 1;
+        all.hi = hdr->uidnext - 1;
+        r = uids ? uids->r : &all;
+        nr = uids ? uids->n : (hdr->uidnext > 1);
+        for(k = j = 0; k < nr; k++) {
+            lo = r[k].lo;
+            hi = (r[k].hi < hdr->uidnext) ? r[k].hi : hdr->uidnext - 1;
+            for(i = share_uid(share, lo); lo <= hi; i++) {
+                // O próximo UID que existe, ou que a sessão ainda vai ver sumir
+                next = (i < hdr->exists) ? (uint32_t)share->msgs[i].id : UINT32_MAX;
+                while(j < n && v[j] < lo) j++;
+                if(j < n && v[j] < next) {
+                    next = v[j];
+                    i--;
+                }
+                if(next > hi) {
+                    set_range(out, lo, hi);
+                    break;
+                }
+                if(next > lo) set_range(out, lo, next - 1);
+                lo = next + 1;
+            }
+        }
+    }
+
+    free(v);
+    share_unlock(share);
+}
+
+// Copia a mensagem na posição 'i' para 'msg' e as suas chaves de
+// ordenação para 'keys' (SHAREKEYS bytes), vazias se ela ainda não foi
+// examinada. Retorna false se a posição não existe mais
+bool share_keys(share_t const *share, int i, msg_t *msg, char *keys) {
+    uint32_t seq;
+
+    do {
+        seq = share_begin(share);
+        if(i < 0 || i >= share->hdr->exists) {
+            if(share_retry(share, seq)) continue;
+            return false;
+        }
+
+        *msg = share->msgs[i];
+        if(msg->keys < SHARESTRINGS)
+            snprintf(keys, SHAREKEYS, "%s", msg->parsed ? share->strings + msg->keys : "");
+    } while(share_retry(share, seq));
+
+    return true;
+}
+
+// Grava as flags e os dados calculados de 'msg' na mensagem de mesmo
+// UID, e também o seu novo nome, a sua BODYSTRUCTURE e as suas chaves
+// de ordenação, se não forem NULL. Deve ser chamada com a trava obtida.
+// Retorna -1 se a mensagem não existe mais
+int share_set(share_t *share, msg_t const *msg, char const *name, char const *bs, char const *keys) {
+    uint32_t noff = 0, boff = 0, koff = 0;
+    msg_t *m;
+    int i;
+
+    i = share_uid(share, msg->id);
+    if(i == share->hdr->exists || share->msgs[i].id != msg->id)
+        return -1;
+    m = &share->msgs[i];
+
+    // As strings novas ficam depois das que já existem, onde nenhuma
+    // leitura as alcança até que a mensagem aponte para elas
+    share_room(share, (name ? strlen(name)+1 : 0) + (bs ? strlen(bs)+1 : 0) + (keys ? strlen(keys)+1 : 0));
+    if(name != NULL) noff = share_str(share, name);
+    if(bs != NULL) boff = share_str(share, bs);
+    if(keys != NULL) koff = share_str(share, keys);
+
+    share_write(share);
+    if(m->seen != msg->seen || m->deleted != msg->deleted)
+        m->modseq = ++share->hdr->modseq;
+    m->seen = msg->seen;
+    m->deleted = msg->deleted;
+    if(msg->parsed && !m->parsed) {
+        m->hsize  = msg->hsize;
+        m->hlines = msg->hlines;
+        m->flines = msg->flines;
+        m->sent   = msg->sent;
+        m->reply  = msg->reply;
+        m->parsed = true;
+        if(bs != NULL) m->bs = boff;
+        if(keys != NULL) m->keys = koff;
+    }
+    if(name != NULL) m->name = noff;
+    share->hdr->dirty = true;
+    share_write(share);
+
+    return 0;
+}
+
+// Garante espaço para mais 'len' bytes na área de strings, compactando
+// a área se for preciso, o que muda as posições de todas as strings.
+// Deve ser chamada com a trava obtida
+void share_room(share_t *share, size_t len) {
+    mailbox_t mbox;
+
+    if(share->hdr->strings + len <= SHARESTRINGS) return;
+
+    memset(&mbox, 0, sizeof(mbox));
+    share_copy(share, &mbox);
+    share_publish(share, &mbox, true);
+    mbox_free(&mbox);
+}
+
+// Acrescenta a string 's' na área de strings do segmento, onde já deve
+// haver espaço (share_room), e retorna a sua posição. Deve ser chamada
+// com a trava obtida
+uint32_t share_str(share_t *share, char const *s) {
+    sharehdr_t *hdr = share->hdr;
+    size_t len = strlen(s)+1;
+    uint32_t off;
+
+    off = hdr->strings;
+    memcpy(share->strings + off, s, len);
+    share_write(share);
+    hdr->strings += len;
+    share_write(share);
+
+    return off;
+}
+
+// Tira a marca de recente das mensagens com UID a partir de 'uid', que
+// passam a ser recentes só para a sessão que as viu primeiro, e
+// acrescenta os UIDs delas a 'uids'. Deve ser chamada com a trava
+// obtida. Retorna quantas eram recentes
+int share_recent(share_t *share, uint32_t uid, set_t *uids) {
+    int i, n = 0;
+
+    for(i = share_uid(share, uid); i < share->hdr->exists; i++) {
+        if(!share->msgs[i].recent) continue;
+        if(n++ == 0) share_write(share);
+        share->msgs[i].recent = false;
+        set_add(uids, share->msgs[i].id);
+    }
+    if(n > 0) {
+        share->hdr->dirty = true;
+        share_write(share);
+    }
+
+    return n;
+}
+
+// Registra no diário que o arquivo 'old' da mensagem 'uid' deve passar
+// a se chamar 'name'. Deve ser chamada com a trava obtida. Retorna false
+// se a linha não pôde ser gravada; um pedaço dela que tenha sido gravado
+// é cortado, para não estragar o diário
+bool share_journal(share_t *share, char const *maildir, uint32_t uid, char const *old, char const *name) {
+    char path[PATH_MAX], line[2*NAME_MAX+32];
+    off_t end;
+    int n;
+
+    if(share->jfd == -1) {
+        snprintf(path, sizeof(path), "%s/" SHAREJOURNAL, maildir);
+        if((share->jfd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+            perror(path);
+            return false;
+        }
+    }
+
+    n = snprintf(line, sizeof(line), "%u %s %s\n", uid, old, name);
+    end = lseek(share->jfd, 0, SEEK_END);
+    if(write(share->jfd, line, n) != n) {
+        perror(SHAREJOURNAL);
+        if(end != -1 && ftruncate(share->jfd, end) == -1) perror(SHAREJOURNAL);
+        return false;
+    }
+    share->hdr->journal++;
+    share->pending = true;
+
+    return true;
+}
+
+// Aplica o diário da caixa, se ele tiver alguma linha
+void share_flush(share_t *share, char const *maildir) {
+    share->pending = false;
+    if(__atomic_load_n(&share->hdr->journal, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    share_lock(share);
+    share_replay(share, maildir);
+    share_unlock(share);
+}
+
+// Faz as renomeações do diário, com a trava obtida: cada arquivo vai
+// direto para o último nome pedido, e a mensagem no segmento passa a
+// ter o nome novo. Um arquivo que já não existe (renomeado antes de
+// uma queda, ou removido) é ignorado. No final o diário é esvaziado
+void share_replay(share_t *share, char const *maildir) {
+    char path[PATH_MAX], oldfp[PATH_MAX+NAME_MAX+2], newfp[PATH_MAX+NAME_MAX+2];
+    char *data, *p, *end, *nl, *sp, *name;
+    journal_t *recs = NULL, *r;
+    struct stat st;
+    uint32_t off;
+    msg_t *m;
+    int fd, i, j, n = 0;
+
+    snprintf(path, sizeof(path), "%s/" SHAREJOURNAL, maildir);
+    if((fd = open(path, O_RDWR)) == -1) {
+        share->hdr->journal = 0;
+        return;
+    }
+    if(fstat(fd, &st) == -1 || st.st_size == 0 || (data = (char*)malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        share->hdr->journal = 0;
+        return;
+    }
+    if(pread(fd, data, st.st_size, 0) != st.st_size) {
+        perror(path);
+        free(data);
+        close(fd);
+        return;
+    }
+
+    // Linhas completas; uma incompleta no final é de uma escrita
+    // interrompida
+    end = data + st.st_size;
+    for(p = data; p < end && (nl = memchr(p, '\n', end - p)) != NULL; p = nl+1) {
+        *nl = 0;
+        if((sp = strchr(p, ' ')) == NULL || (name = strchr(sp+1, ' ')) == NULL) continue;
+        *name++ = 0;
+
+        recs = (journal_t*)realloc(recs, (n+1)*sizeof(journal_t));
+        r = &recs[n];
+        r->uid = strtoul(p, NULL, 10);
+        r->old = sp+1;
+        r->name = name;
+        r->pos = n++;
+    }
+
+    // Agrupa as linhas de cada arquivo, na ordem do diário, e só a
+    // última de cada grupo vale
+    qsort(recs, n, sizeof(journal_t), journal_cmp);
+    for(i = 0; i < n; i = j) {
+        for(j = i+1; j < n && !strcmp(recs[j].old, recs[i].old); j++);
+        r = &recs[j-1];
+        if(!strcmp(r->old, r->name)) continue;
+
+        snprintf(oldfp, sizeof(oldfp), "%s/cur/%s", maildir, r->old);
+        snprintf(newfp, sizeof(newfp), "%s/cur/%s", maildir, r->name);
+        if(rename(oldfp, newfp) == -1) {
+            if(errno != ENOENT) perror(oldfp);
+            continue;
+        }
+
+        m = &share->msgs[share_uid(share, r->uid)];
+        if(m >= share->msgs + share->hdr->exists || m->id != (int)r->uid || strcmp(share->strings + m->name, r->old) != 0)
+            continue;
+
+        share_room(share, strlen(r->name)+1);
+        m = &share->msgs[share_uid(share, r->uid)];
+        off = share_str(share, r->name);
+        share_write(share);
+        m->name = off;
+        share->hdr->dirty = true;
+        share_write(share);
+    }
+
+    if(ftruncate(fd, 0) == -1)
+        perror(path);
+    share->hdr->journal = 0;
+    close(fd);
+    free(recs);
+    free(data);
+}
+
+// Compara duas linhas do diário pelo nome atual do arquivo e depois
+// pela posição, para o qsort
+int journal_cmp(void const *a, void const *b) {
+    journal_t const *x = (journal_t const*)a, *y = (journal_t const*)b;
+    int c = strcmp(x->old, y->old);
+
+    return c ? c : x->pos - y->pos;
+}
@@ -0,0 +1,389 @@
+/* Kernels de varredura de texto.
+ *
+ * Cada kernel tem uma versão escalar, uma com SSE2 (16 bytes por vez) e
+ * uma com AVX2 (32 bytes por vez). A tabela 'simd' aponta para as versões
+ * usadas; ela começa com as escalares e simd_init() escolhe as melhores
+ * que o processador suporta. As versões AVX2 são compiladas com o atributo
+ * target, então o binário continua rodando em processadores sem AVX2.
+ *
+ * count  conta as ocorrências de um byte (as quebras de linha)
+ * line   encontra o próximo '\n' seguido de um de dois bytes (a linha em
+ *        branco que termina um cabeçalho, ou a que começa com "-" e pode
+ *        ser uma boundary)
+ * ifind  procura uma string sem diferenciar maiúsculas
+ * fold   converte as letras ASCII para minúsculas ou maiúsculas
+ * field  diz qual de um conjunto de nomes de campo começa uma linha de
+ *        cabeçalho, comparando a linha com todos de uma vez
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+#define SIMDNAMES 16        // Nomes de campo por conjunto
+#define SIMDNAME 32         // Tamanho máximo de um nome, com o ':'
+
+// Conjunto de nomes de campo procurados de uma vez, já em minúsculas e
+// seguidos de ':', completados com zeros até SIMDNAME bytes
+typedef struct {
+    char name[SIMDNAMES][SIMDNAME];
+    int len[SIMDNAMES];
+    uint32_t mask[SIMDNAMES];
+    int n;
+} simdnames_t;
+
+typedef struct {
+    char const *name;
+    size_t (*count)(char const *s, size_t len, char c);
+    char const *(*line)(char const *s, size_t len, char a, char b);
+    char const *(*ifind)(char const *s, size_t len, char const *t, size_t n);
+    void (*fold)(char *dst, char const *src, size_t len, bool upper);
+    int (*field)(simdnames_t const *set, char const *s, size_t len);
+} simd_t;
+
+//========================================= FUNÇÕES =========================================
+void simd_init(void);
+void simd_names(simdnames_t *set, char const *const *names, int n);
+bool simd_ieq(char const *s, char const *t, size_t n);
+size_t simd_count_scalar(char const *s, size_t len, char c);
+char const *simd_line_scalar(char const *s, size_t len, char a, char b);
+char const *simd_ifind_scalar(char const *s, size_t len, char const *t, size_t n);
+void simd_fold_scalar(char *dst, char const *src, size_t len, bool upper);
+int simd_field_scalar(simdnames_t const *set, char const *s, size_t len);
+#ifdef SIMD_X86
+size_t simd_count_sse2(char const *s, size_t len, char c);
+char const *simd_line_sse2(char const *s, size_t len, char a, char b);
+char const *simd_ifind_sse2(char const *s, size_t len, char const *t, size_t n);
+void simd_fold_sse2(char *dst, char const *src, size_t len, bool upper);
+int simd_field_sse2(simdnames_t const *set, char const *s, size_t len);
+size_t simd_count_avx2(char const *s, size_t len, char c);
+char const *simd_line_avx2(char const *s, size_t len, char a, char b);
+char const *simd_ifind_avx2(char const *s, size_t len, char const *t, size_t n);
+void simd_fold_avx2(char *dst, char const *src, size_t len, bool upper);
+int simd_field_avx2(simdnames_t const *set, char const *s, size_t len);
+#endif
+
+#define SIMD_SCALAR {"escalar", simd_count_scalar, simd_line_scalar, simd_ifind_scalar, simd_fold_scalar, simd_field_scalar}
+#define SIMD_SSE2 {"sse2", simd_count_sse2, simd_line_sse2, simd_ifind_sse2, simd_fold_sse2, simd_field_sse2}
+#define SIMD_AVX2 {"avx2", simd_count_avx2, simd_line_avx2, simd_ifind_avx2, simd_fold_avx2, simd_field_avx2}
+
+simd_t simd = SIMD_SCALAR;
+simd_t const simd_scalar = SIMD_SCALAR;
+#ifdef SIMD_X86
+simd_t const simd_sse2 = SIMD_SSE2;
+simd_t const simd_avx2 = SIMD_AVX2;
+#endif
+
+
+// Escolhe os kernels conforme o processador
+void simd_init(void) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) simd = simd_avx2;
+    else if(__builtin_cpu_supports("sse2")) simd = simd_sse2;
+#endif
+}
+
+// Monta o conjunto com os 'n' nomes de 'names'. Os que não couberem
+// ficam vazios e nunca são encontrados
+void simd_names(simdnames_t *set, char const *const *names, int n) {
+    int i, l;
+
+    memset(set, 0, sizeof(*set));
+    set->n = n < SIMDNAMES ? n : SIMDNAMES;
+    for(i = 0; i < set->n; i++) {
+        if((l = strlen(names[i])) >= SIMDNAME) {
+            set->len[i] = -1;
+            set->mask[i] = 0;
+            continue;
+        }
+        simd_fold_scalar(set->name[i], names[i], l, false);
+        set->name[i][l] = ':';
+        set->len[i] = l;
+        set->mask[i] = (l + 1 == 32) ? UINT32_MAX : ((uint32_t)1 << (l + 1)) - 1;
+    }
+}
+
+// Minúscula de uma letra ASCII
+static inline int simd_lc(int c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Compara 'n' bytes sem diferenciar maiúsculas
+bool simd_ieq(char const *s, char const *t, size_t n) {
+    size_t i;
+
+    for(i = 0; i < n; i++)
+        if(simd_lc((unsigned char)s[i]) != simd_lc((unsigned char)t[i])) return false;
+    return true;
+}
+
+
+// Versões escalares, usadas quando a CPU não tem SSE2
+
+size_t simd_count_scalar(char const *s, size_t len, char c) {
+    char const *p, *end = s + len;
+    size_t n = 0;
+
+    for(p = s; (p = memchr(p, c, end - p)) != NULL; p++) n++;
+    return n;
+}
+
+char const *simd_line_scalar(char const *s, size_t len, char a, char b) {
+    char const *p, *end = s + len;
+
+    for(p = s; (p = memchr(p, '\n', end - p)) != NULL && p + 1 < end; p++)
+        if(p[1] == a || p[1] == b) return p;
+    return NULL;
+}
+
+char const *simd_ifind_scalar(char const *s, size_t len, char const *t, size_t n) {
+    size_t i;
+
+    if(n == 0) return s;
+    for(i = 0; i + n <= len; i++)
+        if(simd_lc((unsigned char)s[i]) == simd_lc((unsigned char)t[0]) && simd_ieq(s + i, t, n)) return s + i;
+    return NULL;
+}
+
+void simd_fold_scalar(char *dst, char const *src, size_t len, bool upper) {
+    char lo = upper ? 'a' : 'A';
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        dst[i] = (src[i] >= lo && src[i] <= lo + 25) ? src[i] ^ 0x20 : src[i];
+}
+
+int simd_field_scalar(simdnames_t const *set, char const *s, size_t len) {
+    int i, l;
+
+    for(i = 0; i < set->n; i++) {
+        l = set->len[i];
+        if(l >= 0 && (size_t)l < len && s[l] == ':' && simd_ieq(s, set->name[i], l)) return i;
+    }
+    return -1;
+}
+
+
+#ifdef SIMD_X86
+// Versões SSE2, 16 bytes por vez
+
+
+// Troca maiúsculas e minúsculas das letras entre 'lo' e 'lo'+25
+static inline __m128i simd_flip_sse2(__m128i x, char lo) {
+    __m128i in = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8(lo + 26)));
+
+    return _mm_xor_si128(x, _mm_and_si128(in, _mm_set1_epi8(0x20)));
+}
+
+size_t simd_count_sse2(char const *s, size_t len, char c) {
+    __m128i cc = _mm_set1_epi8(c), zero = _mm_setzero_si128(), acc, sum = zero;
+    size_t i = 0;
+    int k;
+
+    // Cada byte de 'acc' conta até 255 ocorrências; depois é somado em 'sum'
+    while(i + 16 <= len) {
+        acc = zero;
+        for(k = 0; k < 255 && i + 16 <= len; k++, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const*)(s + i)), cc));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+    }
+
+    return (size_t)_mm_cvtsi128_si64(sum) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)) +
+           simd_count_scalar(s + i, len - i, c);
+}
+
+char const *simd_line_sse2(char const *s, size_t len, char a, char b) {
+    __m128i nl = _mm_set1_epi8('\n'), aa = _mm_set1_epi8(a), bb = _mm_set1_epi8(b), x, y;
+    unsigned bits;
+    size_t i;
+
+    for(i = 0; i + 17 <= len; i += 16) {
+        x = _mm_loadu_si128((__m128i const*)(s + i));
+        y = _mm_loadu_si128((__m128i const*)(s + i + 1));
+        bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, nl), _mm_or_si128(_mm_cmpeq_epi8(y, aa), _mm_cmpeq_epi8(y, bb))));
+        if(bits) return s + i + __builtin_ctz(bits);
+    }
+
+    return simd_line_scalar(s + i, len - i, a, b);
+}
+
+// Procura as posições onde o primeiro e o último byte de 't' aparecem
+// à distância certa, e só nelas compara o resto
+char const *simd_ifind_sse2(char const *s, size_t len, char const *t, size_t n) {
+    __m128i f, l, x, y;
+    unsigned bits;
+    size_t i;
+    int k;
+
+    if(n == 0) return s;
+    f = _mm_set1_epi8(simd_lc((unsigned char)t[0]));
+    l = _mm_set1_epi8(simd_lc((unsigned char)t[n-1]));
+    for(i = 0; i + n + 15 <= len; i += 16) {
+        x = simd_flip_sse2(_mm_loadu_si128((__m128i const*)(s + i)), 'A');
+        y = simd_flip_sse2(_mm_loadu_si128((__m128i const*)(s + i + n - 1)), 'A');
+        bits = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, f), _mm_cmpeq_epi8(y, l)));
+        for(; bits; bits &= bits - 1) {
+            k = __builtin_ctz(bits);
+            if(simd_ieq(s + i + k, t, n)) return s + i + k;
+        }
+    }
+
+    return simd_ifind_scalar(s + i, len - i, t, n);
+}
+
+void simd_fold_sse2(char *dst, char const *src, size_t len, bool upper) {
+    char lo = upper ? 'a' : 'A';
+    size_t i;
+
+    for(i = 0; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), simd_flip_sse2(_mm_loadu_si128((__m128i const*)(src + i)), lo));
+    simd_fold_scalar(dst + i, src + i, len - i, upper);
+}
+
+// A linha é convertida para minúsculas uma vez, o primeiro ':' dela diz
+// o tamanho do nome, e só os nomes desse tamanho são comparados, nos
+// bytes da máscara deles (o nome e o ':')
+int simd_field_sse2(simdnames_t const *set, char const *s, size_t len) {
+    char pad[SIMDNAME];
+    __m128i lo, hi;
+    uint32_t bits, colon;
+    int i, c;
+
+    if(len < SIMDNAME) {
+        memset(pad, 0, SIMDNAME);
+        memcpy(pad, s, len);
+        s = pad;
+    }
+    lo = simd_flip_sse2(_mm_loadu_si128((__m128i const*)s), 'A');
+    hi = simd_flip_sse2(_mm_loadu_si128((__m128i const*)(s + 16)), 'A');
+    colon = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, _mm_set1_epi8(':'))) |
+            (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, _mm_set1_epi8(':'))) << 16;
+    if(colon == 0) return -1;
+    c = __builtin_ctz(colon);
+    for(i = 0; i < set->n; i++) {
+        if(set->len[i] != c) continue;
+        bits = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, _mm_loadu_si128((__m128i const*)set->name[i]))) |
+               (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, _mm_loadu_si128((__m128i const*)(set->name[i] + 16)))) << 16;
+        if((bits & set->mask[i]) == set->mask[i]) return i;
+    }
+    return -1;
+}
+
+
+// Versões AVX2, 32 bytes por vez
+
+// O resto que não completa 32 bytes fica com a versão SSE2; antes de
+// chamá-la a metade de cima dos registradores é zerada, já que o
+// compilador não faz isso numa chamada no fim da função e a troca entre
+// AVX e SSE com ela suja custa caro
+
+__attribute__((target("avx2")))
+static inline __m256i simd_flip_avx2(__m256i x, char lo) {
+    __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(lo + 26), x));
+
+    return _mm256_xor_si256(x, _mm256_and_si256(in, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+size_t simd_count_avx2(char const *s, size_t len, char c) {
+    __m256i cc = _mm256_set1_epi8(c), zero = _mm256_setzero_si256(), acc, sum = zero;
+    size_t i = 0, n;
+    int k;
+
+    while(i + 32 <= len) {
+        acc = zero;
+        for(k = 0; k < 255 && i + 32 <= len; k++, i += 32)
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const*)(s + i)), cc));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));
+    }
+
+    n = (size_t)_mm256_extract_epi64(sum, 0) + (size_t)_mm256_extract_epi64(sum, 1) +
+        (size_t)_mm256_extract_epi64(sum, 2) + (size_t)_mm256_extract_epi64(sum, 3);
+    _mm256_zeroupper();
+    return n + simd_count_sse2(s + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+char const *simd_line_avx2(char const *s, size_t len, char a, char b) {
+    __m256i nl = _mm256_set1_epi8('\n'), aa = _mm256_set1_epi8(a), bb = _mm256_set1_epi8(b), x, y;
+    unsigned bits;
+    size_t i;
+
+    for(i = 0; i + 33 <= len; i += 32) {
+        x = _mm256_loadu_si256((__m256i const*)(s + i));
+        y = _mm256_loadu_si256((__m256i const*)(s + i + 1));
+        bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, nl), _mm256_or_si256(_mm256_cmpeq_epi8(y, aa), _mm256_cmpeq_epi8(y, bb))));
+        if(bits) return s + i + __builtin_ctz(bits);
+    }
+
+    _mm256_zeroupper();
+    return simd_line_sse2(s + i, len - i, a, b);
+}
+
+__attribute__((target("avx2")))
+char const *simd_ifind_avx2(char const *s, size_t len, char const *t, size_t n) {
+    __m256i f, l, x, y;
+    unsigned bits;
+    size_t i;
+    int k;
+
+    if(n == 0) return s;
+    f = _mm256_set1_epi8(simd_lc((unsigned char)t[0]));
+    l = _mm256_set1_epi8(simd_lc((unsigned char)t[n-1]));
+    for(i = 0; i + n + 31 <= len; i += 32) {
+        x = simd_flip_avx2(_mm256_loadu_si256((__m256i const*)(s + i)), 'A');
+        y = simd_flip_avx2(_mm256_loadu_si256((__m256i const*)(s + i + n - 1)), 'A');
+        bits = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, f), _mm256_cmpeq_epi8(y, l)));
+        for(; bits; bits &= bits - 1) {
+            k = __builtin_ctz(bits);
+            if(simd_ieq(s + i + k, t, n)) return s + i + k;
+        }
+    }
+
+    _mm256_zeroupper();
+    return simd_ifind_sse2(s + i, len - i, t, n);
+}
+
+__attribute__((target("avx2")))
+void simd_fold_avx2(char *dst, char const *src, size_t len, bool upper) {
+    char lo = upper ? 'a' : 'A';
+    size_t i;
+
+    for(i = 0; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i*)(dst + i), simd_flip_avx2(_mm256_loadu_si256((__m256i const*)(src + i)), lo));
+    _mm256_zeroupper();
+    simd_fold_sse2(dst + i, src + i, len - i, upper);
+}
+
+__attribute__((target("avx2")))
+int simd_field_avx2(simdnames_t const *set, char const *s, size_t len) {
+    char pad[SIMDNAME];
+    __m256i x;
+    uint32_t bits, colon;
+    int i, c;
+
+    if(len < SIMDNAME) {
+        memset(pad, 0, SIMDNAME);
+        memcpy(pad, s, len);
+        s = pad;
+    }
+    x = simd_flip_avx2(_mm256_loadu_si256((__m256i const*)s), 'A');
+    colon = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(':')));
+    if(colon == 0) return -1;
+    c = __builtin_ctz(colon);
+    for(i = 0; i < set->n; i++) {
+        if(set->len[i] != c) continue;
+        bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_loadu_si256((__m256i const*)set->name[i])));
+        if((bits & set->mask[i]) == set->mask[i]) return i;
+    }
+    return -1;
+}
+#endif
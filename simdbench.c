@@ -0,0 +1,336 @@
+/* Microbenchmarks dos kernels de varredura de simd.c.
+ *
+ * Antes das medidas, confere as versões SSE2 e AVX2 com as escalares em
+ * entradas aleatórias, e termina com erro se alguma delas discordar.
+ * Depois mede cada kernel nas versões escalar, SSE2 e AVX2 (as que a CPU
+ * suportar) e também o código que ele substituiu no servidor, sobre um
+ * texto sintético parecido com uma mensagem multipart grande:
+ *
+ * linhas    contar as linhas do corpo (antes: um memchr por linha)
+ * boundary  achar a próxima linha que começa com "--" (antes: um memchr
+ *           por linha e a comparação do começo de cada uma)
+ * ifind     procurar uma palavra sem diferenciar maiúsculas, como o
+ *           SEARCH confere o texto (antes: tolower byte a byte)
+ * fold      passar uma linha de comando para maiúsculas (antes: o
+ *           uppercase() com strlen a cada byte)
+ * campos    achar os dez campos do ENVELOPE em um cabeçalho (antes: uma
+ *           passada pelo cabeçalho com strncasecmp para cada campo)
+ *
+ * ./simdbench [<Megabytes>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include "simd.c"
+
+#define HEADER \
+    "Return-Path: <email@domain>\r\n" \
+    "Received: from localhost (localhost [127.0.0.1])\r\n" \
+    "\tby mail.ime.usp.br with ESMTP id 12345; Sun, 3 Sep 2017 19:47:11 -0300\r\n" \
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:52.0) Gecko/20100101\r\n" \
+    " Thunderbird/52.3.0\r\n" \
+    "MIME-Version: 1.0\r\n" \
+    "Content-Type: multipart/mixed; boundary=\"------------A1B2C3D4E5F6\"\r\n" \
+    "Content-Language: en-US\r\n" \
+    "X-Mailer: ep1\r\n" \
+    "From: Email <email@domain>\r\n" \
+    "To: mriva@ime.usp.br\r\n" \
+    "Cc: lmagno@ime.usp.br\r\n" \
+    "Subject: This is an email\r\n" \
+    "Message-ID: <efb89e20-5855-c9eb-6db3-bb9db7bcc880@localhost>\r\n" \
+    "Date: Sun, 3 Sep 2017 19:47:11 -0300\r\n" \
+    "\r\n"
+
+char const *const names[] = {"Date", "Subject", "From", "Sender", "Reply-To", "To", "Cc", "Bcc",
+                             "In-Reply-To", "Message-ID"};
+#define NNAMES 10
+
+volatile size_t sink;
+
+//========================================= FUNÇÕES =========================================
+double now(void);
+void run(char const *kernel, char const *impl, size_t bytes, int reps, void (*fn)(void));
+int check(simd_t const *const *impls, int nimpls, int cases);
+void differ(char const *kernel, char const *impl, char const *s, size_t len);
+void fill(void);
+void old_lines(void);
+void old_boundary(void);
+void old_ifind(void);
+void old_fold(void);
+void old_fields(void);
+void new_lines(void);
+void new_boundary(void);
+void new_ifind(void);
+void new_fold(void);
+void new_fields(void);
+
+char *text, *line;
+size_t len, linelen;
+simd_t const *cur;
+simdnames_t set;
+
+// Segundos desde um instante qualquer
+double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Roda 'fn' 'reps' vezes e imprime a vazão sobre 'bytes' bytes por vez
+void run(char const *kernel, char const *impl, size_t bytes, int reps, void (*fn)(void)) {
+    double t;
+    int i;
+
+    fn();
+    t = now();
+    for(i = 0; i < reps; i++) fn();
+    t = now() - t;
+    printf("%-9s %-9s %10.1f MB/s\n", kernel, impl, (double)bytes*reps/t/1e6);
+}
+
+// Uma diferença entre a versão 'impl' e a escalar, na entrada 's'
+void differ(char const *kernel, char const *impl, char const *s, size_t len) {
+    size_t i;
+
+    printf("%s %s difere da escalar em \"", kernel, impl);
+    for(i = 0; i < len; i++)
+        printf(isprint((unsigned char)s[i]) ? "%c" : "\\x%02x", (unsigned char)s[i]);
+    printf("\"\n");
+}
+
+// Compara as 'nimpls' versões com a primeira, a escalar, em 'cases'
+// entradas aleatórias. Os textos têm poucos bytes diferentes, para que
+// as buscas achem alguma coisa, e começam em posições variadas, para
+// cobrir os alinhamentos. Retorna o número de diferenças
+int check(simd_t const *const *impls, int nimpls, int cases) {
+    static char const alphabet[] = "aAbBzZ-:\n\r \xe9";
+    char buf[256+32], want[256], got[256], t[8], *s;
+    char const *a, *b;
+    size_t len, n, i;
+    int k, c, j, errors = 0;
+
+    srand(1);
+    for(k = 0; k < cases; k++) {
+        s = buf + rand() % 32;
+        len = rand() % 257;
+        for(i = 0; i < len; i++) s[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+
+        // Às vezes a linha começa com um dos nomes de campo
+        if(k % 4 == 0 && len > 0) {
+            j = rand() % NNAMES;
+            n = strlen(names[j]);
+            for(i = 0; i < n && i < len; i++)
+                s[i] = (rand() % 2) ? toupper((unsigned char)names[j][i]) : tolower((unsigned char)names[j][i]);
+            if(n < len && rand() % 4) s[n] = ':';
+        }
+
+        // Às vezes a string procurada é um trecho do texto
+        n = 1 + rand() % sizeof(t);
+        if(k % 2 == 0 && len >= n) memcpy(t, s + rand() % (len - n + 1), n);
+        else for(i = 0; i < n; i++) t[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        if(rand() % 2) for(i = 0; i < n; i++) t[i] = (rand() % 2) ? toupper((unsigned char)t[i]) : t[i];
+        c = alphabet[rand() % (sizeof(alphabet) - 1)];
+
+        for(j = 1; j < nimpls; j++) {
+            if(impls[j]->count(s, len, c) != impls[0]->count(s, len, c)) {
+                differ("count", impls[j]->name, s, len);
+                errors++;
+            }
+            a = impls[0]->line(s, len, '-', c);
+            b = impls[j]->line(s, len, '-', c);
+            if(a != b) {
+                differ("line", impls[j]->name, s, len);
+                errors++;
+            }
+            a = impls[0]->ifind(s, len, t, n);
+            b = impls[j]->ifind(s, len, t, n);
+            if(a != b) {
+                differ("ifind", impls[j]->name, s, len);
+                errors++;
+            }
+            impls[0]->fold(want, s, len, k % 2);
+            impls[j]->fold(got, s, len, k % 2);
+            if(memcmp(want, got, len) != 0) {
+                differ("fold", impls[j]->name, s, len);
+                errors++;
+            }
+            if(impls[j]->field(&set, s, len) != impls[0]->field(&set, s, len)) {
+                differ("field", impls[j]->name, s, len);
+                errors++;
+            }
+        }
+    }
+
+    return errors;
+}
+
+// Corpo base64 em linhas de 76 bytes, com uma boundary no final
+void fill(void) {
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        text[i] = (i % 78 == 76) ? '\r' : (i % 78 == 77) ? '\n' : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(i*7919) % 64];
+    memcpy(text + len - 30, "\r\n--------------A1B2C3D4E5F6--", 30);
+}
+
+
+// Código que os kernels substituíram no servidor
+
+void old_lines(void) {
+    char const *p, *nl, *end = text + len;
+    size_t n = 0;
+
+    for(p = text; p < end; p = nl ? nl + 1 : end, n++)
+        nl = memchr(p, '\n', end - p);
+    sink = n;
+}
+
+void old_boundary(void) {
+    char const *p, *nl, *end = text + len;
+
+    for(p = text; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if(end - p >= 3 && p[0] == '-' && p[1] == '-') break;
+        if(nl == NULL) break;
+    }
+    sink = p - text;
+}
+
+void old_ifind(void) {
+    char const *t = "a1b2c3d4e5";
+    size_t n = strlen(t), i, j;
+
+    for(i = 0; i + n <= len; i++) {
+        for(j = 0; j < n && tolower((unsigned char)text[i+j]) == tolower((unsigned char)t[j]); j++);
+        if(j == n) break;
+    }
+    sink = i;
+}
+
+void old_fold(void) {
+    int i;
+    char c;
+
+    for(i = 0; i < (int)strlen(line); i++) {
+        c = line[i];
+        if(isalpha(c)){
+            line[i] = toupper(c);
+        }
+    }
+    line[0] = 'a';
+    sink = line[1];
+}
+
+void old_fields(void) {
+    char const *h = HEADER, *nl;
+    size_t hlen = strlen(HEADER), pos, next, n, found = 0;
+    int i;
+
+    for(i = 0; i < NNAMES; i++) {
+        n = strlen(names[i]);
+        for(pos = 0; pos < hlen; pos = next) {
+            next = ((nl = memchr(h + pos, '\n', hlen - pos)) != NULL) ? (size_t)(nl - h) + 1 : hlen;
+            if(next - pos > n && h[pos+n] == ':' && !strncasecmp(h + pos, names[i], n)) {
+                found++;
+                break;
+            }
+        }
+    }
+    sink = found;
+}
+
+
+// Os mesmos trabalhos feitos pelos kernels de simd.c
+
+void new_lines(void) {
+    sink = cur->count(text, len, '\n');
+}
+
+void new_boundary(void) {
+    sink = cur->line(text, len, '-', '-') - text;
+}
+
+void new_ifind(void) {
+    sink = cur->ifind(text, len, "a1b2c3d4e5", 10) != NULL;
+}
+
+void new_fold(void) {
+    cur->fold(line, line, linelen, true);
+    line[0] = 'a';
+    sink = line[1];
+}
+
+void new_fields(void) {
+    char const *h = HEADER, *nl;
+    size_t hlen = strlen(HEADER), pos, next, found = 0;
+
+    for(pos = 0; pos < hlen; pos = next) {
+        next = ((nl = memchr(h + pos, '\n', hlen - pos)) != NULL) ? (size_t)(nl - h) + 1 : hlen;
+        if(cur->field(&set, h + pos, hlen - pos) >= 0) found++;
+    }
+    sink = found;
+}
+
+
+int main(int argc, char **argv) {
+    simd_t const *impls[3];
+    size_t hlen = strlen(HEADER);
+    int nimpls = 0, i, reps, errors;
+
+    len = (argc > 1 ? atoi(argv[1]) : 16) << 20;
+    text = (char*)malloc(len);
+    fill();
+    line = strdup("a001 uid fetch 1:* (uid flags rfc822.size internaldate body.peek[header.fields (from to cc subject date message-id)])");
+    linelen = strlen(line);
+    simd_names(&set, names, NNAMES);
+    reps = (256 << 20) / len + 1;
+
+    impls[nimpls++] = &simd_scalar;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) impls[nimpls++] = &simd_sse2;
+    if(__builtin_cpu_supports("avx2")) impls[nimpls++] = &simd_avx2;
+#endif
+
+    if((errors = check(impls, nimpls, 200000)) > 0) {
+        printf("%d diferenças entre as versões dos kernels\n", errors);
+        return 1;
+    }
+    printf("%d versões conferidas em %d entradas aleatórias\n", nimpls, 200000);
+
+    run("linhas", "anterior", len, reps, old_lines);
+    for(i = 0; i < nimpls; i++) {
+        cur = impls[i];
+        run("linhas", cur->name, len, reps, new_lines);
+    }
+    run("boundary", "anterior", len, reps, old_boundary);
+    for(i = 0; i < nimpls; i++) {
+        cur = impls[i];
+        run("boundary", cur->name, len, reps, new_boundary);
+    }
+    run("ifind", "anterior", len, reps, old_ifind);
+    for(i = 0; i < nimpls; i++) {
+        cur = impls[i];
+        run("ifind", cur->name, len, reps, new_ifind);
+    }
+    run("fold", "anterior", linelen, 1 << 20, old_fold);
+    for(i = 0; i < nimpls; i++) {
+        cur = impls[i];
+        run("fold", cur->name, linelen, 1 << 20, new_fold);
+    }
+    run("campos", "anterior", hlen, 1 << 18, old_fields);
+    for(i = 0; i < nimpls; i++) {
+        cur = impls[i];
+        run("campos", cur->name, hlen, 1 << 18, new_fields);
+    }
+
+    free(text);
+    free(line);
+    return 0;
+}
@@ -0,0 +1,838 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+// SORT e THREAD (RFC 5256)
+//
+// As chaves de ordenação de cada mensagem são extraídas do cabeçalho uma
+// única vez, junto com a BODYSTRUCTURE, e ficam no índice da caixa como
+// uma string com um campo por linha (SK_*): o assunto base (sem os "Re:",
+// "Fwd:" e "[lista]"), a caixa do primeiro endereço do From, do To e do
+// Cc, o Message-ID e os Message-IDs do References (ou do In-Reply-To)
+// separados por espaço. O assunto e as caixas ficam em maiúsculas, que é
+// como o RFC os compara. A data do campo Date fica na própria mensagem
+// ('sent'), já no UTC. Com isso o SORT e o THREAD de uma caixa inteira
+// não leem nenhum arquivo
+
+typedef enum {SK_SUBJECT, SK_FROM, SK_TO, SK_CC, SK_ID, SK_REFS, SK_N} sortfield_t;
+
+// Tamanho máximo de cada campo das chaves, a não ser o References, que
+// fica com o resto do espaço e perde as referências mais antigas
+#define SORTFIELD 256
+
+// Campos do cabeçalho de onde saem as chaves
+enum {H_SUBJECT, H_FROM, H_TO, H_CC, H_ID, H_REFS, H_INREPLYTO, H_DATE, H_N};
+char const *const sort_names[H_N] = {"Subject", "From", "To", "Cc", "Message-ID", "References", "In-Reply-To", "Date"};
+
+// Critérios do SORT, cada um podendo ser invertido pelo REVERSE
+typedef enum {SB_ARRIVAL, SB_CC, SB_DATE, SB_FROM, SB_SIZE, SB_SUBJECT, SB_TO} sortby_t;
+#define SORTCRITS 16
+typedef struct {sortby_t by[SORTCRITS]; bool reverse[SORTCRITS]; int n;} sort_t;
+
+// Mensagem ordenada ou agrupada: a posição na caixa, o UID, as datas de
+// entrega e do campo Date, o tamanho, se o assunto é de uma resposta e
+// os campos das chaves, que apontam para 'keys'. 'modseq' é o da
+// mensagem quando ela foi escolhida
+typedef struct {int i; uint32_t uid; int64_t date, sent; int size; uint64_t modseq; bool reply; char *keys, *field[SK_N];} sortmsg_t;
+
+// Tabela de espalhamento de strings, com o valor de cada uma (-1 nas
+// posições livres)
+typedef struct {char const **key; int *val; int n; unsigned mask;} strtab_t;
+
+// Nó das threads: a mensagem (-1 nos nós vazios, de mensagens que só
+// aparecem nas referências), o pai, o primeiro filho e o próximo irmão
+// (-1 se não houver). O nó 0 é a raiz, cujos filhos são as threads
+typedef struct {int msg, parent, child, next;} tnode_t;
+typedef struct {tnode_t *nodes; int n, cap; sortmsg_t const *msgs;} thread_t;
+
+//========================================= FUNÇÕES =========================================
+void sort_keys(msg_t *msg, mime_t const *mime, char const *text, char *keys);
+void sort_end(buf_t *out, size_t start, size_t max);
+void sort_words(buf_t *out, char const *s, size_t len);
+char const *sort_encoded(char const *s, char const *end, buf_t *out);
+void sort_subject(buf_t *out, char const *s, size_t len, bool *reply);
+bool sort_blob(char const *s, size_t len, size_t *n);
+bool sort_refwd(char const *s, size_t len, size_t *n);
+void sort_mailbox(buf_t *out, span_t const *v);
+bool sort_ids(buf_t *out, span_t const *v, bool all);
+bool sort_date(char const *s, size_t len, int64_t *t);
+bool sort_parse(char const *s, sort_t *sort);
+void sort_split(sortmsg_t *m, char const *keys);
+int sort_cmp(void const *a, void const *b, void *sort);
+void sort_free(sortmsg_t *msgs, int n);
+int *strtab_get(strtab_t *tab, char const *key);
+void strtab_free(strtab_t *tab);
+int thread_node(thread_t *t, int msg);
+void thread_link(thread_t *t, int parent, int child);
+void thread_unlink(thread_t *t, int k);
+bool thread_above(thread_t const *t, int a, int b);
+int thread_first(thread_t const *t, int k);
+int thread_cmp(void const *a, void const *b, void *t);
+int *thread_order(thread_t const *t, int *n);
+void thread_sort(thread_t *t);
+void thread_prune(thread_t *t);
+void thread_subjects(thread_t *t);
+void thread_references(thread_t *t, sortmsg_t *msgs, int n);
+void thread_ordered(thread_t *t, sortmsg_t *msgs, int n);
+void thread_write(buf_t *out, thread_t const *t, bool uid);
+
+
+// Extrai do cabeçalho da mensagem, já com a árvore de partes 'mime', as
+// chaves de ordenação para 'keys' (SHAREKEYS bytes) e a data do campo
+// Date para 'msg'. Sem uma data válida vale a de entrega
+void sort_keys(msg_t *msg, mime_t const *mime, char const *text, char *keys) {
+    static simdnames_t names;
+    buf_t out = {NULL, 0, 0};
+    span_t v[H_N];
+    size_t start, room, cut;
+    char *sp;
+
+    if(names.n == 0) simd_names(&names, sort_names, H_N);
+    mime_lookup(mime, 0, text, &names, v);
+
+    msg->reply = false;
+    start = out.len;
+    if(v[H_SUBJECT].s != NULL) sort_subject(&out, v[H_SUBJECT].s, v[H_SUBJECT].len, &msg->reply);
+    sort_end(&out, start, SORTFIELD);
+    start = out.len;
+    if(v[H_FROM].s != NULL) sort_mailbox(&out, &v[H_FROM]);
+    sort_end(&out, start, SORTFIELD);
+    start = out.len;
+    if(v[H_TO].s != NULL) sort_mailbox(&out, &v[H_TO]);
+    sort_end(&out, start, SORTFIELD);
+    start = out.len;
+    if(v[H_CC].s != NULL) sort_mailbox(&out, &v[H_CC]);
+    sort_end(&out, start, SORTFIELD);
+    start = out.len;
+    if(v[H_ID].s != NULL) sort_ids(&out, &v[H_ID], false);
+    sort_end(&out, start, SORTFIELD);
+
+    // Sem References, o In-Reply-To diz quem é o pai
+    start = out.len;
+    if((v[H_REFS].s == NULL || !sort_ids(&out, &v[H_REFS], true)) && v[H_INREPLYTO].s != NULL)
+        sort_ids(&out, &v[H_INREPLYTO], false);
+    room = SHAREKEYS - 1 - start;
+    if(out.len - start > room) {
+        cut = out.len - room;
+        if((sp = memchr(out.data + cut, ' ', out.len - cut)) != NULL) cut = sp - out.data + 1;
+        else cut = out.len;
+        memmove(out.data + start, out.data + cut, out.len - cut);
+        out.len -= cut - start;
+    }
+
+    memcpy(keys, out.data, out.len);
+    keys[out.len] = 0;
+    buf_free(&out);
+
+    if(v[H_DATE].s == NULL || !sort_date(v[H_DATE].s, v[H_DATE].len, &msg->sent))
+        msg->sent = msg->date;
+}
+
+// Termina o campo que começa em 'start', cortando-o em 'max' bytes e
+// trocando os fins de linha que restarem por espaços
+void sort_end(buf_t *out, size_t start, size_t max) {
+    size_t i;
+
+    if(out->len - start > max) out->len = start + max;
+    for(i = start; i < out->len; i++)
+        if(out->data[i] == '\n' || out->data[i] == '\r' || out->data[i] == 0) out->data[i] = ' ';
+    buf_append(out, "\n", 1);
+}
+
+// Escreve em 'out' o texto 's' com as encoded-words (RFC 2047)
+// decodificadas e cada sequência de espaços e controles trocada por um
+// único espaço, sem espaços no começo e no final. O espaço entre duas
+// encoded-words não conta. Os bytes decodificados são mantidos como
+// estão, sem conversão de charset
+void sort_words(buf_t *out, char const *s, size_t len) {
+    buf_t raw = {NULL, 0, 0};
+    char const *end = s + len, *p, *q;
+    size_t space = 0, i;
+    bool encoded = false, blank = false, any = false;
+
+    for(p = s; p < end; ) {
+        if(isspace((unsigned char)*p)) {
+            if(!blank) space = raw.len;
+            buf_append(&raw, " ", 1);
+            blank = true;
+            p++;
+            continue;
+        }
+
+        if(p[0] == '=' && p+1 < end && p[1] == '?') {
+            if(encoded && blank) raw.len = space;
+            if((q = sort_encoded(p, end, &raw)) != NULL) {
+                p = q;
+                encoded = true;
+                blank = false;
+                continue;
+            }
+        }
+
+        buf_append(&raw, p++, 1);
+        encoded = blank = false;
+    }
+
+    for(i = 0, blank = false; i < raw.len; i++) {
+        if((unsigned char)raw.data[i] <= ' ' || raw.data[i] == 0x7f) {
+            blank = true;
+            continue;
+        }
+        if(blank && any) buf_append(out, " ", 1);
+        buf_append(out, &raw.data[i], 1);
+        blank = false;
+        any = true;
+    }
+    buf_free(&raw);
+}
+
+// Decodifica a encoded-word "=?charset?B?texto?=" ou "=?charset?Q?texto?="
+// que começa em 's' para 'out' e retorna o seu fim, ou NULL se ela não
+// for válida
+char const *sort_encoded(char const *s, char const *end, buf_t *out) {
+    char const *p, *text, *stop;
+    char hex[3] = {0, 0, 0}, c, enc;
+
+    for(p = s + 2; p < end && *p != '?' && !isspace((unsigned char)*p); p++);
+    if(p == s + 2 || p + 3 >= end || p[2] != '?') return NULL;
+    enc = toupper((unsigned char)p[1]);
+    if(enc != 'B' && enc != 'Q') return NULL;
+
+    text = p + 3;
+    for(stop = text; stop + 1 < end && !(stop[0] == '?' && stop[1] == '=') && !isspace((unsigned char)*stop); stop++);
+    if(stop + 1 >= end || stop[0] != '?' || stop[1] != '=') return NULL;
+
+    if(enc == 'B') {
+        fti_base64(out, text, stop - text);
+    } else {
+        for(p = text; p < stop; p++) {
+            c = *p;
+            if(c == '_') {
+                c = ' ';
+            } else if(c == '=' && p + 2 < stop && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+                hex[0] = p[1];
+                hex[1] = p[2];
+                c = strtol(hex, NULL, 16);
+                p += 2;
+            }
+            buf_append(out, &c, 1);
+        }
+    }
+
+    return stop + 2;
+}
+
+// Escreve em 'out' o assunto base de 's' (RFC 5256, seção 2.1), em
+// maiúsculas, e marca 'reply' se ele tinha "Re:", "Fwd:" ou "(fwd)"
+void sort_subject(buf_t *out, char const *s, size_t len, bool *reply) {
+    buf_t words = {NULL, 0, 0};
+    char const *p;
+    size_t n, k;
+    bool changed;
+
+    sort_words(&words, s, len);
+    p = words.data;
+    n = words.len;
+
+    for(;;) {
+        // Os "(fwd)" e os espaços do final
+        for(;;) {
+            if(n > 0 && p[n-1] == ' ') {
+                n--;
+            } else if(n >= 5 && !strncasecmp(p + n - 5, "(fwd)", 5)) {
+                n -= 5;
+                *reply = true;
+            } else {
+                break;
+            }
+        }
+
+        // Os "Re:" e "Fwd:" do começo, com os [blobs] antes deles, e um
+        // [blob] que não seja o assunto inteiro
+        do {
+            changed = true;
+            if(n > 0 && p[0] == ' ') {
+                p++;
+                n--;
+            } else if(sort_refwd(p, n, &k)) {
+                p += k;
+                n -= k;
+                *reply = true;
+            } else if(sort_blob(p, n, &k) && k < n) {
+                p += k;
+                n -= k;
+            } else {
+                changed = false;
+            }
+        } while(changed);
+
+        // "[Fwd: assunto]"
+        if(n >= 6 && !strncasecmp(p, "[fwd:", 5) && p[n-1] == ']') {
+            p += 5;
+            n -= 6;
+            *reply = true;
+            continue;
+        }
+        break;
+    }
+
+    if(n > 0) {
+        k = out->len;
+        buf_append(out, p, n);
+        simd.fold(out->data + k, out->data + k, n, true);
+    }
+    buf_free(&words);
+}
+
+// Verifica se 's' começa com um "[blob]" seguido de espaços, cujo
+// tamanho é gravado em 'n'
+bool sort_blob(char const *s, size_t len, size_t *n) {
+    size_t i;
+
+    if(len == 0 || s[0] != '[') return false;
+    for(i = 1; i < len && s[i] != '[' && s[i] != ']'; i++);
+    if(i == len || s[i] != ']') return false;
+    for(i++; i < len && s[i] == ' '; i++);
+
+    *n = i;
+    return true;
+}
+
+// Verifica se 's' começa com um "Re:", "Fw:" ou "Fwd:", talvez com
+// [blobs] antes e um [blob] antes do ':', cujo tamanho é gravado em 'n'
+bool sort_refwd(char const *s, size_t len, size_t *n) {
+    size_t i = 0, b;
+
+    while(sort_blob(s + i, len - i, &b)) i += b;
+    if(i + 2 <= len && !strncasecmp(s + i, "re", 2)) {
+        i += 2;
+    } else if(i + 2 <= len && !strncasecmp(s + i, "fw", 2)) {
+        i += 2;
+        if(i < len && tolower((unsigned char)s[i]) == 'd') i++;
+    } else {
+        return false;
+    }
+    while(i < len && s[i] == ' ') i++;
+    if(sort_blob(s + i, len - i, &b)) i += b;
+    if(i == len || s[i] != ':') return false;
+
+    *n = i + 1;
+    return true;
+}
+
+// Escreve em 'out' a caixa (a parte antes do '@') do primeiro endereço
+// do campo 'v', em maiúsculas
+void sort_mailbox(buf_t *out, span_t const *v) {
+    char const *end = v->s + v->len, *s, *a;
+    span_t dname, box, host;
+    size_t k = out->len;
+
+    for(s = v->s; s < end; s++) {
+        a = mime_skip(s, end);
+        if((s = mime_address(a, end, &dname, &box, &host)) == a || box.len == 0) continue;
+
+        buf_append(out, box.s, box.len);
+        simd.fold(out->data + k, out->data + k, box.len, true);
+        break;
+    }
+}
+
+// Escreve em 'out' o primeiro Message-ID ("<...>") do campo 'v', ou
+// todos separados por espaço se 'all' for verdadeiro, sem os <> e sem
+// espaços. Retorna false se não havia nenhum
+bool sort_ids(buf_t *out, span_t const *v, bool all) {
+    char const *p = v->s, *end = v->s + v->len, *lt, *gt, *q;
+    bool found = false;
+
+    while((lt = memchr(p, '<', end - p)) != NULL && (gt = memchr(lt, '>', end - lt)) != NULL) {
+        p = gt + 1;
+        if(gt == lt + 1) continue;
+
+        if(found) buf_append(out, " ", 1);
+        for(q = lt + 1; q < gt; q++)
+            if(!isspace((unsigned char)*q)) buf_append(out, q, 1);
+        found = true;
+        if(!all) break;
+    }
+
+    return found;
+}
+
+// Lê a data e o horário do campo Date ("Tue, 1 Feb 1994 12:30:00 -0300")
+// de 'len' bytes em 's' para 't', em segundos desde 1970 no UTC.
+// Retorna false se ela for inválida
+bool sort_date(char const *s, size_t len, int64_t *t) {
+    static char const months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    static char const *const zones[] = {"UT", "GMT", "Z", "EST", "EDT", "CST", "CDT", "MST", "MDT", "PST", "PDT"};
+    static int const offsets[] = {0, 0, 0, -5, -4, -6, -5, -7, -6, -8, -7};
+    char date[128], mon[4], zone[8];
+    char const *p, *q;
+    int d, y, h, m, sec = 0, n = 0, off = 0, i;
+
+    snprintf(date, sizeof(date), "%.*s", (int)len, s);
+    p = ((q = strchr(date, ',')) != NULL) ? q + 1 : date;
+    if(sscanf(p, "%d %3[A-Za-z] %d %d:%d%n", &d, mon, &y, &h, &m, &n) != 5) return false;
+    p += n;
+    if(*p == ':' && sscanf(p + 1, "%d%n", &sec, &n) == 1) p += n + 1;
+
+    // O ano pode ter dois dígitos, e a zona pode faltar
+    if(y < 50) y += 2000;
+    else if(y < 1000) y += 1900;
+    if(sscanf(p, " %7[-+A-Za-z0-9]", zone) == 1) {
+        if((zone[0] == '+' || zone[0] == '-') && strlen(zone) == 5 && isdigit((unsigned char)zone[1])) {
+            off = (zone[1]-'0')*600 + (zone[2]-'0')*60 + (zone[3]-'0')*10 + (zone[4]-'0');
+            if(zone[0] == '-') off = -off;
+        } else {
+            for(i = 0; i < (int)(sizeof(zones)/sizeof(zones[0])); i++)
+                if(!strcasecmp(zone, zones[i])) off = offsets[i]*60;
+        }
+    }
+
+    if(strlen(mon) != 3 || (q = strcasestr(months, mon)) == NULL || (q - months) % 3 != 0 ||
+       d < 1 || d > 31 || h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 60)
+        return false;
+
+    *t = (int64_t)civil_day(y, (q - months)/3 + 1, d)*86400 + h*3600 + m*60 + sec - off*60;
+    return true;
+}
+
+// Interpreta a lista de critérios do SORT ("REVERSE DATE SUBJECT").
+// Retorna false se ela for inválida
+bool sort_parse(char const *s, sort_t *sort) {
+    static char const *const names[] = {"ARRIVAL", "CC", "DATE", "FROM", "SIZE", "SUBJECT", "TO"};
+    char word[16];
+    bool reverse = false;
+    int n, i;
+
+    sort->n = 0;
+    while(sscanf(s, " %15s%n", word, &n) == 1) {
+        s += n;
+        if(!strcasecmp(word, "REVERSE")) {
+            if(reverse) return false;
+            reverse = true;
+            continue;
+        }
+
+        for(i = 0; i < (int)(sizeof(names)/sizeof(names[0])) && strcasecmp(word, names[i]); i++);
+        if(i == (int)(sizeof(names)/sizeof(names[0])) || sort->n == SORTCRITS) return false;
+        sort->by[sort->n] = (sortby_t)i;
+        sort->reverse[sort->n++] = reverse;
+        reverse = false;
+    }
+
+    return sort->n > 0 && !reverse;
+}
+
+// Copia as chaves 'keys' para a mensagem e aponta os campos para elas.
+// Os que faltarem ficam vazios
+void sort_split(sortmsg_t *m, char const *keys) {
+    char *p, *nl;
+    int f;
+
+    p = m->keys = strdup(keys);
+    for(f = 0; f < SK_N; f++) {
+        m->field[f] = p;
+        if((nl = strchr(p, '\n')) != NULL) {
+            *nl = 0;
+            p = nl + 1;
+        } else {
+            p += strlen(p);
+        }
+    }
+}
+
+// Compara duas mensagens pelos critérios do SORT, e no empate pela
+// posição na caixa, para o qsort_r
+int sort_cmp(void const *a, void const *b, void *sort) {
+    sortmsg_t const *x = (sortmsg_t const*)a, *y = (sortmsg_t const*)b;
+    sort_t const *s = (sort_t const*)sort;
+    int i, c = 0;
+
+    for(i = 0; i < s->n && c == 0; i++) {
+        switch(s->by[i]) {
+            case SB_ARRIVAL: c = (x->date > y->date) - (x->date < y->date); break;
+            case SB_DATE:    c = (x->sent > y->sent) - (x->sent < y->sent); break;
+            case SB_SIZE:    c = (x->size > y->size) - (x->size < y->size); break;
+            case SB_SUBJECT: c = strcmp(x->field[SK_SUBJECT], y->field[SK_SUBJECT]); break;
+            case SB_FROM:    c = strcmp(x->field[SK_FROM], y->field[SK_FROM]); break;
+            case SB_TO:      c = strcmp(x->field[SK_TO], y->field[SK_TO]); break;
+            case SB_CC:      c = strcmp(x->field[SK_CC], y->field[SK_CC]); break;
+        }
+        if(s->reverse[i]) c = -c;
+    }
+
+    return c ? c : x->i - y->i;
+}
+
+// Libera as chaves das mensagens e o vetor
+void sort_free(sortmsg_t *msgs, int n) {
+    int k;
+
+    for(k = 0; k < n; k++) free(msgs[k].keys);
+    free(msgs);
+}
+
+// Posição do valor da string 'key' na tabela, que é criada com -1 se ela
+// não existir. A string precisa continuar valendo enquanto a tabela for
+// usada
+int *strtab_get(strtab_t *tab, char const *key) {
+    char const **oldkey = tab->key;
+    int *oldval = tab->val;
+    unsigned h, i, size = tab->mask + 1;
+
+    // A tabela dobra quando fica meio cheia
+    if(tab->key == NULL || 2*(tab->n + 1) > (int)size) {
+        size = tab->key ? 2*size : 64;
+        tab->key = (char const**)calloc(size, sizeof(char const*));
+        tab->val = (int*)malloc(size*sizeof(int));
+        tab->mask = size - 1;
+        for(i = 0; oldkey != NULL && i <= (size/2 - 1); i++) {
+            if(oldkey[i] == NULL) continue;
+            for(h = fti_hash(oldkey[i], strlen(oldkey[i])) & tab->mask; tab->key[h] != NULL; h = (h + 1) & tab->mask);
+            tab->key[h] = oldkey[i];
+            tab->val[h] = oldval[i];
+        }
+        free(oldkey);
+        free(oldval);
+    }
+
+    for(h = fti_hash(key, strlen(key)) & tab->mask; tab->key[h] != NULL; h = (h + 1) & tab->mask)
+        if(!strcmp(tab->key[h], key)) return &tab->val[h];
+
+    tab->key[h] = key;
+    tab->val[h] = -1;
+    tab->n++;
+    return &tab->val[h];
+}
+
+void strtab_free(strtab_t *tab) {
+    free(tab->key);
+    free(tab->val);
+}
+
+// Acrescenta um nó solto da mensagem 'msg' e retorna a sua posição
+int thread_node(thread_t *t, int msg) {
+    tnode_t *node;
+
+    if(t->n == t->cap) {
+        t->cap = t->cap ? 2*t->cap : 64;
+        t->nodes = (tnode_t*)realloc(t->nodes, t->cap*sizeof(tnode_t));
+    }
+    node = &t->nodes[t->n];
+    node->msg = msg;
+    node->parent = node->child = node->next = -1;
+
+    return t->n++;
+}
+
+// Põe 'child', que não pode ter pai, entre os filhos de 'parent'
+void thread_link(thread_t *t, int parent, int child) {
+    t->nodes[child].parent = parent;
+    t->nodes[child].next = t->nodes[parent].child;
+    t->nodes[parent].child = child;
+}
+
+// Tira 'k' dos filhos do seu pai
+void thread_unlink(thread_t *t, int k) {
+    int *p;
+
+    for(p = &t->nodes[t->nodes[k].parent].child; *p != k; p = &t->nodes[*p].next);
+    *p = t->nodes[k].next;
+    t->nodes[k].parent = t->nodes[k].next = -1;
+}
+
+// Verifica se 'a' é 'b' ou está acima dele
+bool thread_above(thread_t const *t, int a, int b) {
+    for(; b != -1; b = t->nodes[b].parent)
+        if(b == a) return true;
+    return false;
+}
+
+// Primeiro nó com mensagem a partir de 'k', descendo pelos primeiros
+// filhos dos nós vazios
+int thread_first(thread_t const *t, int k) {
+    while(t->nodes[k].msg == -1 && t->nodes[k].child != -1) k = t->nodes[k].child;
+    return k;
+}
+
+// Compara dois nós pela data do campo Date, e no empate pela posição
+// na caixa. Um nó vazio vale o seu primeiro filho
+int thread_cmp(void const *a, void const *b, void *t) {
+    thread_t const *th = (thread_t const*)t;
+    int x = th->nodes[thread_first(th, *(int const*)a)].msg, y = th->nodes[thread_first(th, *(int const*)b)].msg;
+    sortmsg_t const *mx, *my;
+
+    if(x == -1 || y == -1) return (x != -1) - (y != -1);
+    mx = &th->msgs[x];
+    my = &th->msgs[y];
+    if(mx->sent != my->sent) return (mx->sent > my->sent) - (mx->sent < my->sent);
+    return mx->i - my->i;
+}
+
+// Nós em ordem de largura a partir da raiz, de forma que cada um vem
+// depois do seu pai. O vetor é liberado por quem chamou
+int *thread_order(thread_t const *t, int *n) {
+    int *order = (int*)malloc(t->n*sizeof(int)), head, k;
+
+    order[0] = 0;
+    for(head = 0, *n = 1; head < *n; head++)
+        for(k = t->nodes[order[head]].child; k != -1; k = t->nodes[k].next)
+            order[(*n)++] = k;
+
+    return order;
+}
+
+// Ordena os filhos de cada nó pela data, de baixo para cima, já que um
+// nó vazio vale o seu primeiro filho
+void thread_sort(thread_t *t) {
+    int *order, *kids = NULL, n, m, cap = 0, i, j, k;
+
+    order = thread_order(t, &n);
+    for(i = n - 1; i >= 0; i--) {
+        for(m = 0, k = t->nodes[order[i]].child; k != -1; k = t->nodes[k].next) {
+            if(m == cap) {
+                cap = cap ? 2*cap : 16;
+                kids = (int*)realloc(kids, cap*sizeof(int));
+            }
+            kids[m++] = k;
+        }
+        if(m < 2) continue;
+
+        qsort_r(kids, m, sizeof(int), thread_cmp, t);
+        t->nodes[order[i]].child = kids[0];
+        for(j = 0; j < m; j++) t->nodes[kids[j]].next = (j + 1 < m) ? kids[j+1] : -1;
+    }
+
+    free(kids);
+    free(order);
+}
+
+// Tira os nós vazios sem filhos, e põe os filhos dos outros no lugar
+// deles, a não ser que fossem virar threads junto com outros (RFC
+// 5256, REFERENCES, passo 3). Os filhos são tratados antes dos pais
+void thread_prune(thread_t *t) {
+    int *order, n, i, p, k, next, c, last;
+
+    order = thread_order(t, &n);
+    for(i = n - 1; i >= 0; i--) {
+        p = order[i];
+        k = t->nodes[p].child;
+        t->nodes[p].child = -1;
+        for(; k != -1; k = next) {
+            next = t->nodes[k].next;
+            t->nodes[k].next = -1;
+            c = t->nodes[k].child;
+            if(t->nodes[k].msg != -1 || (c != -1 && p == 0 && t->nodes[c].next != -1)) {
+                t->nodes[k].next = t->nodes[p].child;
+                t->nodes[p].child = k;
+                continue;
+            }
+
+            // Os filhos sobem para o lugar do nó vazio, que some
+            for(last = c; c != -1; c = t->nodes[c].next) {
+                t->nodes[c].parent = p;
+                last = c;
+            }
+            if(last != -1) {
+                t->nodes[last].next = t->nodes[p].child;
+                t->nodes[p].child = t->nodes[k].child;
+            }
+            t->nodes[k].child = t->nodes[k].parent = -1;
+        }
+    }
+
+    free(order);
+}
+
+// Junta as threads de mesmo assunto base (RFC 5256, REFERENCES, passo
+// 5). A tabela guarda, para cada assunto, de preferência um nó vazio, e
+// senão uma mensagem que não seja resposta
+void thread_subjects(thread_t *t) {
+    strtab_t subjects = {NULL, NULL, 0, 0};
+    int *roots, n = 0, i, k, e, d, c, next, *slot;
+    sortmsg_t const *mk, *me;
+
+    for(k = t->nodes[0].child; k != -1; k = t->nodes[k].next) n++;
+    roots = (int*)malloc((n + 1)*sizeof(int));
+    for(n = 0, k = t->nodes[0].child; k != -1; k = t->nodes[k].next) roots[n++] = k;
+
+    for(i = 0; i < n; i++) {
+        k = roots[i];
+        mk = &t->msgs[t->nodes[thread_first(t, k)].msg];
+        if(mk->field[SK_SUBJECT][0] == 0) continue;
+        slot = strtab_get(&subjects, mk->field[SK_SUBJECT]);
+        if((e = *slot) == -1) {
+            *slot = k;
+            continue;
+        }
+        me = &t->msgs[t->nodes[thread_first(t, e)].msg];
+        if((t->nodes[k].msg == -1 && t->nodes[e].msg != -1) ||
+           (t->nodes[e].msg != -1 && t->nodes[k].msg != -1 && me->reply && !mk->reply))
+            *slot = k;
+    }
+
+    for(i = 0; i < n; i++) {
+        k = roots[i];
+        mk = &t->msgs[t->nodes[thread_first(t, k)].msg];
+        if(mk->field[SK_SUBJECT][0] == 0) continue;
+        slot = strtab_get(&subjects, mk->field[SK_SUBJECT]);
+        if((e = *slot) == k) continue;
+        me = &t->msgs[t->nodes[thread_first(t, e)].msg];
+
+        thread_unlink(t, k);
+        if(t->nodes[e].msg == -1 && t->nodes[k].msg == -1) {
+            // Os filhos de um nó vazio passam para o outro
+            for(c = t->nodes[k].child; c != -1; c = next) {
+                next = t->nodes[c].next;
+                t->nodes[c].parent = -1;
+                thread_link(t, e, c);
+            }
+            t->nodes[k].child = -1;
+        } else if(t->nodes[e].msg == -1) {
+            thread_link(t, e, k);
+        } else if(t->nodes[k].msg == -1) {
+            thread_unlink(t, e);
+            thread_link(t, k, e);
+            thread_link(t, 0, k);
+            *slot = k;
+        } else if(!me->reply && mk->reply) {
+            thread_link(t, e, k);
+        } else {
+            // Um nó vazio novo fica com as duas
+            d = thread_node(t, -1);
+            thread_unlink(t, e);
+            thread_link(t, d, e);
+            thread_link(t, d, k);
+            thread_link(t, 0, d);
+            *slot = d;
+        }
+    }
+
+    free(roots);
+    strtab_free(&subjects);
+}
+
+// Monta as threads de 'msgs' pelo algoritmo REFERENCES (RFC 5256): cada
+// mensagem é filha da última das suas referências, e as referências
+// são ligadas em sequência, sem desfazer ligações nem criar ciclos
+void thread_references(thread_t *t, sortmsg_t *msgs, int n) {
+    strtab_t ids = {NULL, NULL, 0, 0};
+    char *ref, *save;
+    int m, k, c, prev, *slot;
+
+    t->msgs = msgs;
+    thread_node(t, -1);
+    for(m = 0; m < n; m++) {
+        // Uma mensagem sem Message-ID ou com um repetido fica sozinha
+        k = -1;
+        if(msgs[m].field[SK_ID][0] != 0) {
+            slot = strtab_get(&ids, msgs[m].field[SK_ID]);
+            if(*slot == -1) *slot = thread_node(t, -1);
+            k = *slot;
+        }
+        if(k == -1 || t->nodes[k].msg != -1) k = thread_node(t, -1);
+        t->nodes[k].msg = m;
+
+        prev = -1;
+        for(ref = strtok_r(msgs[m].field[SK_REFS], " ", &save); ref != NULL; ref = strtok_r(NULL, " ", &save)) {
+            slot = strtab_get(&ids, ref);
+            if(*slot == -1) *slot = thread_node(t, -1);
+            c = *slot;
+            if(prev != -1 && t->nodes[c].parent == -1 && !thread_above(t, c, prev)) thread_link(t, prev, c);
+            prev = c;
+        }
+
+        // A última referência é a mãe, se isso não criar um ciclo
+        if(prev != -1 && !thread_above(t, k, prev)) {
+            if(t->nodes[k].parent != -1) thread_unlink(t, k);
+            thread_link(t, prev, k);
+        }
+    }
+
+    for(k = 1; k < t->n; k++)
+        if(t->nodes[k].parent == -1) thread_link(t, 0, k);
+
+    thread_prune(t);
+    thread_sort(t);
+    thread_subjects(t);
+    thread_sort(t);
+    strtab_free(&ids);
+}
+
+// Monta as threads de 'msgs', que são reordenadas, pelo algoritmo
+// ORDEREDSUBJECT (RFC 5256): as mensagens de mesmo assunto base formam
+// uma thread, em que a mais antiga é a mãe de todas as outras
+void thread_ordered(thread_t *t, sortmsg_t *msgs, int n) {
+    static sort_t const bysubject = {{SB_SUBJECT, SB_DATE}, {false, false}, 2};
+    int m, k, parent = -1;
+
+    qsort_r(msgs, n, sizeof(sortmsg_t), sort_cmp, (void*)&bysubject);
+
+    t->msgs = msgs;
+    thread_node(t, -1);
+    for(m = 0; m < n; m++) {
+        k = thread_node(t, m);
+        if(m == 0 || strcmp(msgs[m].field[SK_SUBJECT], msgs[m-1].field[SK_SUBJECT])) {
+            thread_link(t, 0, k);
+            parent = k;
+        } else {
+            thread_link(t, parent, k);
+        }
+    }
+
+    thread_sort(t);
+}
+
+// Escreve as threads como na resposta do THREAD: "(1 2 (3)(4 5))" é a
+// mensagem 1, com a 2 como filha, que tem como filhas a 3 e a 4, que tem
+// a 5. Um nó vazio não aparece, só os seus filhos
+void thread_write(buf_t *out, thread_t const *t, bool uid) {
+    int *stack = (int*)malloc(t->n*sizeof(int)), top, r, k, c;
+    sortmsg_t const *m;
+    char num[16];
+    bool first;
+
+    for(r = t->nodes[0].child; r != -1; r = t->nodes[r].next) {
+        buf_append(out, "(", 1);
+        top = 0;
+        k = r;
+        first = true;
+        for(;;) {
+            if(t->nodes[k].msg != -1) {
+                m = &t->msgs[t->nodes[k].msg];
+                sprintf(num, first ? "%u" : " %u", uid ? m->uid : (uint32_t)m->i + 1);
+                buf_append(out, num, strlen(num));
+                first = false;
+            }
+
+            // Um filho só continua a lista; mais de um abre uma para cada
+            c = t->nodes[k].child;
+            if(c != -1 && t->nodes[c].next == -1) {
+                k = c;
+                continue;
+            }
+            if(c != -1) {
+                buf_append(out, first ? "(" : " (", first ? 1 : 2);
+                stack[top++] = t->nodes[c].next;
+                k = c;
+                first = true;
+                continue;
+            }
+
+            // Fecha as listas terminadas e abre a do próximo irmão
+            while(top > 0 && (c = stack[--top]) == -1) buf_append(out, ")", 1);
+            if(c == -1 || top < 0) break;
+            buf_append(out, ")(", 2);
+            stack[top++] = t->nodes[c].next;
+            k = c;
+            first = true;
+        }
+        buf_append(out, ")", 1);
+    }
+
+    free(stack);
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Interface mínima para o io_uring, usando as chamadas de sistema
+// diretamente (sem a liburing)
+
+// Um anel de submissão (SQ) e um de conclusão (CQ), compartilhados
+// com o kernel
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, queued;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} uring_t;
+
+//========================================= FUNÇÕES =========================================
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+struct io_uring_sqe *uring_sqe(uring_t *ring, int op, int fd, void *addr, unsigned len, unsigned long long off, unsigned long long data);
+int uring_submit(uring_t *ring, unsigned wait);
+struct io_uring_cqe *uring_cqe(uring_t *ring);
+void uring_seen(uring_t *ring);
+
+
+// Cria um anel com 'entries' posições de submissão.
+// Retorna -1 se o kernel não suportar io_uring
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(uring_t));
+    memset(&p, 0, sizeof(p));
+    if((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    // Mapeia os dois anéis e o vetor de submissões
+    ring->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+
+    ring->sq_head  = (unsigned*)((char*)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail  = (unsigned*)((char*)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((char*)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head  = (unsigned*)((char*)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail  = (unsigned*)((char*)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask  = (unsigned*)((char*)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)((char*)ring->cq_ptr + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+
+    return 0;
+}
+
+// Libera o anel
+void uring_exit(uring_t *ring) {
+    if(ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// Enfileira uma operação 'op' sobre 'fd', que só é enviada ao kernel
+// no próximo uring_submit. Se o anel estiver cheio, as operações
+// pendentes são enviadas antes
+struct io_uring_sqe *uring_sqe(uring_t *ring, int op, int fd, void *addr, unsigned len, unsigned long long off, unsigned long long data) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *ring->sq_tail;
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        uring_submit(ring, 0);
+        if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            return NULL;
+    }
+
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+    ring->queued++;
+
+    return sqe;
+}
+
+// Envia todas as operações enfileiradas em uma única chamada de sistema,
+// esperando até que 'wait' delas tenham terminado
+int uring_submit(uring_t *ring, unsigned wait) {
+    int n;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    do {
+        n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, flags, NULL, 0);
+    } while(n < 0 && errno == EINTR);
+
+    if(n > 0) ring->queued -= n;
+    return n;
+}
+
+// Retorna a próxima operação concluída, ou NULL se não houver nenhuma
+struct io_uring_cqe *uring_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Libera a posição da operação concluída retornada por uring_cqe
+void uring_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head+1, __ATOMIC_RELEASE);
+}
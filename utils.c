@@ -1,44 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 // Transforma todas as letras da string 's' em maiúsculas
 char* uppercase(char *s) {
-    int i;
-    char c;
-
-    for(i = 0; i < (int)strlen(s); i++) {
-        c = s[i];
-        if(isalpha(c)){
-            s[i] = toupper(c);
-        }
-    }
-
+    simd.fold(s, s, strlen(s), true);
     return s;
 }
 
 // Remove whitespace no começo e no final da string 'src'
 // gravando o resultado em 'dest'
 void trim(char *dest, char *src) {
-    int i, j, k;
-    char ws[6] = " \r\n\t";
+    int i, j, len = strlen(src);
 
-    strcpy(ws, " \r\n\t");
     // Encontra o primeiro whitespace à direita
-    for(j = strlen(src)-1; j >=0; j--)
-        if(strchr(ws, src[j]) == NULL) break;
+    for(j = len-1; j >= 0; j--)
+        if(strchr(" \r\n\t", src[j]) == NULL) break;
 
     // Encontra o último à esquerda
-    for(i = 0; i < (int)strlen(src); i++)
-        if(strchr(ws, src[i]) == NULL) break;
+    for(i = 0; i < j; i++)
+        if(strchr(" \r\n\t", src[i]) == NULL) break;
 
     // Copia os elementos entre eles
-    for(k = 0; k+i <= j; k++)
-        dest[k] = src[k + i];
-
-    dest[k] = 0;
+    memmove(dest, src + i, j - i + 1);
+    dest[j - i + 1] = 0;
 }
 
 // Copia todos os caracteres da string 'src' entre os delimitadores
@@ -82,3 +76,364 @@ void unquote(char *dest, char *src, char l, char r) {
     strcpy(dest, s);
     free(s);
 }
+
+// Dias desde 1/1/1970 até a data 'y'-'m'-'d' do calendário gregoriano
+long civil_day(int y, int m, int d) {
+    long era, yoe, doy, doe;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399)/400;
+    yoe = y - era*400;
+    doy = (153*(m > 2 ? m - 3 : m + 9) + 2)/5 + d - 1;
+    doe = yoe*365 + yoe/4 - yoe/100 + doy;
+
+    return era*146097 + doe - 719468;
+}
+
+// Buffer de bytes que cresce conforme necessário
+typedef struct {char *data; size_t len, cap;} buf_t;
+
+// Garante espaço para pelo menos 'len' bytes além dos já armazenados
+void buf_reserve(buf_t *buf, size_t len) {
+    if(buf->len + len > buf->cap) {
+        buf->cap = 2*(buf->len + len);
+        buf->data = (char*)realloc(buf->data, buf->cap);
+    }
+}
+
+// Adiciona 'len' bytes de 'data' ao final do buffer
+void buf_append(buf_t *buf, char const *data, size_t len) {
+    buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Libera a memória do buffer
+void buf_free(buf_t *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+}
+
+// Intervalo fechado [lo, hi] de números
+typedef struct {uint32_t lo, hi;} range_t;
+
+// Conjunto de números (o sequence-set do IMAP, como "1:100,205,300:*")
+// guardado como intervalos em ordem crescente, sem sobreposições e sem
+// intervalos vizinhos
+typedef struct {range_t *r; int n, cap;} set_t;
+
+// Lê um número do conjunto em 's' para 'num', com o '*' valendo 'star'.
+// Retorna o que vem depois dele, ou NULL se não houver um número válido
+char const *set_num(char const *s, uint32_t star, uint32_t *num) {
+    unsigned long n;
+    char *end;
+
+    if(*s == '*') {
+        *num = star;
+        return s+1;
+    }
+    if(!isdigit((unsigned char)*s)) return NULL;
+
+    errno = 0;
+    n = strtoul(s, &end, 10);
+    if(errno != 0 || n == 0 || n > UINT32_MAX) return NULL;
+
+    *num = n;
+    return end;
+}
+
+// Compara dois UIDs, para o qsort
+int uid_cmp(void const *a, void const *b) {
+    uint32_t x = *(uint32_t const*)a, y = *(uint32_t const*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Compara dois intervalos pelo começo, para o qsort
+int range_cmp(void const *a, void const *b) {
+    uint32_t x = ((range_t const*)a)->lo, y = ((range_t const*)b)->lo;
+
+    return (x > y) - (x < y);
+}
+
+// Lê o conjunto 's' para 'set', com o '*' valendo 'star' (o maior
+// número em uso). Os intervalos são ordenados e os que se sobrepõem ou
+// se tocam viram um só. Retorna false se o conjunto for inválido
+bool set_parse(set_t *set, char const *s, uint32_t star) {
+    range_t r;
+    uint32_t t;
+    bool sorted = true;
+    int i, n;
+
+    set->n = 0;
+    for(;;) {
+        if((s = set_num(s, star, &r.lo)) == NULL) return false;
+        r.hi = r.lo;
+        if(*s == ':' && (s = set_num(s+1, star, &r.hi)) == NULL) return false;
+
+        // "5:2" é o mesmo que "2:5"
+        if(r.lo > r.hi) {
+            t = r.lo;
+            r.lo = r.hi;
+            r.hi = t;
+        }
+
+        if(set->n == set->cap) {
+            set->cap = set->cap ? 2*set->cap : 8;
+            set->r = (range_t*)realloc(set->r, set->cap*sizeof(range_t));
+        }
+        if(set->n > 0 && r.lo < set->r[set->n-1].lo) sorted = false;
+        set->r[set->n++] = r;
+
+        if(*s != ',') break;
+        s++;
+    }
+    if(*s != 0) return false;
+
+    // Os clientes quase sempre mandam os intervalos em ordem
+    if(!sorted) qsort(set->r, set->n, sizeof(range_t), range_cmp);
+
+    for(i = n = 1; i < set->n; i++) {
+        if((uint64_t)set->r[i].lo <= (uint64_t)set->r[n-1].hi + 1) {
+            if(set->r[i].hi > set->r[n-1].hi) set->r[n-1].hi = set->r[i].hi;
+        } else {
+            set->r[n++] = set->r[i];
+        }
+    }
+    set->n = n;
+
+    return true;
+}
+
+// Acrescenta 'num' ao conjunto, que precisa ser maior que todos os
+// números que ele já tem
+void set_add(set_t *set, uint32_t num) {
+    if(set->n > 0 && set->r[set->n-1].hi + 1 == num) {
+        set->r[set->n-1].hi = num;
+        return;
+    }
+
+    if(set->n == set->cap) {
+        set->cap = set->cap ? 2*set->cap : 8;
+        set->r = (range_t*)realloc(set->r, set->cap*sizeof(range_t));
+    }
+    set->r[set->n].lo = set->r[set->n].hi = num;
+    set->n++;
+}
+
+// Acrescenta o intervalo [lo, hi] ao conjunto, que precisa estar depois
+// de todos os números que ele já tem
+void set_range(set_t *set, uint32_t lo, uint32_t hi) {
+    if(set->n > 0 && set->r[set->n-1].hi + 1 == lo) {
+        set->r[set->n-1].hi = hi;
+        return;
+    }
+
+    if(set->n == set->cap) {
+        set->cap = set->cap ? 2*set->cap : 8;
+        set->r = (range_t*)realloc(set->r, set->cap*sizeof(range_t));
+    }
+    set->r[set->n].lo = lo;
+    set->r[set->n].hi = hi;
+    set->n++;
+}
+
+// Escreve o conjunto em 'out' como um sequence-set ("1:3,5")
+void set_write(buf_t *out, set_t const *set) {
+    char num[32];
+    int i;
+
+    for(i = 0; i < set->n; i++) {
+        if(set->r[i].lo == set->r[i].hi) sprintf(num, i ? ",%u" : "%u", set->r[i].lo);
+        else sprintf(num, i ? ",%u:%u" : "%u:%u", set->r[i].lo, set->r[i].hi);
+        buf_append(out, num, strlen(num));
+    }
+}
+
+// Verifica se 'num' está no conjunto, por busca binária
+bool set_has(set_t const *set, uint32_t num) {
+    int lo = 0, hi = set->n, mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if(set->r[mid].hi < num) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo < set->n && set->r[lo].lo <= num;
+}
+
+// Libera a memória do conjunto
+void set_free(set_t *set) {
+    free(set->r);
+    set->r = NULL;
+    set->n = set->cap = 0;
+}
+
+// Trecho de uma string, que não precisa terminar em '\0'. Nos argumentos
+// de um comando, 'kind' é o delimitador de onde ele veio ('"', '(' ou
+// '{'), ou 0 para um átomo
+typedef struct {char *s; int len; char kind;} slice_t;
+
+// Fila de saída: trechos copiados para 'buf' intercalados com
+// referências a dados que continuam na memória até serem enviados
+// (como o texto das mensagens) e com arquivos abertos. Os trechos em
+// memória pendentes são enviados juntos por uma única chamada
+// writev/sendmsg, e os arquivos com sendfile. Um trecho 'map' é um
+// arquivo mapeado na memória, desmapeado depois de enviado
+typedef struct {char const *ref; int fd; bool map; size_t off, len;} seg_t;
+typedef struct {buf_t buf; seg_t *segs; int nsegs, cap, first, refs; size_t len, sent, skip;} outq_t;
+
+// Trechos menores que isso são sempre copiados
+#define OUTCOPY 1024
+
+// Adiciona um trecho ao final da fila
+seg_t *out_seg(outq_t *q, char const *ref, size_t off, size_t len) {
+    seg_t *seg;
+
+    if(q->nsegs == q->cap) {
+        q->cap = q->cap ? 2*q->cap : 16;
+        q->segs = (seg_t*)realloc(q->segs, q->cap*sizeof(seg_t));
+    }
+    seg = &q->segs[q->nsegs++];
+    seg->ref = ref;
+    seg->fd = -1;
+    seg->map = false;
+    seg->off = off;
+    seg->len = len;
+    q->len += len;
+
+    return seg;
+}
+
+// Libera o arquivo de um trecho
+void out_release(seg_t *seg) {
+    if(seg->fd >= 0) close(seg->fd);
+    if(seg->map) munmap((void*)seg->ref, seg->len);
+}
+
+// Passa a enviar os 'len' bytes já escritos depois do final de 'buf',
+// continuando o último trecho se ele também estiver em 'buf'
+void out_commit(outq_t *q, size_t len) {
+    if(len == 0) return;
+
+    if(q->nsegs > q->first && q->segs[q->nsegs-1].ref == NULL && q->segs[q->nsegs-1].fd < 0) {
+        q->segs[q->nsegs-1].len += len;
+        q->len += len;
+    } else {
+        out_seg(q, NULL, q->buf.len, len);
+    }
+    q->buf.len += len;
+}
+
+// Copia 'len' bytes de 'data' para o final da fila
+void out_copy(outq_t *q, char const *data, size_t len) {
+    buf_reserve(&q->buf, len);
+    memcpy(q->buf.data + q->buf.len, data, len);
+    out_commit(q, len);
+}
+
+// Adiciona os 'len' bytes de 'data' à fila sem copiá-los. Eles
+// precisam continuar válidos até serem enviados
+void out_ref(outq_t *q, char const *data, size_t len) {
+    if(len < OUTCOPY) {
+        out_copy(q, data, len);
+    } else {
+        out_seg(q, data, 0, len);
+        q->refs++;
+    }
+}
+
+// Adiciona à fila os 'len' primeiros bytes do arquivo aberto 'fd', que
+// é fechado depois de enviado. Com 'map' o arquivo é mapeado na memória
+// para ser enviado junto com os outros trechos, senão ele é enviado
+// direto do cache de páginas com out_sendfile
+void out_file(outq_t *q, int fd, size_t len, bool map) {
+    void *data;
+    ssize_t n;
+    size_t k;
+
+    if(len == 0) {
+        close(fd);
+    } else if(!map) {
+        out_seg(q, NULL, 0, len)->fd = fd;
+    } else if((data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        out_seg(q, (char*)data, 0, len)->map = true;
+        close(fd);
+    } else {
+        // Sem o mapeamento o arquivo é copiado, completando com espaços
+        // se ele encolheu para não quebrar o tamanho do literal
+        buf_reserve(&q->buf, len);
+        for(k = 0; k < len; k += n)
+            if((n = pread(fd, q->buf.data + q->buf.len + k, len - k, k)) <= 0) break;
+        memset(q->buf.data + q->buf.len + k, ' ', len - k);
+        out_commit(q, len);
+        close(fd);
+    }
+}
+
+// Preenche 'iov' com até 'max' trechos em memória ainda não enviados,
+// parando no próximo arquivo, e retorna quantos foram preenchidos
+int out_iov(outq_t *q, struct iovec *iov, int max) {
+    int i, n = 0;
+    size_t skip = q->skip;
+    seg_t *seg;
+
+    for(i = q->first; i < q->nsegs && n < max; i++) {
+        seg = &q->segs[i];
+        if(seg->fd >= 0) break;
+        iov[n].iov_base = (char*)(seg->ref ? seg->ref : q->buf.data + seg->off) + skip;
+        iov[n].iov_len = seg->len - skip;
+        skip = 0;
+        n++;
+    }
+
+    return n;
+}
+
+// Marca 'n' bytes como enviados. Quando tudo foi enviado a fila
+// volta a ficar vazia
+void out_sent(outq_t *q, size_t n) {
+    q->sent += n;
+    n += q->skip;
+    while(q->first < q->nsegs && n >= q->segs[q->first].len) {
+        n -= q->segs[q->first].len;
+        if(q->segs[q->first].ref && !q->segs[q->first].map) q->refs--;
+        out_release(&q->segs[q->first]);
+        q->first++;
+    }
+    q->skip = n;
+
+    if(q->sent == q->len) {
+        q->nsegs = q->first = q->refs = 0;
+        q->len = q->sent = q->skip = 0;
+        q->buf.len = 0;
+    }
+}
+
+// Envia o que for possível do arquivo no início da fila para o
+// socket 'sock'. Retorna quantos bytes foram enviados, ou -1 com erro
+// (inclusive se o arquivo terminou antes do esperado)
+ssize_t out_sendfile(outq_t *q, int sock) {
+    seg_t *seg = &q->segs[q->first];
+    off_t off = seg->off + q->skip;
+    ssize_t n;
+
+    if((n = sendfile(sock, seg->fd, &off, seg->len - q->skip)) == 0) {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+// Libera a memória da fila
+void out_free(outq_t *q) {
+    int i;
+
+    for(i = q->first; i < q->nsegs; i++)
+        out_release(&q->segs[i]);
+    buf_free(&q->buf);
+    free(q->segs);
+    memset(q, 0, sizeof(outq_t));
+}